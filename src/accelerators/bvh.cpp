@@ -3,9 +3,29 @@
 #include "memory.h"
 #include "parallel.h"
 #include "geometry.h"
+#include "api.h"
+#include "error.h"
+#include "fileutil.h"
+#include "port.h"
+#include "stats.h"
+#include "../shapes/triangle.h"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <new>
+#include <set>
+#include <type_traits>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 namespace pbrt {
 
@@ -38,6 +58,8 @@ struct BVHBuildNode {
   Bounds3f bounds;
   BVHBuildNode *children[2];
   int splitAxis, firstPrimOffset, nPrimitives;
+  // SAH cost of the subtree; only maintained by treelet restructuring.
+  Float cost;
 };
 
 struct LinearBVHNode {
@@ -48,18 +70,471 @@ struct LinearBVHNode {
   };
   uint16_t nPrimitives;     // 0 -> interior node
   uint8_t axis;             // interior node: xyz
-  uint8_t pad[1];           // ensure 32 byte local size
+  uint8_t occluderChild;    // interior node: child any-hit rays visit first (0/1)
+};
+
+// Four children per node with bounds stored per axis across children (SoA) so one
+// SIMD slab test covers all of them. Empty slots have inverted (empty) bounds and
+// never hit. A child is a leaf when nPrimitives[i] > 0, in which case child[i] is
+// its primitive offset; otherwise child[i] indexes wideNodes (-1 for an empty slot).
+struct alignas(16) WideBVHNode {
+  float bMin[3][4], bMax[3][4];
+  int32_t child[4];
+  int32_t nPrimitives[4];
+};
+
+// Binary node in the same depth-first order as LinearBVHNode, but with both
+// children's boxes stored as 8-bit offsets into this node's own box. The decoded
+// box of a node is the frame for decoding its children, so traversal carries it
+// down from the full-precision root bounds.
+struct QuantizedBVHNode {
+  uint8_t qMin[2][3], qMax[2][3];
+  uint16_t nPrimitives;     // 0 -> interior node
+  uint8_t axis;             // interior node: xyz
+  uint8_t occluderChild;    // interior node: as in LinearBVHNode
+  int32_t offset;           // leaf: primitiveOffset, interior: secondChildOffset
+};
+
+// <decode a quantized box relative to frame>
+// Conservativeness comes from EncodeQuantizedBounds checking containment against
+// this exact function, so build and traversal must both go through it.
+inline Bounds3f DecodeQuantizedBounds(const Bounds3f& frame,
+    const uint8_t qMin[3], const uint8_t qMax[3]) {
+  Bounds3f b;
+  for (int a = 0; a < 3; ++a) {
+    Float scale = (frame.pMax[a] - frame.pMin[a])*(1.f/255);
+    b.pMin[a] = (qMin[a] == 0) ? frame.pMin[a] : frame.pMin[a] + qMin[a]*scale;
+    b.pMax[a] = (qMax[a] == 255) ? frame.pMax[a] : frame.pMin[a] + qMax[a]*scale;
+  }
+  return b;
+}
+
+// <quantize b relative to frame so that the decoded box always contains b>
+inline void EncodeQuantizedBounds(const Bounds3f& frame, const Bounds3f& b,
+    uint8_t qMin[3], uint8_t qMax[3]) {
+  for (int a = 0; a < 3; ++a) {
+    Float extent = frame.pMax[a] - frame.pMin[a];
+    Float invScale = extent > 0 ? 255/extent : 0;
+    qMin[a] = Clamp((int)std::floor((b.pMin[a] - frame.pMin[a])*invScale), 0, 255);
+    qMax[a] = Clamp((int)std::ceil((b.pMax[a] - frame.pMin[a])*invScale), 0, 255);
+    // <step outwards if rounding in the encode/decode pair lost containment>
+    while (qMin[a] > 0 && DecodeQuantizedBounds(frame, qMin, qMax).pMin[a] > b.pMin[a]) {
+      --qMin[a];
+    }
+    while (qMax[a] < 255 && DecodeQuantizedBounds(frame, qMin, qMax).pMax[a] < b.pMax[a]) {
+      ++qMax[a];
+    }
+  }
+}
+
+// <entry on the binary traversal stack: a node and the ray's entry distance into it>
+struct BVHStackEntry {
+  int nodeIndex;
+  Float tEntry;
+};
+
+// <entry on the wide traversal stack: a child reference and its entry distance>
+struct WideStackEntry {
+  int32_t child, nPrimitives;
+  float tNear;
+};
+
+// <slab test ray against the four children of node; returns hit mask and entry distances>
+inline int IntersectWideNode(const WideBVHNode& node, const float org[3], const float invDir[3],
+    const int dirIsNeg[3], float tMax, float tNear[4]) {
+  const float robust = 1 + 2*gamma(3);
+#ifdef __SSE__
+  __m128 t0 = _mm_setzero_ps();
+  __m128 t1 = _mm_set1_ps(tMax);
+  for (int a = 0; a < 3; ++a) {
+    __m128 o = _mm_set1_ps(org[a]);
+    __m128 inv = _mm_set1_ps(invDir[a]);
+    const float *nearPlane = dirIsNeg[a] ? node.bMax[a] : node.bMin[a];
+    const float *farPlane = dirIsNeg[a] ? node.bMin[a] : node.bMax[a];
+    __m128 tNearA = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearPlane), o), inv);
+    __m128 tFarA = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farPlane), o), inv),
+        _mm_set1_ps(robust));
+    // <operand order keeps t0/t1 when a NaN slab distance (0*inf) shows up>
+    t0 = _mm_max_ps(tNearA, t0);
+    t1 = _mm_min_ps(tFarA, t1);
+  }
+  _mm_storeu_ps(tNear, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  int mask = 0;
+  for (int i = 0; i < 4; ++i) {
+    float t0 = 0, t1 = tMax;
+    for (int a = 0; a < 3; ++a) {
+      float nearPlane = dirIsNeg[a] ? node.bMax[a][i] : node.bMin[a][i];
+      float farPlane = dirIsNeg[a] ? node.bMin[a][i] : node.bMax[a][i];
+      t0 = std::max(t0, (nearPlane - org[a])*invDir[a]);
+      t1 = std::min(t1, (farPlane - org[a])*invDir[a]*robust);
+    }
+    tNear[i] = t0;
+    if (t0 <= t1) mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+// Up to four triangles of one leaf with their world space vertices stored per
+// vertex and axis across lanes (SoA). Padding lanes have primitive == -1.
+struct alignas(16) TriangleQuad {
+  float p[3][3][4];         // [vertex][axis][lane]
+  int32_t primitive[4];     // index into primitives
+};
+
+// <per-ray constants of the watertight triangle test>
+struct TriangleRay {
+  explicit TriangleRay(const Ray& ray) {
+    kz = MaxDimension(Abs(ray.d));
+    kx = kz + 1; if (kx == 3) kx = 0;
+    ky = kx + 1; if (ky == 3) ky = 0;
+    Vector3f d = Permute(ray.d, kx, ky, kz);
+    Sx = -d.x/d.z;
+    Sy = -d.y/d.z;
+    Sz = 1.f/d.z;
+  }
+  int kx, ky, kz;
+  Float Sx, Sy, Sz;
+};
+
+// <intersect ray with the triangles of quad; returns hit mask and distances>
+// The SIMD path performs exactly the floating point operations of
+// IntersectTriangle(), in the same order, so both accept the same triangles at
+// the same t. Lanes that need its double precision edge fallback go through
+// IntersectTriangle() itself.
+inline int IntersectTriangleQuad(const TriangleQuad& quad, const Ray& ray,
+    const TriangleRay& r, Float tHit[4]) {
+  int valid = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (quad.primitive[i] >= 0) valid |= 1 << i;
+  }
+#if defined(__SSE__) && !defined(PBRT_FLOAT_AS_DOUBLE)
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 signMask = _mm_set1_ps(-0.f);
+  auto absPs = [&](__m128 v) { return _mm_andnot_ps(signMask, v); };
+
+  // <translate, permute and shear the vertices of all four triangles>
+  __m128 Sx = _mm_set1_ps(r.Sx), Sy = _mm_set1_ps(r.Sy), Sz = _mm_set1_ps(r.Sz);
+  __m128 x[3], y[3], z[3];
+  for (int v = 0; v < 3; ++v) {
+    x[v] = _mm_sub_ps(_mm_load_ps(quad.p[v][r.kx]), _mm_set1_ps(ray.o[r.kx]));
+    y[v] = _mm_sub_ps(_mm_load_ps(quad.p[v][r.ky]), _mm_set1_ps(ray.o[r.ky]));
+    z[v] = _mm_sub_ps(_mm_load_ps(quad.p[v][r.kz]), _mm_set1_ps(ray.o[r.kz]));
+    x[v] = _mm_add_ps(x[v], _mm_mul_ps(Sx, z[v]));
+    y[v] = _mm_add_ps(y[v], _mm_mul_ps(Sy, z[v]));
+  }
+
+  // <compute edge function coefficients>
+  __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[1], y[2]), _mm_mul_ps(y[1], x[2]));
+  __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[2], y[0]), _mm_mul_ps(y[2], x[0]));
+  __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[0], y[1]), _mm_mul_ps(y[0], x[1]));
+  int onEdge = valid & _mm_movemask_ps(_mm_or_ps(_mm_or_ps(
+      _mm_cmpeq_ps(e0, zero), _mm_cmpeq_ps(e1, zero)), _mm_cmpeq_ps(e2, zero)));
+
+  // <perform triangle edge and determinant tests>
+  __m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)),
+      _mm_cmplt_ps(e2, zero));
+  __m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)),
+      _mm_cmpgt_ps(e2, zero));
+  __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+  __m128 reject = _mm_or_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpeq_ps(det, zero));
+
+  // <compute scaled hit distance to triangle and test against ray t range>
+  for (int v = 0; v < 3; ++v) {
+    z[v] = _mm_mul_ps(z[v], Sz);
+  }
+  __m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])),
+      _mm_mul_ps(e2, z[2]));
+  __m128 tMaxDet = _mm_mul_ps(_mm_set1_ps(ray.tMax), det);
+  reject = _mm_or_ps(reject, _mm_and_ps(_mm_cmplt_ps(det, zero),
+      _mm_or_ps(_mm_cmpge_ps(tScaled, zero), _mm_cmplt_ps(tScaled, tMaxDet))));
+  reject = _mm_or_ps(reject, _mm_and_ps(_mm_cmpgt_ps(det, zero),
+      _mm_or_ps(_mm_cmple_ps(tScaled, zero), _mm_cmpgt_ps(tScaled, tMaxDet))));
+
+  // <compute t and check it against the conservative error bound>
+  __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+  __m128 t = _mm_mul_ps(tScaled, invDet);
+  __m128 maxZt = _mm_max_ps(_mm_max_ps(absPs(z[0]), absPs(z[1])), absPs(z[2]));
+  __m128 maxXt = _mm_max_ps(_mm_max_ps(absPs(x[0]), absPs(x[1])), absPs(x[2]));
+  __m128 maxYt = _mm_max_ps(_mm_max_ps(absPs(y[0]), absPs(y[1])), absPs(y[2]));
+  __m128 deltaZ = _mm_mul_ps(_mm_set1_ps(gamma(3)), maxZt);
+  __m128 deltaX = _mm_mul_ps(_mm_set1_ps(gamma(5)), _mm_add_ps(maxXt, maxZt));
+  __m128 deltaY = _mm_mul_ps(_mm_set1_ps(gamma(5)), _mm_add_ps(maxYt, maxZt));
+  __m128 deltaE = _mm_mul_ps(_mm_set1_ps(2.f), _mm_add_ps(_mm_add_ps(
+      _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(gamma(2)), maxXt), maxYt),
+      _mm_mul_ps(deltaY, maxXt)), _mm_mul_ps(deltaX, maxYt)));
+  __m128 maxE = _mm_max_ps(_mm_max_ps(absPs(e0), absPs(e1)), absPs(e2));
+  __m128 deltaT = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(3.f), _mm_add_ps(_mm_add_ps(
+      _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(gamma(3)), maxE), maxZt),
+      _mm_mul_ps(deltaE, maxZt)), _mm_mul_ps(deltaZ, maxE))), absPs(invDet));
+  reject = _mm_or_ps(reject, _mm_cmple_ps(t, deltaT));
+
+  _mm_storeu_ps(tHit, t);
+  int mask = valid & ~onEdge & ~_mm_movemask_ps(reject);
+  int scalarLanes = onEdge;
+#else
+  int mask = 0;
+  int scalarLanes = valid;
+#endif
+  // <run the scalar test on lanes the SIMD path could not decide>
+  for (int i = 0; i < 4; ++i) {
+    if (scalarLanes & (1 << i)) {
+      Point3f p[3];
+      for (int v = 0; v < 3; ++v) {
+        p[v] = Point3f(quad.p[v][0][i], quad.p[v][1][i], quad.p[v][2][i]);
+      }
+      Float b[3];
+      if (IntersectTriangle(p[0], p[1], p[2], ray, &tHit[i], b)) mask |= 1 << i;
+    }
+  }
+  return mask;
+}
+
+// <intersects the primitives of BVH leaves on behalf of one traversal>
+// Leaves made only of triangles are tested from their packed quads; the closest
+// of those hits is only remembered, and the GeometricPrimitive is asked for the
+// full SurfaceInteraction once, in Finish(), after traversal is done.
+// It also counts the nodes the traversal visits and the primitives it tests,
+// and adds them to the render statistics when the traversal is over. Only a
+// traversal that isn't nested inside another BVH's primitive test (an instance's
+// bottom-level BVH) counts as a ray, so per-ray averages include nested work.
+static thread_local int leafPrimitiveTestDepth = 0;
+
+template <bool anyHit>
+class LeafIntersector {
+public:
+  LeafIntersector(const std::vector<std::shared_ptr<Primitive>>& primitives,
+      const std::vector<int>& leafQuadOffset, const TriangleQuad* quads,
+      const Ray& ray, SurfaceInteraction* isect)
+  : primitives(primitives), leafQuadOffset(leafQuadOffset), quads(quads),
+    ray(ray), tMax(ray.tMax), isect(isect), triangleRay(ray),
+    nested(leafPrimitiveTestDepth > 0) {}
+
+  ~LeafIntersector() {
+    ThreadStats &stats = CurrentThreadStats();
+    if (!nested) {
+      stats.counts[(int)(anyHit ? Stat::BVHShadowRays : Stat::BVHRays)] += 1;
+    }
+    stats.counts[(int)(anyHit ? Stat::BVHShadowNodesVisited : Stat::BVHNodesVisited)] +=
+        nodesVisited;
+    stats.counts[(int)(anyHit ? Stat::BVHShadowPrimitivesTested : Stat::BVHPrimitivesTested)] +=
+        primitivesTested;
+  }
+
+  void VisitNode() { ++nodesVisited; }
+
+  bool Intersect(int primitiveOffset, int nPrimitives) {
+    int quadOffset = quads ? leafQuadOffset[primitiveOffset] : -1;
+    if (quadOffset < 0) {
+      // <intersect ray with primitives in leaf one by one>
+      bool hit = false;
+      for (int i = 0; i < nPrimitives; ++i) {
+        ++primitivesTested;
+        const Primitive &prim = *primitives[primitiveOffset + i];
+        ++leafPrimitiveTestDepth;
+        bool primHit = anyHit ? prim.IntersectP(ray) : prim.Intersect(ray, isect);
+        --leafPrimitiveTestDepth;
+        if (primHit) {
+          if (anyHit) {
+            return true;
+          }
+          hit = true;
+          closestTriangle = -1;
+        }
+      }
+      return hit;
+    }
+    // <intersect ray with the packed triangles of the leaf>
+    bool hit = false;
+    for (int q = 0; q < (nPrimitives + 3)/4; ++q) {
+      primitivesTested += std::min(4, nPrimitives - 4*q);
+      const TriangleQuad &quad = quads[quadOffset + q];
+      Float t[4];
+      int mask = IntersectTriangleQuad(quad, ray, triangleRay, t);
+      if (anyHit && mask) {
+        return true;
+      }
+      for (int i = 0; i < 4; ++i) {
+        if ((mask & (1 << i)) && t[i] <= ray.tMax) {
+          ray.tMax = t[i];
+          closestTriangle = quad.primitive[i];
+          hit = true;
+        }
+      }
+    }
+    return hit;
+  }
+
+  bool Finish(bool hit) {
+    if (closestTriangle >= 0) {
+      // <recompute the closest triangle hit in full; it passes the same test again>
+      ray.tMax = tMax;
+      bool found = primitives[closestTriangle]->Intersect(ray, isect);
+      Assert(found);
+    }
+    return hit;
+  }
+
+private:
+  const std::vector<std::shared_ptr<Primitive>>& primitives;
+  const std::vector<int>& leafQuadOffset;
+  const TriangleQuad *quads;
+  const Ray& ray;
+  const Float tMax;
+  SurfaceInteraction *isect;
+  const TriangleRay triangleRay;
+  int closestTriangle = -1;
+  int nodesVisited = 0, primitivesTested = 0;
+  const bool nested;
+};
+
+// <rays traced together by the packet traversal>
+static constexpr int maxPacketSize = 16;
+
+// <interval bounds of a packet whose rays share direction signs>
+// Every ray's origin and reciprocal direction lie in these per-axis intervals, so a
+// box the intervals miss is missed by every ray in the packet.
+struct PacketFrustum {
+  PacketFrustum(const Ray* rays, const Vector3f* invDir, int nRays) {
+    valid = true;
+    tMax = 0;
+    for (int a = 0; a < 3; ++a) {
+      dirIsNeg[a] = invDir[0][a] < 0;
+      oMin[a] = oMax[a] = rays[0].o[a];
+      invMin[a] = invMax[a] = invDir[0][a];
+    }
+    for (int i = 0; i < nRays; ++i) {
+      tMax = std::max(tMax, rays[i].tMax);
+      for (int a = 0; a < 3; ++a) {
+        // <a sign change or a ray parallel to a slab leaves no useful interval>
+        if ((invDir[i][a] < 0) != dirIsNeg[a] || std::isinf(invDir[i][a])) {
+          valid = false;
+        }
+        oMin[a] = std::min(oMin[a], rays[i].o[a]);
+        oMax[a] = std::max(oMax[a], rays[i].o[a]);
+        invMin[a] = std::min(invMin[a], invDir[i][a]);
+        invMax[a] = std::max(invMax[a], invDir[i][a]);
+      }
+    }
+  }
+
+  bool Misses(const Bounds3f& b) const {
+    Float t0 = 0, t1 = tMax;
+    for (int a = 0; a < 3; ++a) {
+      Float nearPlane = dirIsNeg[a] ? b.pMax[a] : b.pMin[a];
+      Float farPlane = dirIsNeg[a] ? b.pMin[a] : b.pMax[a];
+      // <bound (plane - o)*invDir over the corners of both intervals>
+      Float n0 = (nearPlane - oMax[a])*invMin[a], n1 = (nearPlane - oMax[a])*invMax[a];
+      Float n2 = (nearPlane - oMin[a])*invMin[a], n3 = (nearPlane - oMin[a])*invMax[a];
+      Float f0 = (farPlane - oMax[a])*invMin[a], f1 = (farPlane - oMax[a])*invMax[a];
+      Float f2 = (farPlane - oMin[a])*invMin[a], f3 = (farPlane - oMin[a])*invMax[a];
+      t0 = std::max(t0, std::min(std::min(n0, n1), std::min(n2, n3)));
+      t1 = std::min(t1, std::max(std::max(f0, f1), std::max(f2, f3))*(1 + 2*gamma(3)));
+    }
+    return t0 > t1;
+  }
+
+  bool valid;
+  int dirIsNeg[3];
+  Float oMin[3], oMax[3], invMin[3], invMax[3], tMax;
 };
 
 bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
 
+  if (quantizedNodes) {
+    return intersectQuantized(ray, isect);
+  }
   if (!nodes) {
     return false;
   }
+  if (wideNodes) {
+    return intersectWide(ray, isect);
+  }
+  if (motionBounds) {
+    return intersectMotion(ray, isect);
+  }
+  if (parentIndex) {
+    return intersectStackless(ray, isect);
+  }
 
   bool hit = false;
   Vector3f invDir(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
   int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+  LeafIntersector<false> leaves(primitives, leafQuadOffset, triangleQuads, ray, isect);
+  if (!nodes[0].bounds.IntersectP(ray, invDir, dirIsNeg)) {
+    return false;
+  }
+
+  // <follow ray through BVH nodes to find primitive intersections>
+  // Both children are tested before either is visited: the nearer one is
+  // visited first and the other is pushed with its entry distance, so it can
+  // be skipped once a closer hit has been found by the time it is popped.
+  int toVisitOffset = 0, currentNodeIndex = 0;
+  BVHStackEntry nodesToVisit[64];
+  while (true) {
+    const LinearBVHNode *node = &nodes[currentNodeIndex];
+    leaves.VisitNode();
+    if (node->nPrimitives > 0) {
+      // <intersect ray with primitives in leaf BVH node>
+      if (leaves.Intersect(node->primitiveOffset, node->nPrimitives)) {
+        hit = true;
+      }
+    }
+    else {
+      // <visit the nearer child hit by the ray, push the farther one>
+      int child[2] = {currentNodeIndex + 1, node->secondChildOffset};
+      Float tEntry[2];
+      bool hit0 = nodes[child[0]].bounds.IntersectP(ray, invDir, dirIsNeg, &tEntry[0]);
+      bool hit1 = nodes[child[1]].bounds.IntersectP(ray, invDir, dirIsNeg, &tEntry[1]);
+      if (hit0 && hit1) {
+        // <break ties, as when the ray starts inside both, by the split axis>
+        int nearer = tEntry[1] < tEntry[0] ||
+            (tEntry[1] == tEntry[0] && dirIsNeg[node->axis]);
+        nodesToVisit[toVisitOffset++] = {child[1 - nearer], tEntry[1 - nearer]};
+        currentNodeIndex = child[nearer];
+        continue;
+      }
+      if (hit0 || hit1) {
+        currentNodeIndex = child[hit0 ? 0 : 1];
+        continue;
+      }
+    }
+
+    // <pop the next node the ray enters before its closest hit so far>
+    while (toVisitOffset > 0 && nodesToVisit[toVisitOffset - 1].tEntry > ray.tMax) {
+      --toVisitOffset;
+    }
+    if (toVisitOffset == 0) {
+      break;
+    }
+    currentNodeIndex = nodesToVisit[--toVisitOffset].nodeIndex;
+  }
+
+  return leaves.Finish(hit);
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const {
+
+  if (quantizedNodes) {
+    return intersectPQuantized(ray);
+  }
+  if (!nodes) {
+    return false;
+  }
+  if (wideNodes) {
+    return intersectPWide(ray);
+  }
+  if (motionBounds) {
+    return intersectPMotion(ray);
+  }
+  if (parentIndex) {
+    return intersectPStackless(ray);
+  }
+  Vector3f invDir(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+  int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+  LeafIntersector<true> leaves(primitives, leafQuadOffset, triangleQuads, ray, nullptr);
 
   // <follow ray through BVH nodes to find primitive intersections>
   int toVisitOffset = 0, currentNodeIndex = 0;
@@ -69,12 +544,11 @@ bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
 
     // <check ray against BVH node>
     if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+      leaves.VisitNode();
       if (node->nPrimitives > 0) {
         // <intersect ray with primitives in leaf BVH node>
-        for (int i = 0; i < node->nPrimitives; ++i) {
-          if (primitives[node->primitiveOffset + i]->Intersect(ray, isect)) {
-            hit = true;
-          }
+        if (leaves.Intersect(node->primitiveOffset, node->nPrimitives)) {
+          return true;
         }
         if (toVisitOffset == 0) {
           break;
@@ -82,8 +556,8 @@ bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
         currentNodeIndex = nodesToVisit[--toVisitOffset];
       }
       else {
-        // <put far BVH node on nodesToVisit stack, advance to near node>
-        if (dirIsNeg[node->axis]) {
+        // <put the child less likely to occlude on the stack, advance to the other>
+        if (node->occluderChild) {
           nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
           currentNodeIndex = node->secondChildOffset;
         }
@@ -101,31 +575,189 @@ bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
     }
   }
 
-  return hit;
+  return false;
 }
 
-bool BVHAccel::IntersectP(const Ray& ray) const {
 
-  if (!nodes) {
-    return false;
+// <traverse the wide BVH; shadow rays (anyHit) stop at the first occluder>
+template <bool anyHit>
+static bool TraverseWide(const WideBVHNode* wideNodes, LeafIntersector<anyHit>& leaves,
+    const Ray& ray) {
+
+  float org[3] = {(float)ray.o.x, (float)ray.o.y, (float)ray.o.z};
+  float invDir[3] = {1/(float)ray.d.x, 1/(float)ray.d.y, 1/(float)ray.d.z};
+  int dirIsNeg[3] = {invDir[0] < 0, invDir[1] < 0, invDir[2] < 0};
+
+  bool hit = false;
+  WideStackEntry stack[128];
+  int stackSize = 0;
+  WideStackEntry current = {0, 0, 0.f};
+  while (true) {
+    leaves.VisitNode();
+    if (current.nPrimitives > 0) {
+      // <intersect ray with primitives in leaf>
+      if (leaves.Intersect(current.child, current.nPrimitives)) {
+        if (anyHit) {
+          return true;
+        }
+        hit = true;
+      }
+    }
+    else {
+      // <test all four children and push hit ones, farthest first>
+      const WideBVHNode &node = wideNodes[current.child];
+      float tNear[4];
+      int mask = IntersectWideNode(node, org, invDir, dirIsNeg, (float)ray.tMax, tNear);
+      int order[4], nHit = 0;
+      for (int i = 0; i < 4; ++i) {
+        if (mask & (1 << i)) {
+          // <insertion sort by decreasing entry distance>
+          int j = nHit++;
+          while (j > 0 && tNear[order[j-1]] < tNear[i]) {
+            order[j] = order[j-1];
+            --j;
+          }
+          order[j] = i;
+        }
+      }
+      for (int k = 0; k < nHit; ++k) {
+        int i = order[k];
+        stack[stackSize++] = {node.child[i], node.nPrimitives[i], tNear[i]};
+      }
+    }
+
+    // <pop next node, skipping entries already beyond the closest hit>
+    do {
+      if (stackSize == 0) {
+        return leaves.Finish(hit);
+      }
+      current = stack[--stackSize];
+    } while (current.tNear > ray.tMax);
   }
+}
+
+bool BVHAccel::intersectWide(const Ray& ray, SurfaceInteraction* isect) const {
+  LeafIntersector<false> leaves(primitives, leafQuadOffset, triangleQuads, ray, isect);
+  return TraverseWide<false>(wideNodes, leaves, ray);
+}
+
+bool BVHAccel::intersectPWide(const Ray& ray) const {
+  LeafIntersector<true> leaves(primitives, leafQuadOffset, triangleQuads, ray, nullptr);
+  return TraverseWide<true>(wideNodes, leaves, ray);
+}
+
+// <traverse the quantized BVH; shadow rays (anyHit) stop at the first occluder>
+template <bool anyHit>
+static bool TraverseQuantized(const QuantizedBVHNode* quantizedNodes, const Bounds3f& rootBounds,
+    LeafIntersector<anyHit>& leaves, const Ray& ray) {
+
   Vector3f invDir(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
   int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+  if (!rootBounds.IntersectP(ray, invDir, dirIsNeg)) {
+    return false;
+  }
 
-  // <follow ray through BVH nodes to find primitive intersections>
+  // <each stack entry keeps the decoded box of the node, its children's frame>
+  struct StackEntry {
+    int nodeIndex;
+    Bounds3f frame;
+  };
+  StackEntry nodesToVisit[64];
+  int toVisitOffset = 0, currentNodeIndex = 0;
+  Bounds3f frame = rootBounds;
+  bool hit = false;
+  while (true) {
+    const QuantizedBVHNode &node = quantizedNodes[currentNodeIndex];
+    leaves.VisitNode();
+    if (node.nPrimitives > 0) {
+      // <intersect ray with primitives in leaf BVH node>
+      if (leaves.Intersect(node.offset, node.nPrimitives)) {
+        if (anyHit) {
+          return true;
+        }
+        hit = true;
+      }
+    }
+    else {
+      // <decode and test both children, descend into the near one>
+      Bounds3f b0 = DecodeQuantizedBounds(frame, node.qMin[0], node.qMax[0]);
+      Bounds3f b1 = DecodeQuantizedBounds(frame, node.qMin[1], node.qMax[1]);
+      bool hit0 = b0.IntersectP(ray, invDir, dirIsNeg);
+      bool hit1 = b1.IntersectP(ray, invDir, dirIsNeg);
+      int child0 = currentNodeIndex + 1, child1 = node.offset;
+      if (hit0 && hit1) {
+        if (anyHit ? node.occluderChild : dirIsNeg[node.axis]) {
+          nodesToVisit[toVisitOffset++] = {child0, b0};
+          currentNodeIndex = child1;
+          frame = b1;
+        }
+        else {
+          nodesToVisit[toVisitOffset++] = {child1, b1};
+          currentNodeIndex = child0;
+          frame = b0;
+        }
+        continue;
+      }
+      else if (hit0 || hit1) {
+        currentNodeIndex = hit0 ? child0 : child1;
+        frame = hit0 ? b0 : b1;
+        continue;
+      }
+    }
+    if (toVisitOffset == 0) {
+      break;
+    }
+    --toVisitOffset;
+    currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+    frame = nodesToVisit[toVisitOffset].frame;
+  }
+  return leaves.Finish(hit);
+}
+
+bool BVHAccel::intersectQuantized(const Ray& ray, SurfaceInteraction* isect) const {
+  LeafIntersector<false> leaves(primitives, leafQuadOffset, triangleQuads, ray, isect);
+  return TraverseQuantized<false>(quantizedNodes, rootBounds, leaves, ray);
+}
+
+bool BVHAccel::intersectPQuantized(const Ray& ray) const {
+  LeafIntersector<true> leaves(primitives, leafQuadOffset, triangleQuads, ray, nullptr);
+  return TraverseQuantized<true>(quantizedNodes, rootBounds, leaves, ray);
+}
+
+// <traverse the binary nodes with bounds interpolated to the ray's time>
+// The time selects a segment of the shutter and the node's bounds at its two
+// ends are interpolated; the children are ordered as in Intersect and IntersectP.
+template <bool anyHit>
+static bool TraverseMotion(const LinearBVHNode* nodes, const Bounds3f* motionBounds,
+    int nSegments, Float shutterOpen, Float shutterClose,
+    LeafIntersector<anyHit>& leaves, const Ray& ray) {
+
+  // <find the shutter segment containing the ray's time>
+  Float u = shutterClose > shutterOpen ?
+      Clamp((ray.time - shutterOpen)/(shutterClose - shutterOpen), 0, 1)*nSegments : 0;
+  int segment = std::min((int)u, nSegments - 1);
+  Float f = u - segment;
+
+  bool hit = false;
+  Vector3f invDir(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+  int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
   int toVisitOffset = 0, currentNodeIndex = 0;
   int nodesToVisit[64];
   while (true) {
     const LinearBVHNode *node = &nodes[currentNodeIndex];
+    const Bounds3f *knots = &motionBounds[currentNodeIndex*(nSegments + 1) + segment];
+    Bounds3f bounds;
+    bounds.pMin = Lerp(f, knots[0].pMin, knots[1].pMin);
+    bounds.pMax = Lerp(f, knots[0].pMax, knots[1].pMax);
 
-    // <check ray against BVH node>
-    if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+    if (bounds.IntersectP(ray, invDir, dirIsNeg)) {
+      leaves.VisitNode();
       if (node->nPrimitives > 0) {
-        // <intersect ray with primitives in leaf BVH node>
-        for (int i = 0; i < node->nPrimitives; ++i) {
-          if (primitives[node->primitiveOffset + i]->IntersectP(ray)) {
+        if (leaves.Intersect(node->primitiveOffset, node->nPrimitives)) {
+          if (anyHit) {
             return true;
           }
+          hit = true;
         }
         if (toVisitOffset == 0) {
           break;
@@ -133,8 +765,8 @@ bool BVHAccel::IntersectP(const Ray& ray) const {
         currentNodeIndex = nodesToVisit[--toVisitOffset];
       }
       else {
-        // <put far BVH node on nodesToVisit stack, advance to near node>
-        if (dirIsNeg[node->axis]) {
+        bool secondFirst = anyHit ? node->occluderChild : dirIsNeg[node->axis];
+        if (secondFirst) {
           nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
           currentNodeIndex = node->secondChildOffset;
         }
@@ -151,10 +783,228 @@ bool BVHAccel::IntersectP(const Ray& ray) const {
       currentNodeIndex = nodesToVisit[--toVisitOffset];
     }
   }
+  return hit;
+}
 
-  return false;
+bool BVHAccel::intersectMotion(const Ray& ray, SurfaceInteraction* isect) const {
+  LeafIntersector<false> leaves(primitives, leafQuadOffset, triangleQuads, ray, isect);
+  return leaves.Finish(TraverseMotion<false>(nodes, motionBounds, motionSegments,
+      shutterOpen, shutterClose, leaves, ray));
 }
 
+bool BVHAccel::intersectPMotion(const Ray& ray) const {
+  LeafIntersector<true> leaves(primitives, leafQuadOffset, triangleQuads, ray, nullptr);
+  return TraverseMotion<true>(nodes, motionBounds, motionSegments,
+      shutterOpen, shutterClose, leaves, ray);
+}
+
+// <traverse the binary nodes without a stack, through the parent links>
+// Each interior node's near child is the one the stack traversal would visit
+// first. A node is entered from its parent (it is a near child), from its
+// sibling (it is a far child) or from a child whose subtree is done. After a
+// near child the far child is next; after a far child its parent's subtree is
+// done. Closest-hit rays visit children in split-axis order rather than by
+// entry distance, so they may enter more nodes than Intersect, but find the
+// same hit; missed boxes are still culled by the shortened ray.tMax.
+template <bool anyHit>
+static bool TraverseStackless(const LinearBVHNode* nodes, const int* parentIndex,
+    LeafIntersector<anyHit>& leaves, const Ray& ray) {
+
+  Vector3f invDir(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+  int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+  auto nearChild = [&](int nodeIndex) {
+    const LinearBVHNode &node = nodes[nodeIndex];
+    bool secondFirst = anyHit ? node.occluderChild : dirIsNeg[node.axis];
+    return secondFirst ? node.secondChildOffset : nodeIndex + 1;
+  };
+  auto sibling = [&](int nodeIndex) {
+    int parent = parentIndex[nodeIndex];
+    return nodeIndex == parent + 1 ? nodes[parent].secondChildOffset : parent + 1;
+  };
+
+  enum class From { Parent, Sibling, Child };
+  From from = From::Parent;
+  int currentNodeIndex = 0;
+  bool hit = false;
+  while (true) {
+    if (from == From::Child) {
+      // <the subtree of currentNodeIndex is done: go to its far sibling or further up>
+      if (currentNodeIndex == 0) {
+        break;
+      }
+      if (currentNodeIndex == nearChild(parentIndex[currentNodeIndex])) {
+        currentNodeIndex = sibling(currentNodeIndex);
+        from = From::Sibling;
+      }
+      else {
+        currentNodeIndex = parentIndex[currentNodeIndex];
+      }
+      continue;
+    }
+
+    // <check ray against BVH node; descend into its near child if it is interior>
+    const LinearBVHNode *node = &nodes[currentNodeIndex];
+    if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+      leaves.VisitNode();
+      if (node->nPrimitives == 0) {
+        currentNodeIndex = nearChild(currentNodeIndex);
+        from = From::Parent;
+        continue;
+      }
+      if (leaves.Intersect(node->primitiveOffset, node->nPrimitives)) {
+        if (anyHit) {
+          return true;
+        }
+        hit = true;
+      }
+    }
+
+    // <node missed or leaf done: a near child hands over to its sibling>
+    if (currentNodeIndex == 0) {
+      break;
+    }
+    if (from == From::Parent) {
+      currentNodeIndex = sibling(currentNodeIndex);
+      from = From::Sibling;
+    }
+    else {
+      currentNodeIndex = parentIndex[currentNodeIndex];
+      from = From::Child;
+    }
+  }
+  return hit;
+}
+
+bool BVHAccel::intersectStackless(const Ray& ray, SurfaceInteraction* isect) const {
+  LeafIntersector<false> leaves(primitives, leafQuadOffset, triangleQuads, ray, isect);
+  return leaves.Finish(TraverseStackless<false>(nodes, parentIndex, leaves, ray));
+}
+
+bool BVHAccel::intersectPStackless(const Ray& ray) const {
+  LeafIntersector<true> leaves(primitives, leafQuadOffset, triangleQuads, ray, nullptr);
+  return TraverseStackless<true>(nodes, parentIndex, leaves, ray);
+}
+
+void BVHAccel::quantizeBVH(int nodeIndex, const Bounds3f& frame,
+    QuantizedBVHNode* quantized) const {
+
+  const LinearBVHNode &node = nodes[nodeIndex];
+  QuantizedBVHNode &q = quantized[nodeIndex];
+  q.nPrimitives = node.nPrimitives;
+  if (node.nPrimitives > 0) {
+    q.offset = node.primitiveOffset;
+    return;
+  }
+  q.axis = node.axis;
+  q.occluderChild = node.occluderChild;
+  q.offset = node.secondChildOffset;
+  int children[2] = {nodeIndex + 1, node.secondChildOffset};
+  for (int c = 0; c < 2; ++c) {
+    EncodeQuantizedBounds(frame, nodes[children[c]].bounds, q.qMin[c], q.qMax[c]);
+    // <children are encoded against the decoded box, exactly as traversal sees it>
+    quantizeBVH(children[c], DecodeQuantizedBounds(frame, q.qMin[c], q.qMax[c]), quantized);
+  }
+}
+
+int BVHAccel::collapseWideBVH(int nodeIndex, std::vector<WideBVHNode>& wide) const {
+
+  // <gather up to four descendants by repeatedly opening the largest interior child>
+  int children[4];
+  int nChildren = 0;
+  const LinearBVHNode &node = nodes[nodeIndex];
+  if (node.nPrimitives > 0) {
+    children[nChildren++] = nodeIndex;
+  }
+  else {
+    children[nChildren++] = nodeIndex + 1;
+    children[nChildren++] = node.secondChildOffset;
+  }
+  while (nChildren < 4) {
+    int largest = -1;
+    Float largestArea = -1;
+    for (int i = 0; i < nChildren; ++i) {
+      const LinearBVHNode &c = nodes[children[i]];
+      if (c.nPrimitives == 0 && c.bounds.SurfaceArea() > largestArea) {
+        largest = i;
+        largestArea = c.bounds.SurfaceArea();
+      }
+    }
+    if (largest == -1) {
+      break;
+    }
+    int opened = children[largest];
+    children[largest] = opened + 1;
+    children[nChildren++] = nodes[opened].secondChildOffset;
+  }
+
+  // <emit wide node, recursing into interior children>
+  int wideIndex = wide.size();
+  wide.push_back(WideBVHNode());
+  for (int i = 0; i < 4; ++i) {
+    if (i >= nChildren) {
+      for (int a = 0; a < 3; ++a) {
+        wide[wideIndex].bMin[a][i] = Infinity;
+        wide[wideIndex].bMax[a][i] = -Infinity;
+      }
+      wide[wideIndex].child[i] = -1;
+      wide[wideIndex].nPrimitives[i] = 0;
+      continue;
+    }
+    const LinearBVHNode &c = nodes[children[i]];
+    int child, nPrimitives;
+    if (c.nPrimitives > 0) {
+      child = c.primitiveOffset;
+      nPrimitives = c.nPrimitives;
+    }
+    else {
+      child = collapseWideBVH(children[i], wide);
+      nPrimitives = 0;
+    }
+    // <wide may have been reallocated by the recursive call>
+    for (int a = 0; a < 3; ++a) {
+      wide[wideIndex].bMin[a][i] = c.bounds.pMin[a];
+      wide[wideIndex].bMax[a][i] = c.bounds.pMax[a];
+    }
+    wide[wideIndex].child[i] = child;
+    wide[wideIndex].nPrimitives[i] = nPrimitives;
+  }
+  return wideIndex;
+}
+
+// <the Triangle a primitive is made of, or nullptr if it isn't a triangle>
+static const Triangle* GetTriangle(const Primitive* primitive) {
+  auto geometric = dynamic_cast<const GeometricPrimitive*>(primitive);
+  return geometric ? dynamic_cast<const Triangle*>(geometric->GetShape()) : nullptr;
+}
+
+// <estimate the probability that a ray through node's box is blocked inside it>
+// This follows the ray termination SAH: a leaf is estimated from its primitives'
+// box areas, and an interior node from its children's hit probabilities
+// (area ratios). Along the way each interior node records the child with the
+// higher chance to terminate a ray, so shadow rays try it first.
+Float BVHAccel::computeOccluderOrder(int nodeIndex) {
+  LinearBVHNode &node = nodes[nodeIndex];
+  Float area = node.bounds.SurfaceArea();
+  if (node.nPrimitives > 0) {
+    if (area <= 0) {
+      return 1;
+    }
+    Float covered = 0;
+    for (int i = 0; i < node.nPrimitives; ++i) {
+      covered += primitives[node.primitiveOffset + i]->WorldBound().SurfaceArea();
+    }
+    return std::min<Float>(1, covered/area);
+  }
+  int children[2] = {nodeIndex + 1, node.secondChildOffset};
+  Float p[2];
+  for (int c = 0; c < 2; ++c) {
+    Float childArea = nodes[children[c]].bounds.SurfaceArea();
+    Float hit = area > 0 ? std::min<Float>(1, childArea/area) : 1;
+    p[c] = hit*computeOccluderOrder(children[c]);
+  }
+  node.occluderChild = p[1] > p[0];
+  return p[0] + (1 - p[0])*p[1];
+}
 
 int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset) {
   LinearBVHNode *linearNode = &nodes[*offset];
@@ -167,6 +1017,7 @@ int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset) {
   else {
     // <create interior flattened BVH node>
     linearNode->axis = node->splitAxis;
+    linearNode->occluderChild = 0;
     linearNode->nPrimitives = 0;
     flattenBVHTree(node->children[0], offset);
     linearNode->secondChildOffset = flattenBVHTree(node->children[1], offset);
@@ -174,202 +1025,1095 @@ int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset) {
   return myOffset;
 }
 
+// <copy the subtree at oldNodes[oldIndex] into nodes, flattening rebuilt subtrees in its place>
+// rebuilt is sorted by old root index.
+int BVHAccel::relinkBVHTree(const LinearBVHNode* oldNodes, int oldIndex,
+    const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt, int* offset) {
+  auto it = std::lower_bound(rebuilt.begin(), rebuilt.end(),
+      std::make_pair(oldIndex, (BVHBuildNode*)nullptr));
+  if (it != rebuilt.end() && it->first == oldIndex) {
+    return flattenBVHTree(it->second, offset);
+  }
+  const LinearBVHNode &old = oldNodes[oldIndex];
+  int myOffset = (*offset)++;
+  nodes[myOffset] = old;
+  if (old.nPrimitives == 0) {
+    relinkBVHTree(oldNodes, oldIndex + 1, rebuilt, offset);
+    nodes[myOffset].secondChildOffset =
+        relinkBVHTree(oldNodes, old.secondChildOffset, rebuilt, offset);
+  }
+  return myOffset;
+}
+
+// <SAH binning parameters for recursiveBuild>
+static constexpr int nSAHBuckets = 16;
+static constexpr int parallelBuildThreshold = 16*1024;
+// cost of visiting an interior node relative to intersecting one primitive
+static constexpr Float sahTraversalCost = .125f;
+
+struct BucketInfo {
+  int count = 0;
+  Bounds3f bounds;
+};
+
+// <bucket that a centroid falls into along axis, given per-axis scale nSAHBuckets/extent>
+inline int SAHBucket(const Point3f& centroid, const Bounds3f& centroidBounds,
+    const Vector3f& scale, int axis) {
+  int b = (centroid[axis] - centroidBounds.pMin[axis])*scale[axis];
+  return Clamp(b, 0, nSAHBuckets - 1);
+}
+
+// <compute primitive and centroid bounds of primitiveInfo[start, end), in parallel if large>
+static void ComputeRangeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    int start, int end, Bounds3f* bounds, Bounds3f* centroidBounds) {
+
+  if (end - start <= parallelBuildThreshold) {
+    for (int i = start; i < end; ++i) {
+      *bounds = Union(*bounds, primitiveInfo[i].bounds);
+      *centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+    }
+    return;
+  }
+  int nChunks = MaxThreadIndex();
+  std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+  ParallelFor([&](int64_t c) {
+    int c0 = start + (int64_t)(end - start)*c/nChunks;
+    int c1 = start + (int64_t)(end - start)*(c + 1)/nChunks;
+    for (int i = c0; i < c1; ++i) {
+      chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+      chunkCentroidBounds[c] = Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+    }
+  }, nChunks);
+  for (int c = 0; c < nChunks; ++c) {
+    *bounds = Union(*bounds, chunkBounds[c]);
+    *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[c]);
+  }
+}
+
+// <bin primitiveInfo[start, end) into SAH buckets along all three axes, in parallel if large>
+static void BinPrimitives(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    int start, int end, const Bounds3f& centroidBounds, const Vector3f& scale,
+    BucketInfo buckets[3][nSAHBuckets]) {
+
+  auto binRange = [&](int b0, int b1, BucketInfo* local) {
+    for (int i = b0; i < b1; ++i) {
+      for (int axis = 0; axis < 3; ++axis) {
+        BucketInfo &bucket =
+            local[axis*nSAHBuckets + SAHBucket(primitiveInfo[i].centroid, centroidBounds, scale, axis)];
+        bucket.count++;
+        bucket.bounds = Union(bucket.bounds, primitiveInfo[i].bounds);
+      }
+    }
+  };
+  if (end - start <= parallelBuildThreshold) {
+    binRange(start, end, &buckets[0][0]);
+    return;
+  }
+
+  int nChunks = MaxThreadIndex();
+  std::vector<BucketInfo> chunkBuckets(nChunks*3*nSAHBuckets);
+  ParallelFor([&](int64_t c) {
+    int c0 = start + (int64_t)(end - start)*c/nChunks;
+    int c1 = start + (int64_t)(end - start)*(c + 1)/nChunks;
+    binRange(c0, c1, &chunkBuckets[c*3*nSAHBuckets]);
+  }, nChunks);
+  for (int c = 0; c < nChunks; ++c) {
+    for (int axis = 0; axis < 3; ++axis) {
+      for (int b = 0; b < nSAHBuckets; ++b) {
+        const BucketInfo &local = chunkBuckets[(c*3 + axis)*nSAHBuckets + b];
+        buckets[axis][b].count += local.count;
+        buckets[axis][b].bounds = Union(buckets[axis][b].bounds, local.bounds);
+      }
+    }
+  }
+}
+
+// <best binned SAH split: primitives in buckets <= bucket along axis go left>
+struct SAHSplit {
+  Float cost = Infinity;
+  int axis = -1, bucket = -1;
+  Bounds3f bounds[2];
+};
+
+static SAHSplit FindSAHSplit(const BucketInfo buckets[3][nSAHBuckets],
+    const Vector3f& scale, const Bounds3f& bounds) {
+
+  SAHSplit best;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (scale[axis] == 0) {
+      continue;
+    }
+
+    // <sweep from the right to get the bounds and count above each split>
+    Bounds3f boundsAbove[nSAHBuckets-1];
+    int countAbove[nSAHBuckets-1];
+    Bounds3f b1;
+    int count1 = 0;
+    for (int i = nSAHBuckets-1; i > 0; --i) {
+      b1 = Union(b1, buckets[axis][i].bounds);
+      count1 += buckets[axis][i].count;
+      boundsAbove[i-1] = b1;
+      countAbove[i-1] = count1;
+    }
+
+    // <sweep from the left and compute costs for splitting after each bucket>
+    Bounds3f b0;
+    int count0 = 0;
+    for (int i = 0; i < nSAHBuckets-1; ++i) {
+      b0 = Union(b0, buckets[axis][i].bounds);
+      count0 += buckets[axis][i].count;
+      if (count0 == 0 || countAbove[i] == 0) {
+        continue;
+      }
+      Float cost = sahTraversalCost + (count0*b0.SurfaceArea() +
+          countAbove[i]*boundsAbove[i].SurfaceArea())/bounds.SurfaceArea();
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bucket = i;
+        best.bounds[0] = b0;
+        best.bounds[1] = boundsAbove[i];
+      }
+    }
+  }
+  return best;
+}
+
+// Most motion segments a BVH keeps bounds for; the bounds take
+// (motionSegments + 1)*24 bytes per node.
+static constexpr int maxMotionSegments = 16;
+
 BVHAccel::BVHAccel(const std::vector<std::shared_ptr<Primitive>>& p,
-    int maxPrimsInNode, SplitMethod splitMethod)
-: maxPrimsInNode(std::min(255,maxPrimsInNode)), primitives(p), splitMethod(splitMethod) {
+    int maxPrimsInNode, SplitMethod splitMethod, NodeLayout nodeLayout,
+    Float maxSplitDuplication, int treeletPasses, int motionSegments,
+    Float shutterOpen, Float shutterClose)
+: maxPrimsInNode(std::min(255,maxPrimsInNode)), splitMethod(splitMethod),
+  nodeLayout(motionSegments > 0 ? NodeLayout::Binary : nodeLayout),
+  maxSplitDuplication(maxSplitDuplication), treeletPasses(treeletPasses),
+  motionSegments(Clamp(motionSegments, 0, maxMotionSegments)),
+  shutterOpen(shutterOpen), shutterClose(shutterClose), primitives(p) {
+
+  // The parameters shadow the members: nodeLayout and motionSegments below are
+  // the requested ones, this->nodeLayout the one the BVH uses.
+  if (motionSegments > 0 && nodeLayout != NodeLayout::Binary) {
+    Warning("BVH with motion segments uses the binary node layout");
+  }
 
   if (primitives.size() == 0) {
     return;
   }
+  if (splitMethod == SplitMethod::SBVH) {
+    inputPrimitives = primitives;
+  }
+
+  // <use the cached BVH for this geometry if there is one>
+  std::string cacheFile;
+  uint64_t geometryHash = 0;
+  if (!PbrtOptions.bvhCacheDir.empty()) {
+    geometryHash = hashGeometry();
+    char name[64];
+    std::snprintf(name, sizeof(name), "/bvh-%016llx.cache", (unsigned long long)geometryHash);
+    cacheFile = PbrtOptions.bvhCacheDir + name;
+    if (loadCache(cacheFile, geometryHash)) {
+      if (this->nodeLayout != NodeLayout::Quantized) {
+        builtSAHCost = sahCost = initRefit();
+      }
+      buildLayouts();
+      if (PbrtOptions.printStats) {
+        PrintBVHTreeStats(treeStats, stdout);
+      }
+      return;
+    }
+  }
+
+  std::vector<std::shared_ptr<Primitive>> inputPrims;
+  if (!cacheFile.empty()) {
+    inputPrims = primitives;
+  }
+  build();
+  if (!cacheFile.empty()) {
+    writeCache(cacheFile, geometryHash, inputPrims);
+  }
+  buildLayouts();
+  if (PbrtOptions.printStats) {
+    PrintBVHTreeStats(treeStats, stdout);
+  }
+}
+
+void BVHAccel::build() {
 
   // <build BVH from primitives>
+  if (!inputPrimitives.empty()) {
+    primitives = inputPrimitives;
+  }
 
   //  <initialize primitiveInfo array for primitives>
   std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-  for (size_t i = 0; i < primitives.size(); ++i) {
-    primitiveInfo[i] = {i, primitives[i]->WorldBound()};
-  }
+  ParallelFor([&](int64_t i) {
+    primitiveInfo[i] = {(size_t)i, primitives[i]->WorldBound()};
+  }, primitives.size(), 4096);
 
   //  <build BVH tree for primitives using primitiveInfo>
   MemoryArena arena(1024*1024);
-  int totalNodes = 0;
   std::vector<std::shared_ptr<Primitive>> orderedPrims;
   BVHBuildNode *root;
 
+  // <one arena per thread so parallel subtree builds never share an allocator>
+  std::vector<std::unique_ptr<MemoryArena>> threadArenas;
+
   if (splitMethod == SplitMethod::HLBVH) {
+    totalNodes = 0;
     root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
   }
+  else if (splitMethod == SplitMethod::SBVH) {
+    for (int i = 0; i < MaxThreadIndex(); ++i) {
+      threadArenas.push_back(std::unique_ptr<MemoryArena>(new MemoryArena(1024*1024)));
+    }
+    root = SBVHBuild(threadArenas, primitiveInfo, &totalNodes, orderedPrims);
+  }
   else {
-    root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(), &totalNodes, orderedPrims);
+    for (int i = 0; i < MaxThreadIndex(); ++i) {
+      threadArenas.push_back(std::unique_ptr<MemoryArena>(new MemoryArena(1024*1024)));
+    }
+    std::atomic<int> atomicTotal(0);
+    orderedPrims.resize(primitives.size());
+    root = recursiveBuild(threadArenas, primitiveInfo, 0, primitives.size(),
+        &atomicTotal, orderedPrims);
+    totalNodes = atomicTotal;
   }
   primitives.swap(orderedPrims);
+  if (treeletPasses > 0) {
+    restructureTreelets(root);
+  }
 
   // <compute representation of depth-first traversal of BVH tree>
+  releaseNodes(nodes);
   nodes = AllocAligned<LinearBVHNode>(totalNodes);
   int offset = 0;
   flattenBVHTree(root, &offset);
+  computeOccluderOrder(0);
+  if (nodeLayout != NodeLayout::Quantized) {
+    builtSAHCost = sahCost = initRefit();
+  }
+}
+
+void BVHAccel::buildLayouts() {
+
+  packTriangleLeaves();
+
+  // <collapse binary BVH into 4-wide nodes if requested>
+  if (nodeLayout == NodeLayout::Wide4) {
+    std::vector<WideBVHNode> wide;
+    wide.reserve(totalNodes/2 + 1);
+    collapseWideBVH(0, wide);
+    totalWideNodes = wide.size();
+    FreeAligned(wideNodes);
+    wideNodes = AllocAligned<WideBVHNode>(totalWideNodes);
+    std::copy(wide.begin(), wide.end(), wideNodes);
+  }
+
+  computeTreeStats();
+
+  // <link every binary node to its parent for stackless traversal if requested>
+  if (nodeLayout == NodeLayout::Stackless) {
+    FreeAligned(parentIndex);
+    parentIndex = AllocAligned<int>(totalNodes);
+    parentIndex[0] = -1;
+    for (int i = 0; i < totalNodes; ++i) {
+      if (nodes[i].nPrimitives == 0) {
+        parentIndex[i + 1] = parentIndex[nodes[i].secondChildOffset] = i;
+      }
+    }
+  }
+
+  // <replace binary nodes with quantized nodes if requested>
+  rootBounds = nodes[0].bounds;
+  if (nodeLayout == NodeLayout::Quantized) {
+    FreeAligned(quantizedNodes);
+    quantizedNodes = AllocAligned<QuantizedBVHNode>(totalNodes);
+    quantizeBVH(0, rootBounds, quantizedNodes);
+    releaseNodes(nodes);
+    nodes = nullptr;
+  }
+
+  if (motionSegments > 0) {
+    computeMotionBounds();
+  }
+  treeStats.nodeBytes = NodeMemoryUsage();
+  treeStats.totalBytes = MemoryUsage();
+}
+
+void BVHAccel::computeTreeStats() {
+  BVHTreeStats stats;
+  Float rootArea = nodes[0].bounds.SurfaceArea();
+  Float cost = 0, overlap = 0;
+
+  // <walk the binary nodes depth first, tracking each node's depth>
+  struct StackEntry {
+    int nodeIndex, depth;
+  };
+  std::vector<StackEntry> toVisit = {{0, 0}};
+  while (!toVisit.empty()) {
+    StackEntry entry = toVisit.back();
+    toVisit.pop_back();
+    const LinearBVHNode &node = nodes[entry.nodeIndex];
+    if (node.nPrimitives > 0) {
+      ++stats.nLeaves;
+      stats.nPrimitiveReferences += node.nPrimitives;
+      cost += node.nPrimitives*node.bounds.SurfaceArea();
+      if ((int)stats.leafDepths.size() <= entry.depth) {
+        stats.leafDepths.resize(entry.depth + 1);
+      }
+      ++stats.leafDepths[entry.depth];
+      if ((int)stats.leafSizes.size() <= node.nPrimitives) {
+        stats.leafSizes.resize(node.nPrimitives + 1);
+      }
+      ++stats.leafSizes[node.nPrimitives];
+    }
+    else {
+      ++stats.nInteriorNodes;
+      cost += sahTraversalCost*node.bounds.SurfaceArea();
+      const Bounds3f &b0 = nodes[entry.nodeIndex + 1].bounds;
+      const Bounds3f &b1 = nodes[node.secondChildOffset].bounds;
+      if (Overlaps(b0, b1)) {
+        overlap += pbrt::Intersect(b0, b1).SurfaceArea();
+      }
+      toVisit.push_back({node.secondChildOffset, entry.depth + 1});
+      toVisit.push_back({entry.nodeIndex + 1, entry.depth + 1});
+    }
+  }
+  if (rootArea > 0) {
+    stats.sahCost = cost/rootArea;
+    stats.overlap = overlap/rootArea;
+  }
+  treeStats = std::move(stats);
+}
+
+// <print one histogram row with a bar scaled to the largest bin>
+static void PrintHistogramRow(FILE* dest, int bin, int count, int maxCount) {
+  int width = maxCount > 0 ? (40*count + maxCount - 1)/maxCount : 0;
+  std::fprintf(dest, "    %4d %10d  %s\n", bin, count, std::string(width, '#').c_str());
+}
+
+void PrintBVHTreeStats(const BVHTreeStats& stats, FILE* dest) {
+  std::fprintf(dest, "BVH: %d interior nodes, %d leaves, %d primitive references\n",
+      stats.nInteriorNodes, stats.nLeaves, stats.nPrimitiveReferences);
+  std::fprintf(dest, "  SAH cost %.2f  overlap %.3f  memory %.2f MB (nodes %.2f MB)\n",
+      stats.sahCost, stats.overlap, stats.totalBytes/(1024.*1024.),
+      stats.nodeBytes/(1024.*1024.));
+  std::fprintf(dest, "  leaves by depth:\n");
+  int maxCount = 0;
+  for (int count : stats.leafDepths) maxCount = std::max(maxCount, count);
+  for (size_t d = 0; d < stats.leafDepths.size(); ++d) {
+    if (stats.leafDepths[d] > 0) {
+      PrintHistogramRow(dest, d, stats.leafDepths[d], maxCount);
+    }
+  }
+  std::fprintf(dest, "  leaves by primitive count:\n");
+  maxCount = 0;
+  for (int count : stats.leafSizes) maxCount = std::max(maxCount, count);
+  for (size_t n = 0; n < stats.leafSizes.size(); ++n) {
+    if (stats.leafSizes[n] > 0) {
+      PrintHistogramRow(dest, n, stats.leafSizes[n], maxCount);
+    }
+  }
+}
+
+void BVHAccel::computeMotionBounds() {
+  int nKnots = motionSegments + 1;
+  FreeAligned(motionBounds);
+  motionBounds = AllocAligned<Bounds3f>(totalNodes*nKnots);
+
+  // <bound the leaves' primitives at each knot>
+  ParallelFor([&](int64_t i) {
+    const LinearBVHNode &node = nodes[i];
+    if (node.nPrimitives == 0) {
+      return;
+    }
+    Bounds3f *knots = &motionBounds[i*nKnots];
+    Bounds3f primKnots[maxMotionSegments + 1];
+    for (int k = 0; k < nKnots; ++k) {
+      knots[k] = Bounds3f();
+    }
+    for (int j = 0; j < node.nPrimitives; ++j) {
+      primitives[node.primitiveOffset + j]->LinearMotionBounds(shutterOpen, shutterClose,
+          motionSegments, primKnots);
+      for (int k = 0; k < nKnots; ++k) {
+        knots[k] = Union(knots[k], primKnots[k]);
+      }
+    }
+  }, totalNodes, 1024);
+
+  // <union the children's bounds at each knot, children after their parent>
+  for (int i = totalNodes - 1; i >= 0; --i) {
+    const LinearBVHNode &node = nodes[i];
+    if (node.nPrimitives > 0) {
+      continue;
+    }
+    for (int k = 0; k < nKnots; ++k) {
+      motionBounds[i*nKnots + k] = Union(motionBounds[(i + 1)*nKnots + k],
+          motionBounds[node.secondChildOffset*nKnots + k]);
+    }
+  }
+}
+
+// <refit subtree sizing>
+// Subtrees are at most 1/64 of the tree, for enough parallel tasks and so that
+// a local deformation only rebuilds a small part of it, but not so small that
+// the serial pass over the nodes above them matters.
+static constexpr int refitSubtreeCount = 64;
+static constexpr int refitMinSubtreeNodes = 1024;
+
+Float BVHAccel::initRefit() {
+  refitRoots.clear();
+  refitEnds.clear();
+  refitUpperNodes.clear();
+  int grain = std::max(refitMinSubtreeNodes, totalNodes/refitSubtreeCount);
+  partitionRefitSubtrees(0, totalNodes, grain);
+
+  // <record the SAH cost of each subtree and of the whole tree>
+  int nSubtrees = refitRoots.size();
+  refitBuiltCost.resize(nSubtrees);
+  ParallelFor([&](int64_t s) {
+    refitBuiltCost[s] = refitRange(refitRoots[s], refitEnds[s], false);
+  }, nSubtrees);
+  Float cost = 0;
+  for (int s = 0; s < nSubtrees; ++s) {
+    cost += refitBuiltCost[s];
+  }
+  for (int nodeIndex : refitUpperNodes) {
+    cost += sahTraversalCost*nodes[nodeIndex].bounds.SurfaceArea();
+  }
+  return cost;
+}
+
+void BVHAccel::partitionRefitSubtrees(int nodeIndex, int end, int grain) {
+  // The nodes of a subtree are contiguous in the depth-first node array:
+  // nodeIndex's subtree is [nodeIndex, end).
+  const LinearBVHNode &node = nodes[nodeIndex];
+  if (node.nPrimitives > 0 || end - nodeIndex <= grain) {
+    refitRoots.push_back(nodeIndex);
+    refitEnds.push_back(end);
+    return;
+  }
+  refitUpperNodes.push_back(nodeIndex);
+  partitionRefitSubtrees(nodeIndex + 1, node.secondChildOffset, grain);
+  partitionRefitSubtrees(node.secondChildOffset, end, grain);
+}
+
+// <recompute the bounds of nodes [start, end) and return their SAH cost>
+// Costs are not divided by the root's area as in the build: the root grows
+// with the primitives that moved away, which would hide the degradation.
+// Children always follow their parent in the depth-first node array, so a
+// reverse sweep sees both children of a node before the node itself.
+// Without updateBounds only the cost is computed; this keeps leaf boxes that
+// the build clipped tighter than their primitives' bounds (SBVH).
+Float BVHAccel::refitRange(int start, int end, bool updateBounds) {
+  Float cost = 0;
+  for (int i = end - 1; i >= start; --i) {
+    LinearBVHNode &node = nodes[i];
+    if (!updateBounds) {
+      cost += (node.nPrimitives > 0 ? node.nPrimitives : sahTraversalCost)*
+          node.bounds.SurfaceArea();
+    }
+    else if (node.nPrimitives > 0) {
+      Bounds3f b;
+      for (int j = 0; j < node.nPrimitives; ++j) {
+        b = Union(b, primitives[node.primitiveOffset + j]->WorldBound());
+      }
+      node.bounds = b;
+      cost += node.nPrimitives*b.SurfaceArea();
+    }
+    else {
+      node.bounds = Union(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds);
+      cost += sahTraversalCost*node.bounds.SurfaceArea();
+    }
+  }
+  return cost;
+}
+
+void BVHAccel::Refit(Float maxSAHGrowth) {
+
+  if (primitives.size() == 0) {
+    return;
+  }
+  // <quantized BVHs keep no binary nodes to refit, so they are rebuilt>
+  if (!nodes) {
+    build();
+    buildLayouts();
+    return;
+  }
+
+  // <refit the subtrees in parallel, then the nodes above them>
+  int nSubtrees = refitRoots.size();
+  std::vector<Float> subtreeCost(nSubtrees);
+  ParallelFor([&](int64_t s) {
+    subtreeCost[s] = refitRange(refitRoots[s], refitEnds[s], true);
+  }, nSubtrees);
+  Float cost = 0;
+  for (int s = 0; s < nSubtrees; ++s) {
+    cost += subtreeCost[s];
+  }
+  for (auto it = refitUpperNodes.rbegin(); it != refitUpperNodes.rend(); ++it) {
+    LinearBVHNode &node = nodes[*it];
+    node.bounds = Union(nodes[*it + 1].bounds, nodes[node.secondChildOffset].bounds);
+    cost += sahTraversalCost*node.bounds.SurfaceArea();
+  }
+  sahCost = cost;
+
+  // <rebuild what degraded once the tree's SAH cost grew too much>
+  if (sahCost > maxSAHGrowth*builtSAHCost) {
+    std::vector<int> degraded;
+    int degradedNodes = 0;
+    for (int s = 0; s < nSubtrees; ++s) {
+      if (subtreeCost[s] > maxSAHGrowth*refitBuiltCost[s]) {
+        degraded.push_back(s);
+        degradedNodes += refitEnds[s] - refitRoots[s];
+      }
+    }
+    // The nodes above the subtrees can only be fixed by a full rebuild, so
+    // one is done when they are what degraded, or when most subtrees did.
+    if (degraded.empty() || 2*degradedNodes > totalNodes || !rebuildSubtrees(degraded)) {
+      build();
+      buildLayouts();
+      return;
+    }
+    // The partially rebuilt tree is the new baseline. Otherwise nodes above the
+    // subtrees that grew with the geometry would keep the cost over the old
+    // one, and the next Refit would find no degraded subtree and rebuild it all.
+    builtSAHCost = sahCost;
+  }
+  computeOccluderOrder(0);
+
+  buildLayouts();
+}
+
+// <shift the primitive offsets of a subtree built over a slice of primitives>
+static void OffsetLeafPrimitives(BVHBuildNode* node, int offset) {
+  if (node->nPrimitives > 0) {
+    node->firstPrimOffset += offset;
+    return;
+  }
+  OffsetLeafPrimitives(node->children[0], offset);
+  OffsetLeafPrimitives(node->children[1], offset);
+}
+
+bool BVHAccel::rebuildSubtrees(const std::vector<int>& subtrees) {
+
+  // <an SBVH subtree may reference a primitive more than once; rebuild it all>
+  if (!inputPrimitives.empty()) {
+    return false;
+  }
+
+  // <find the primitives under each subtree>
+  // They are contiguous for trees from recursiveBuild or after treelet
+  // restructuring, but not necessarily above the treelets of an HLBVH; the
+  // caller rebuilds everything then.
+  std::vector<int> primStart, primEnd;
+  for (int s : subtrees) {
+    int p0 = (int)primitives.size(), p1 = 0, n = 0;
+    for (int i = refitRoots[s]; i < refitEnds[s]; ++i) {
+      const LinearBVHNode &node = nodes[i];
+      if (node.nPrimitives > 0) {
+        p0 = std::min(p0, node.primitiveOffset);
+        p1 = std::max(p1, node.primitiveOffset + node.nPrimitives);
+        n += node.nPrimitives;
+      }
+    }
+    if (p1 - p0 != n) {
+      return false;
+    }
+    primStart.push_back(p0);
+    primEnd.push_back(p1);
+  }
+
+  // <build each subtree again over its primitives>
+  std::vector<std::unique_ptr<MemoryArena>> threadArenas;
+  for (int i = 0; i < MaxThreadIndex(); ++i) {
+    threadArenas.push_back(std::unique_ptr<MemoryArena>(new MemoryArena(1024*1024)));
+  }
+  std::vector<std::pair<int, BVHBuildNode*>> rebuilt;
+  std::atomic<int> newTotalNodes(totalNodes);
+  for (size_t i = 0; i < subtrees.size(); ++i) {
+    int p0 = primStart[i], n = primEnd[i] - p0;
+    std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+    ParallelFor([&](int64_t j) {
+      primitiveInfo[j] = {(size_t)(p0 + j), primitives[p0 + j]->WorldBound()};
+    }, n, 4096);
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(n);
+    newTotalNodes -= refitEnds[subtrees[i]] - refitRoots[subtrees[i]];
+    BVHBuildNode *root =
+        recursiveBuild(threadArenas, primitiveInfo, 0, n, &newTotalNodes, orderedPrims);
+    OffsetLeafPrimitives(root, p0);
+    rebuilt.push_back(std::make_pair(refitRoots[subtrees[i]], root));
+    std::copy(orderedPrims.begin(), orderedPrims.end(), primitives.begin() + p0);
+  }
+
+  // <flatten the tree again, copying the nodes outside the rebuilt subtrees>
+  LinearBVHNode *oldNodes = nodes;
+  totalNodes = newTotalNodes;
+  nodes = AllocAligned<LinearBVHNode>(totalNodes);
+  int offset = 0;
+  relinkBVHTree(oldNodes, 0, rebuilt, &offset);
+  releaseNodes(oldNodes);
+  sahCost = initRefit();
+  return true;
+}
+
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+    std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+    std::atomic<int>* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims) const {
+
+  BVHBuildNode *node = threadArenas[ThreadIndex]->Alloc<BVHBuildNode>();
+  (*totalNodes)++;
+
+  // <compute bounds of all primitives and of their centroids in BVH node>
+  Bounds3f bounds, centroidBounds;
+  ComputeRangeBounds(primitiveInfo, start, end, &bounds, &centroidBounds);
+
+  // <create leaf BVHBuildNode>
+  // Subtrees partition primitiveInfo in place, so a leaf's primitives are exactly
+  // primitiveInfo[start, end) and land at the same offsets in orderedPrims; this
+  // needs no synchronization when subtrees are built in parallel.
+  auto createLeaf = [&]() {
+    for (int i = start; i < end; ++i) {
+      orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+    }
+    node->InitLeaf(start, end - start, bounds);
+    return node;
+  };
+
+  int nPrimitives = end - start;
+  if (nPrimitives == 1) {
+    return createLeaf();
+  }
+
+  // <choose split dimension dim>
+  int dim = centroidBounds.MaximumExtent();
+
+  // <partition primitives into two sets and build children>
+  int mid = (start + end)/2;
+  if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+    // <all centroids coincide; split by count only if the leaf would be too big>
+    if (nPrimitives <= maxPrimsInNode) {
+      return createLeaf();
+    }
+  }
+  else {
+    // <partition primitives based on splitMethod>
+    switch(splitMethod) {
+    case SplitMethod::Middle: {
+      // <partition primitives through node's midpoint>
+      Float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim])/2;
+      BVHPrimitiveInfo *midPtr = std::partition(&primitiveInfo[start], &primitiveInfo[end-1]+1,
+          [dim, pmid](const BVHPrimitiveInfo& pi) {
+        return pi.centroid[dim] < pmid;
+      });
+      mid = midPtr - &primitiveInfo[0];
+      if (mid != start && mid != end) {
+        break;
+      }
+    }
+    // fall through
+    case SplitMethod::EqualCounts: {
+      // <partition primitives into equally-sized subsets>
+      mid = (start + end)/2;
+      std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end-1]+1,
+          [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+        return a.centroid[dim] < b.centroid[dim];
+      });
+      break;
+    }
+    case SplitMethod::SAH:
+    default: {
+      // <partition primitives using binned SAH over all three axes>
+      Vector3f scale;
+      for (int axis = 0; axis < 3; ++axis) {
+        Float extent = centroidBounds.pMax[axis] - centroidBounds.pMin[axis];
+        scale[axis] = extent > 0 ? nSAHBuckets/extent : 0;
+      }
+      BucketInfo buckets[3][nSAHBuckets];
+      BinPrimitives(primitiveInfo, start, end, centroidBounds, scale, buckets);
+      SAHSplit split = FindSAHSplit(buckets, scale, bounds);
+
+      // <either create leaf or split primitives at selected SAH bucket>
+      Float leafCost = nPrimitives;
+      if (nPrimitives <= maxPrimsInNode && split.cost >= leafCost) {
+        return createLeaf();
+      }
+      dim = split.axis;
+      BVHPrimitiveInfo *pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end-1]+1,
+          [=](const BVHPrimitiveInfo& pi) {
+        return SAHBucket(pi.centroid, centroidBounds, scale, dim) <= split.bucket;
+      });
+      mid = pmid - &primitiveInfo[0];
+      break;
+    }
+    }
+  }
+
+  // <build children, in parallel for large subtrees>
+  BVHBuildNode *children[2];
+  if (nPrimitives > parallelBuildThreshold) {
+    ParallelFor([&](int64_t child) {
+      children[child] = (child == 0) ?
+          recursiveBuild(threadArenas, primitiveInfo, start, mid, totalNodes, orderedPrims) :
+          recursiveBuild(threadArenas, primitiveInfo, mid, end, totalNodes, orderedPrims);
+    }, 2);
+  }
+  else {
+    children[0] = recursiveBuild(threadArenas, primitiveInfo, start, mid, totalNodes, orderedPrims);
+    children[1] = recursiveBuild(threadArenas, primitiveInfo, mid, end, totalNodes, orderedPrims);
+  }
+  node->InitInterior(dim, children[0], children[1]);
+  return node;
+}
+
+// <SBVH parameters>
+// Spatial splits are only searched for when the children of the best object
+// split overlap by more than sbvhOverlapThreshold of the root's area, as in
+// Stich et al., "Spatial Splits in Bounding Volume Hierarchies".
+static constexpr int nSpatialBins = 32;
+static constexpr Float sbvhOverlapThreshold = 1e-5f;
+
+struct SBVHBuildState {
+  // triangles[i] is primitive i's Triangle, whose parts are clipped exactly;
+  // the boxes of other primitives are clipped instead
+  std::vector<const Triangle*> triangles;
+  Float rootArea;
+  int maxReferences;
+  std::atomic<int> nReferences{0};
+  std::atomic<int> totalNodes{0};
+  // leaves store their references here, at offsets taken in any order
+  std::vector<int> leafPrimitives;
+  std::atomic<int> leafOffset{0};
+};
+
+// <intersection of two boxes, or an empty box if they don't overlap>
+inline Bounds3f ClipBounds(const Bounds3f& a, const Bounds3f& b) {
+  Bounds3f r = Intersect(a, b);
+  for (int axis = 0; axis < 3; ++axis) {
+    if (r.pMin[axis] > r.pMax[axis]) {
+      return Bounds3f();
+    }
+  }
+  return r;
+}
+
+// <split the part of a primitive inside b at plane axis = pos>
+static void SplitReference(const Triangle* triangle, const Bounds3f& b, int axis, Float pos,
+    Bounds3f* left, Bounds3f* right) {
+  *left = *right = Bounds3f();
+  if (triangle) {
+    // <bound the triangle's vertices and edge crossings on each side of the plane>
+    Point3f p[3];
+    triangle->GetVertices(p);
+    for (int i = 0; i < 3; ++i) {
+      const Point3f &v0 = p[i], &v1 = p[(i + 1) % 3];
+      if (v0[axis] <= pos) *left = Union(*left, v0);
+      if (v0[axis] >= pos) *right = Union(*right, v0);
+      if ((v0[axis] < pos && pos < v1[axis]) || (v1[axis] < pos && pos < v0[axis])) {
+        Float t = Clamp((pos - v0[axis])/(v1[axis] - v0[axis]), 0, 1);
+        Point3f crossing = Lerp(t, v0, v1);
+        crossing[axis] = pos;
+        *left = Union(*left, crossing);
+        *right = Union(*right, crossing);
+      }
+    }
+  }
+  else {
+    *left = *right = b;
+  }
+  left->pMax[axis] = std::min(left->pMax[axis], pos);
+  right->pMin[axis] = std::max(right->pMin[axis], pos);
+  *left = ClipBounds(*left, b);
+  *right = ClipBounds(*right, b);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(MemoryArena& arena,
-    std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int* totalNodes,
-    std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+inline bool IsEmpty(const Bounds3f& b) {
+  return b.pMin.x > b.pMax.x;
+}
 
-  BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
-  (*totalNodes)++;
+// <best spatial split of references: the plane axis = pos, with the
+// bounds and reference counts of both sides if straddlers are duplicated>
+struct SpatialSplit {
+  Float cost = Infinity;
+  int axis = -1;
+  Float pos;
+  Bounds3f bounds[2];
+  int count[2];
+};
 
-  // <compute bounds of all primitives in BVH node>
+struct SpatialBin {
   Bounds3f bounds;
-  for (int i = start; i < end; ++i) {
-    bounds = Union(bounds, primitiveInfo[i].bounds);
-  }
+  int enter = 0, exit = 0;
+};
 
-  int nPrimitives = end - start;
-  if (nPrimitives == 1) {
-    // <create leaf BVHBuildNode>
-    int firstPrimOffset = orderedPrims.size();
-    for (int i = start; i < end; ++i) {
-      int primNum = primitiveInfo[i].primitiveNumber;
-      orderedPrims.push_back(primitives[primNum]);
+static SpatialSplit FindSpatialSplit(const std::vector<BVHPrimitiveInfo>& references,
+    const Bounds3f& bounds, const SBVHBuildState& state) {
+
+  SpatialSplit best[3];
+  auto searchAxis = [&](int axis) {
+    Float extent = bounds.pMax[axis] - bounds.pMin[axis];
+    if (extent <= 0) {
+      return;
     }
-    node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-    return node;
-  }
-  else {
-    // <compute bound of primitive centroids, choose split dimension dim>
-    Bounds3f centroidBounds;
-    for (int i = start; i < end; ++i) {
-      centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+    Float origin = bounds.pMin[axis], binWidth = extent/nSpatialBins;
+    Float invWidth = 1/binWidth;
+
+    // <clip each reference into the bins it spans>
+    SpatialBin bins[nSpatialBins];
+    for (const BVHPrimitiveInfo& ref : references) {
+      int first = Clamp((int)((ref.bounds.pMin[axis] - origin)*invWidth), 0, nSpatialBins - 1);
+      int last = Clamp((int)((ref.bounds.pMax[axis] - origin)*invWidth), first, nSpatialBins - 1);
+      Bounds3f rest = ref.bounds;
+      for (int b = first; b < last; ++b) {
+        Bounds3f left, right;
+        SplitReference(state.triangles[ref.primitiveNumber], rest, axis,
+            origin + binWidth*(b + 1), &left, &right);
+        bins[b].bounds = Union(bins[b].bounds, left);
+        rest = right;
+      }
+      bins[last].bounds = Union(bins[last].bounds, rest);
+      bins[first].enter++;
+      bins[last].exit++;
     }
-    int dim = centroidBounds.MaximumExtent();
 
-    // <partition primitives into two sets and build children>
-    int mid = (start + end)/2;
-    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
-      // <create leaf BVHBuildNode>
-      int firstPrimOffset = orderedPrims.size();
-      for (int i = start; i < end; ++i) {
-        int primNum = primitiveInfo[i].primitiveNumber;
-        orderedPrims.push_back(primitives[primNum]);
+    // <sweep from the right, then from the left, as for object splits>
+    Bounds3f boundsAbove[nSpatialBins - 1];
+    int countAbove[nSpatialBins - 1];
+    Bounds3f b1;
+    int count1 = 0;
+    for (int i = nSpatialBins - 1; i > 0; --i) {
+      b1 = Union(b1, bins[i].bounds);
+      count1 += bins[i].exit;
+      boundsAbove[i - 1] = b1;
+      countAbove[i - 1] = count1;
+    }
+    Bounds3f b0;
+    int count0 = 0;
+    for (int i = 0; i < nSpatialBins - 1; ++i) {
+      b0 = Union(b0, bins[i].bounds);
+      count0 += bins[i].enter;
+      if (count0 == 0 || countAbove[i] == 0) {
+        continue;
+      }
+      Float cost = sahTraversalCost + (count0*b0.SurfaceArea() +
+          countAbove[i]*boundsAbove[i].SurfaceArea())/bounds.SurfaceArea();
+      if (cost < best[axis].cost) {
+        best[axis].cost = cost;
+        best[axis].axis = axis;
+        best[axis].pos = origin + binWidth*(i + 1);
+        best[axis].bounds[0] = b0;
+        best[axis].bounds[1] = boundsAbove[i];
+        best[axis].count[0] = count0;
+        best[axis].count[1] = countAbove[i];
       }
-      node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-      return node;
+    }
+  };
+  if (references.size() > parallelBuildThreshold) {
+    ParallelFor([&](int64_t axis) { searchAxis(axis); }, 3);
+  }
+  else {
+    for (int axis = 0; axis < 3; ++axis) searchAxis(axis);
+  }
+  int axis = best[0].cost <= best[1].cost ? 0 : 1;
+  return best[2].cost < best[axis].cost ? best[2] : best[axis];
+}
+
+// <partition references at a spatial split, duplicating straddlers within budget>
+// Straddling references are kept whole on one side when that is cheaper than
+// splitting them ("reference unsplitting"), or when the budget is used up.
+// Returns false, with nothing changed, if either side ends up empty.
+static bool SpatialPartition(const std::vector<BVHPrimitiveInfo>& references,
+    const SpatialSplit& split, SBVHBuildState& state,
+    std::vector<BVHPrimitiveInfo>* left, std::vector<BVHPrimitiveInfo>* right) {
+
+  Bounds3f bounds[2] = {split.bounds[0], split.bounds[1]};
+  int count[2] = {split.count[0], split.count[1]};
+  int axis = split.axis, nDuplicated = 0;
+  for (const BVHPrimitiveInfo& ref : references) {
+    if (ref.bounds.pMax[axis] <= split.pos) {
+      left->push_back(ref);
+    }
+    else if (ref.bounds.pMin[axis] >= split.pos) {
+      right->push_back(ref);
     }
     else {
-      // <partition primitives based on splitMethod>
-      switch(splitMethod) {
-      case SplitMethod::Middle:{
-        // <partition primitives through node's midpoint>
-        Float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim])/2;
-        BVHPrimitiveInfo *midPtr = std::partition(&primitiveInfo[start], &primitiveInfo[end-1]+1,
-            [dim, pmid](const BVHPrimitiveInfo& pi) {
-          return pi.centroid[dim] < pmid;
-        });
-        mid = midPtr - &primitiveInfo[0];
-        if (mid != start && mid != end) {
-          break;
-        }
+      Bounds3f l, r;
+      SplitReference(state.triangles[ref.primitiveNumber], ref.bounds, axis, split.pos, &l, &r);
+      Float area[2] = {bounds[0].SurfaceArea(), bounds[1].SurfaceArea()};
+      Float splitCost = area[0]*count[0] + area[1]*count[1];
+      Float leftCost = Union(bounds[0], ref.bounds).SurfaceArea()*count[0] + area[1]*(count[1] - 1);
+      Float rightCost = area[0]*(count[0] - 1) + Union(bounds[1], ref.bounds).SurfaceArea()*count[1];
+      bool duplicate = !IsEmpty(l) && !IsEmpty(r) &&
+          splitCost < std::min(leftCost, rightCost);
+      if (duplicate && state.nReferences++ >= state.maxReferences) {
+        state.nReferences--;
+        duplicate = false;
       }
-      case SplitMethod::EqualCounts: {
-        // <partition primitives into equally-sized subsets>
-        mid = (start + end)/2;
-        std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end-1]+1,
-            [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
-          return a.centroid[dim] < b.centroid[dim];
-        });
-        break;
+      if (duplicate) {
+        left->push_back(BVHPrimitiveInfo(ref.primitiveNumber, l));
+        right->push_back(BVHPrimitiveInfo(ref.primitiveNumber, r));
+        ++nDuplicated;
       }
-      case SplitMethod::SAH:
-      default: {
-        // <partition primitives using approximate SAH>
-        if (nPrimitives <= 4) {
-          // <partition primitives into equally sized subsets>
-          mid = (start + end)/2;
-          std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end-1]+1,
-              [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
-            return a.centroid[dim] < b.centroid[dim];
-          });
-        }
-        else {
-          // <allocate BucketInfo for SAH partition buckets>
-          constexpr int nBuckets = 12;
-          struct BucketInfo {
-            int count = 0;
-            Bounds3f bounds;
-          };
-          BucketInfo buckets[nBuckets];
-
-          // <initialize BucketInfo for SAH partition buckets>
-          for (int i = start; i < end; ++i) {
-            int b = nBuckets*centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-            if (b == nBuckets) b = nBuckets - 1;
-            buckets[b].count++;
-            buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
-          }
+      else if (IsEmpty(r) || (!IsEmpty(l) && leftCost <= rightCost)) {
+        left->push_back(ref);
+        bounds[0] = Union(bounds[0], ref.bounds);
+        count[1]--;
+      }
+      else {
+        right->push_back(ref);
+        bounds[1] = Union(bounds[1], ref.bounds);
+        count[0]--;
+      }
+    }
+  }
+  if (left->empty() || right->empty()) {
+    state.nReferences -= nDuplicated;
+    left->clear();
+    right->clear();
+    return false;
+  }
+  return true;
+}
 
-          // <compute costs for splitting after each bucket>
-          Float cost[nBuckets-1];
-          for (int i = 0; i < nBuckets-1; ++i) {
-            Bounds3f b0, b1;
-            int count0 = 0, count1 = 0;
-            for (int j = 0; j <= i; ++j) {
-              b0 = Union(b0, buckets[j].bounds);
-              count0 += buckets[j].count;
-            }
-            for (int j = i+1; j < nBuckets; ++j) {
-              b1 = Union(b1, buckets[j].bounds);
-              count1 += buckets[j].count;
-            }
-            cost[i] = .125f +
-                (count0*b0.SurfaceArea() + count1*b1.SurfaceArea())/bounds.SurfaceArea();
-          }
+BVHBuildNode* BVHAccel::recursiveSBVHBuild(std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+    std::vector<BVHPrimitiveInfo>& references, SBVHBuildState& state) const {
 
-          // <find bucket to split at that minimizes SAH metric>
-          Float minCost = cost[0];
-          int minCostSplitBucket = 0;
-          for (int i = 1; i < nBuckets-1; ++i) {
-            if (cost[i] < minCost) {
-              minCost = cost[i];
-              minCostSplitBucket = i;
-            }
-          }
+  BVHBuildNode *node = threadArenas[ThreadIndex]->Alloc<BVHBuildNode>();
+  state.totalNodes++;
+  int nReferences = references.size();
 
-          // <either create leaf or split primitives at selected SAH bucket>
-          Float leafCost = nPrimitives;
-          if (nPrimitives > maxPrimsInNode || minCost < leafCost) {
-            BVHPrimitiveInfo *pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end-1]+1,
-                [=](const BVHPrimitiveInfo& pi) {
-              int b = nBuckets*centroidBounds.Offset(pi.centroid)[dim];
-              if (b == nBuckets) b = nBuckets - 1;
-              return b <= minCostSplitBucket;
-            });
-            mid = pmid - &primitiveInfo[0];
-          }
-          else {
-            // <create leaf BVHBuildNode>
-            int firstPrimOffset = orderedPrims.size();
-            for (int i = start; i < end; ++i) {
-              int primNum = primitiveInfo[i].primitiveNumber;
-              orderedPrims.push_back(primitives[primNum]);
-            }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-          }
-        }
-        }
-      }
-      node->InitInterior(dim,
-          recursiveBuild(arena, primitiveInfo, start, mid, totalNodes, orderedPrims),
-          recursiveBuild(arena, primitiveInfo, mid, end, totalNodes, orderedPrims));
+  // <compute bounds of all references and of their centroids>
+  Bounds3f bounds, centroidBounds;
+  ComputeRangeBounds(references, 0, nReferences, &bounds, &centroidBounds);
+
+  auto createLeaf = [&]() {
+    int offset = state.leafOffset.fetch_add(nReferences);
+    for (int i = 0; i < nReferences; ++i) {
+      state.leafPrimitives[offset + i] = references[i].primitiveNumber;
+    }
+    node->InitLeaf(offset, nReferences, bounds);
+    return node;
+  };
+  if (nReferences == 1) {
+    return createLeaf();
+  }
+
+  // <find the best object split>
+  Vector3f scale;
+  for (int axis = 0; axis < 3; ++axis) {
+    Float extent = centroidBounds.pMax[axis] - centroidBounds.pMin[axis];
+    scale[axis] = extent > 0 ? nSAHBuckets/extent : 0;
+  }
+  BucketInfo buckets[3][nSAHBuckets];
+  BinPrimitives(references, 0, nReferences, centroidBounds, scale, buckets);
+  SAHSplit objectSplit = FindSAHSplit(buckets, scale, bounds);
+
+  // <find the best spatial split if the object split's children overlap>
+  SpatialSplit spatialSplit;
+  Bounds3f overlap = objectSplit.axis >= 0 ?
+      ClipBounds(objectSplit.bounds[0], objectSplit.bounds[1]) : bounds;
+  if (!IsEmpty(overlap) && overlap.SurfaceArea() > sbvhOverlapThreshold*state.rootArea &&
+      state.nReferences < state.maxReferences) {
+    spatialSplit = FindSpatialSplit(references, bounds, state);
+  }
+
+  Float minCost = std::min(objectSplit.cost, spatialSplit.cost);
+  if (nReferences <= maxPrimsInNode && minCost >= nReferences) {
+    return createLeaf();
+  }
+
+  // <partition references into the two children>
+  std::vector<BVHPrimitiveInfo> children[2];
+  int dim = 0;
+  if (spatialSplit.cost < objectSplit.cost &&
+      SpatialPartition(references, spatialSplit, state, &children[0], &children[1])) {
+    dim = spatialSplit.axis;
+  }
+  else if (objectSplit.axis >= 0) {
+    dim = objectSplit.axis;
+    for (const BVHPrimitiveInfo& ref : references) {
+      children[SAHBucket(ref.centroid, centroidBounds, scale, dim) > objectSplit.bucket].push_back(ref);
     }
   }
+  else if (nReferences <= maxPrimsInNode) {
+    return createLeaf();
+  }
+  else {
+    // <all centroids coincide; split by count>
+    int mid = nReferences/2;
+    children[0].assign(references.begin(), references.begin() + mid);
+    children[1].assign(references.begin() + mid, references.end());
+  }
+  std::vector<BVHPrimitiveInfo>().swap(references);
+
+  // <build children, in parallel for large subtrees>
+  BVHBuildNode *childNodes[2];
+  if (nReferences > parallelBuildThreshold) {
+    ParallelFor([&](int64_t child) {
+      childNodes[child] = recursiveSBVHBuild(threadArenas, children[child], state);
+    }, 2);
+  }
+  else {
+    childNodes[0] = recursiveSBVHBuild(threadArenas, children[0], state);
+    childNodes[1] = recursiveSBVHBuild(threadArenas, children[1], state);
+  }
+  node->InitInterior(dim, childNodes[0], childNodes[1]);
   return node;
 }
 
+// <give leaves consecutive primitive offsets in depth-first order>
+// Leaves were filled in whatever order the parallel build finished them; after
+// this every subtree's primitives are contiguous, as from recursiveBuild.
+static void GatherLeafPrimitives(BVHBuildNode* node, const std::vector<int>& leafPrimitives,
+    const std::vector<std::shared_ptr<Primitive>>& primitives,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+  if (node->nPrimitives > 0) {
+    int first = orderedPrims.size();
+    for (int i = 0; i < node->nPrimitives; ++i) {
+      orderedPrims.push_back(primitives[leafPrimitives[node->firstPrimOffset + i]]);
+    }
+    node->firstPrimOffset = first;
+    return;
+  }
+  GatherLeafPrimitives(node->children[0], leafPrimitives, primitives, orderedPrims);
+  GatherLeafPrimitives(node->children[1], leafPrimitives, primitives, orderedPrims);
+}
+
+BVHBuildNode* BVHAccel::SBVHBuild(std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims) const {
+
+  SBVHBuildState state;
+  state.triangles.resize(primitives.size());
+  ParallelFor([&](int64_t i) {
+    state.triangles[i] = GetTriangle(primitives[i].get());
+  }, primitives.size(), 4096);
+  std::vector<BVHPrimitiveInfo> references(primitiveInfo);
+  Bounds3f bounds, centroidBounds;
+  ComputeRangeBounds(references, 0, references.size(), &bounds, &centroidBounds);
+  state.rootArea = bounds.SurfaceArea();
+  state.nReferences = primitives.size();
+  state.maxReferences = primitives.size()*(1 + std::max<Float>(0, maxSplitDuplication));
+  state.leafPrimitives.resize(state.maxReferences);
+
+  BVHBuildNode *root = recursiveSBVHBuild(threadArenas, references, state);
+  *totalNodes = state.totalNodes;
+  orderedPrims.reserve(state.leafOffset);
+  GatherLeafPrimitives(root, state.leafPrimitives, primitives, orderedPrims);
+  return root;
+}
+
 inline uint32_t LeftShift3(uint32_t x) {
   if (x == (1 << 10)) --x;
   x = (x | (x << 16)) & 0b00000011000000000000000011111111;
   x = (x | (x <<  8)) & 0b00000011000000001111000000001111;
   x = (x | (x <<  4)) & 0b00000011000011000011000011000011;
   x = (x | (x <<  2)) & 0b00001001001001001001001001001001;
+  return x;
 }
 
 inline uint32_t EncodeMorton3(const Vector3f& v) {
@@ -386,12 +2130,26 @@ struct LBVHTreelet {
   BVHBuildNode *buildNodes;
 };
 
+// <split [0,n) into one chunk per thread, or a single chunk when n is small>
+inline int RadixSortChunks(size_t n) {
+  return (n <= (size_t)parallelBuildThreshold) ? 1 : MaxThreadIndex();
+}
+
 static void RadixSort(std::vector<MortonPrimitive>* v) {
 
   std::vector<MortonPrimitive> tempVector(v->size());
   constexpr int bitsPerPass = 6;
   constexpr int nBits = 30;
   constexpr int nPasses = nBits/bitsPerPass;
+  constexpr int nBuckets = 1 << bitsPerPass;
+  constexpr int bitMask = (1 << bitsPerPass) - 1;
+
+  // <each chunk keeps its own histogram and output offsets>
+  const int64_t n = v->size();
+  const int nChunks = RadixSortChunks(n);
+  std::vector<std::array<int, nBuckets>> chunkCount(nChunks);
+  auto chunkStart = [&](int c) { return (int)(n*c/nChunks); };
+
   for (int pass = 0; pass < nPasses; ++pass) {
     // <perform one pass of radix sort, sorting bitsPerPass bits>
     int lowBit = pass*bitsPerPass;
@@ -400,28 +2158,35 @@ static void RadixSort(std::vector<MortonPrimitive>* v) {
     std::vector<MortonPrimitive> &in = (pass & 1) ? tempVector : *v;
     std::vector<MortonPrimitive> &out = (pass & 1) ? *v : tempVector;
 
-
-    // <count number of zero bits in array for current radix sort bit>
-    constexpr int nBuckets = 1 << bitsPerPass;
-    int bucketCount[nBuckets] = {0};
-    constexpr int bitMask = (1 << bitsPerPass) - 1;
-    for (const MortonPrimitive &mp : in) {
-      int bucket = (mp.mortonCode >> lowBit) & bitMask;
-      ++bucketCount[bucket];
-    }
-
-    // <compute starting index in output array for each bucket>
-    int outIndex[nBuckets];
-    outIndex[0] = 0;
-    for (int i = 1; i < nBuckets; ++i) {
-      outIndex[i] = outIndex[i-1] + bucketCount[i-1];
+    // <count bucket occupancy per chunk>
+    ParallelFor([&](int64_t c) {
+      std::array<int, nBuckets> &count = chunkCount[c];
+      count.fill(0);
+      for (int i = chunkStart(c); i < chunkStart(c + 1); ++i) {
+        ++count[(in[i].mortonCode >> lowBit) & bitMask];
+      }
+    }, nChunks);
+
+    // <compute starting index in output array for each bucket of each chunk>
+    // Buckets are laid out in order and, within a bucket, chunks in order,
+    // which keeps the sort stable.
+    int offset = 0;
+    for (int b = 0; b < nBuckets; ++b) {
+      for (int c = 0; c < nChunks; ++c) {
+        int count = chunkCount[c][b];
+        chunkCount[c][b] = offset;
+        offset += count;
+      }
     }
 
     // <store sorted values in output array>
-    for (const MortonPrimitive &mp : in) {
-      int bucket = (mp.mortonCode >> lowBit) & bitMask;
-      out[outIndex[bucket]++]= mp;
-    }
+    ParallelFor([&](int64_t c) {
+      std::array<int, nBuckets> &outIndex = chunkCount[c];
+      for (int i = chunkStart(c); i < chunkStart(c + 1); ++i) {
+        int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+        out[outIndex[bucket]++] = in[i];
+      }
+    }, nChunks);
   }
   // <copy final result from tempVector, if needed>
   if (nPasses & 1) {
@@ -429,15 +2194,47 @@ static void RadixSort(std::vector<MortonPrimitive>* v) {
   }
 }
 
+// <find the start of every run of primitives sharing the masked Morton bits>
+static std::vector<int> FindTreeletStarts(const std::vector<MortonPrimitive>& mortonPrims,
+    uint32_t mask) {
+
+  const int64_t n = mortonPrims.size();
+  const int nChunks = RadixSortChunks(n);
+  auto chunkStart = [&](int c) { return (int)(n*c/nChunks); };
+  auto isStart = [&](int i) {
+    return i == 0 ||
+        (mortonPrims[i-1].mortonCode & mask) != (mortonPrims[i].mortonCode & mask);
+  };
+
+  // <count boundaries per chunk, then scatter them at their prefix offsets>
+  std::vector<int> chunkOffset(nChunks + 1, 0);
+  ParallelFor([&](int64_t c) {
+    int count = 0;
+    for (int i = chunkStart(c); i < chunkStart(c + 1); ++i) {
+      count += isStart(i);
+    }
+    chunkOffset[c + 1] = count;
+  }, nChunks);
+  for (int c = 0; c < nChunks; ++c) {
+    chunkOffset[c + 1] += chunkOffset[c];
+  }
+  std::vector<int> starts(chunkOffset[nChunks]);
+  ParallelFor([&](int64_t c) {
+    int offset = chunkOffset[c];
+    for (int i = chunkStart(c); i < chunkStart(c + 1); ++i) {
+      if (isStart(i)) starts[offset++] = i;
+    }
+  }, nChunks);
+  return starts;
+}
+
 BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena,
     std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
     std::vector<std::shared_ptr<Primitive>>& orderedPrims) const {
 
   // <compute bounding box of all primitive centroids>
-  Bounds3f bounds;
-  for (const BVHPrimitiveInfo &pi : primitiveInfo) {
-    bounds = Union(bounds, pi.centroid);
-  }
+  Bounds3f primBounds, bounds;
+  ComputeRangeBounds(primitiveInfo, 0, primitiveInfo.size(), &primBounds, &bounds);
 
   // <compute Morton indices of primitives>
   std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
@@ -456,20 +2253,16 @@ BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena,
 
   // <create LBVH treelets at bottom of BVH>
   // <find intervals of primitives for each treelet>
-  std::vector<LBVHTreelet> treeletsToBuild;
-  for (int start = 0, end = 1; end <= (int)mortonPrims.size(); ++end) {
-    uint32_t mask = 0b00111111111111000000000000000000;
-    if (end == (int)mortonPrims.size() || (
-        (mortonPrims[start].mortonCode & mask) !=
-            (mortonPrims[end].mortonCode & mask))) {
-      // <add entry to treeletsToBuild for this treelet>
-      int nPrimitives = end - start;
-      int maxBVHNodes = 2*nPrimitives;
-      BVHBuildNode *nodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
-      treeletsToBuild.push_back({start, nPrimitives, nodes});
-
-      start = end;
-    }
+  uint32_t mask = 0b00111111111111000000000000000000;
+  std::vector<int> treeletStarts = FindTreeletStarts(mortonPrims, mask);
+  treeletStarts.push_back(mortonPrims.size());
+
+  // <carve each treelet's 2*nPrimitives nodes out of one allocation>
+  BVHBuildNode *nodes = arena.Alloc<BVHBuildNode>(2*mortonPrims.size(), false);
+  std::vector<LBVHTreelet> treeletsToBuild(treeletStarts.size() - 1);
+  for (size_t i = 0; i + 1 < treeletStarts.size(); ++i) {
+    int start = treeletStarts[i];
+    treeletsToBuild[i] = {start, treeletStarts[i+1] - start, nodes + 2*start};
   }
   // <create LBVHs for treelets in parallel>
   std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
@@ -499,8 +2292,9 @@ BVHBuildNode* BVHAccel::emitLBVH(BVHBuildNode *&buildNodes,
     int nPrimitives, int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims,
     std::atomic<int>* orderedPrimsOffset, int bitIndex) const {
 
-  if (bitIndex == -1 || nPrimitives < maxPrimsInNode) {
-    // <create and return leaf node of LBVH treelet>
+  // <create and return leaf node of LBVH treelet>
+  // Treelet restructuring forms the leaves itself from single primitives.
+  if (bitIndex == -1 || nPrimitives < (treeletPasses > 0 ? 2 : maxPrimsInNode)) {
     (*totalNodes)++;
     BVHBuildNode *node = buildNodes++;
     Bounds3f bounds;
@@ -539,7 +2333,7 @@ BVHBuildNode* BVHAccel::emitLBVH(BVHBuildNode *&buildNodes,
     (*totalNodes)++;
     BVHBuildNode *node = buildNodes++;
     BVHBuildNode *lbvh[2] = {
-        emitLBVH(buildNodes, primitiveInfo, mortonPrims, nPrimitives, totalNodes,
+        emitLBVH(buildNodes, primitiveInfo, mortonPrims, splitOffset, totalNodes,
             orderedPrims, orderedPrimsOffset, bitIndex-1),
         emitLBVH(buildNodes, primitiveInfo, &mortonPrims[splitOffset],
             nPrimitives - splitOffset, totalNodes,
@@ -641,10 +2435,590 @@ BVHBuildNode* BVHAccel::buildUpperSAH(MemoryArena& arena, std::vector<BVHBuildNo
   return node;
 }
 
+// <TRBVH treelet restructuring>
+// After Karras and Aila, "Fast Parallel Construction of High-Quality Bounding
+// Volume Hierarchies". Every interior node roots a treelet, grown by expanding
+// its largest-area leaf until it has treeletSize leaves; the treelet's interior
+// nodes are then rearranged into the topology of least SAH cost, found
+// exhaustively over the subsets of its leaves. Nodes are visited bottom-up, so
+// the treelet leaves below a node are already optimized. A node whose
+// subtree would cost less as a single leaf is then collapsed into one, so
+// HLBVH, which otherwise leaves primitives grouped by Morton code, emits one
+// primitive per leaf and lets this pass form the leaves.
+static constexpr int treeletSize = 7;
+static constexpr int parallelTreeletDepth = 8;
+
+static void RestructureTreelet(BVHBuildNode* root) {
+  // <form the treelet by expanding its largest interior leaf>
+  BVHBuildNode *leaves[treeletSize], *interior[treeletSize - 1];
+  int nLeaves = 2, nInterior = 1;
+  leaves[0] = root->children[0];
+  leaves[1] = root->children[1];
+  interior[0] = root;
+  Float cost = sahTraversalCost*root->bounds.SurfaceArea();
+  while (nLeaves < treeletSize) {
+    int expand = -1;
+    Float maxArea = -1;
+    for (int i = 0; i < nLeaves; ++i) {
+      if (leaves[i]->nPrimitives == 0 && leaves[i]->bounds.SurfaceArea() > maxArea) {
+        expand = i;
+        maxArea = leaves[i]->bounds.SurfaceArea();
+      }
+    }
+    if (expand == -1) {
+      break;
+    }
+    BVHBuildNode *node = leaves[expand];
+    interior[nInterior++] = node;
+    cost += sahTraversalCost*maxArea;
+    leaves[expand] = node->children[0];
+    leaves[nLeaves++] = node->children[1];
+  }
+  for (int i = 0; i < nLeaves; ++i) {
+    cost += leaves[i]->cost;
+  }
+  root->cost = cost;
+  if (nLeaves < 3) {
+    return;
+  }
+
+  // <find the least-cost binary tree over every subset of the treelet leaves>
+  // A subset's partitions (p, s^p) are enumerated once each by requiring p to
+  // contain the lowest leaf of s; subsets of s are numerically smaller than s.
+  constexpr int maxSubsets = 1 << treeletSize;
+  Bounds3f subsetBounds[maxSubsets];
+  Float subsetCost[maxSubsets];
+  uint8_t subsetSplit[maxSubsets];
+  int nSubsets = 1 << nLeaves;
+  for (int i = 0; i < nLeaves; ++i) {
+    subsetBounds[1 << i] = leaves[i]->bounds;
+    subsetCost[1 << i] = leaves[i]->cost;
+  }
+  for (int s = 3; s < nSubsets; ++s) {
+    int lowest = s & -s;
+    if (s == lowest) {
+      continue;
+    }
+    subsetBounds[s] = Union(subsetBounds[s ^ lowest], subsetBounds[lowest]);
+    Float minCost = Infinity;
+    for (int p = (s - 1) & s; p != 0; p = (p - 1) & s) {
+      if ((p & lowest) && subsetCost[p] + subsetCost[s ^ p] < minCost) {
+        minCost = subsetCost[p] + subsetCost[s ^ p];
+        subsetSplit[s] = p;
+      }
+    }
+    subsetCost[s] = sahTraversalCost*subsetBounds[s].SurfaceArea() + minCost;
+  }
+  int all = nSubsets - 1;
+  if (subsetCost[all] >= cost*(1 - 1e-4f)) {
+    return;
+  }
+
+  // <rebuild the treelet from its interior nodes in the optimal topology>
+  std::pair<BVHBuildNode*, int> todo[treeletSize - 1];
+  int nTodo = 0, nextInterior = 1;
+  todo[nTodo++] = std::make_pair(root, all);
+  while (nTodo > 0) {
+    BVHBuildNode *node = todo[--nTodo].first;
+    int s = todo[nTodo].second;
+    int sides[2] = { subsetSplit[s], s ^ subsetSplit[s] };
+    for (int c = 0; c < 2; ++c) {
+      if ((sides[c] & (sides[c] - 1)) == 0) {
+        int leaf = 0;
+        while ((1 << leaf) != sides[c]) ++leaf;
+        node->children[c] = leaves[leaf];
+      }
+      else {
+        node->children[c] = interior[nextInterior++];
+        todo[nTodo++] = std::make_pair(node->children[c], sides[c]);
+      }
+    }
+    // <split along the axis that separates the children the most>
+    Vector3f d = (subsetBounds[sides[1]].pMin + subsetBounds[sides[1]].pMax) -
+        (subsetBounds[sides[0]].pMin + subsetBounds[sides[0]].pMax);
+    node->splitAxis = MaxDimension(Abs(d));
+    node->bounds = subsetBounds[s];
+    node->cost = subsetCost[s];
+  }
+}
+
+// Returns the number of primitives under node. Only nodes with at least
+// minPrimitives below them are restructured. Collapsed nodes get their
+// primitive count but keep their children until the primitives are gathered.
+static int RestructureTreelets(BVHBuildNode* node, int depth, int minPrimitives,
+    int maxPrimsInNode) {
+  if (node->nPrimitives > 0) {
+    node->cost = node->nPrimitives*node->bounds.SurfaceArea();
+    return node->nPrimitives;
+  }
+  int nPrimitives[2];
+  if (depth < parallelTreeletDepth) {
+    ParallelFor([&](int64_t child) {
+      nPrimitives[child] = RestructureTreelets(node->children[child], depth + 1,
+          minPrimitives, maxPrimsInNode);
+    }, 2);
+  }
+  else {
+    for (int child = 0; child < 2; ++child) {
+      nPrimitives[child] = RestructureTreelets(node->children[child], depth + 1,
+          minPrimitives, maxPrimsInNode);
+    }
+  }
+  int n = nPrimitives[0] + nPrimitives[1];
+  if (n >= minPrimitives) {
+    RestructureTreelet(node);
+  }
+  else {
+    node->cost = sahTraversalCost*node->bounds.SurfaceArea() +
+        node->children[0]->cost + node->children[1]->cost;
+  }
+  // <collapse the subtree into a leaf if that is cheaper>
+  Float leafCost = n*node->bounds.SurfaceArea();
+  if (n <= maxPrimsInNode && leafCost <= node->cost) {
+    node->nPrimitives = n;
+    node->cost = leafCost;
+  }
+  return n;
+}
+
+// <gather primitives in depth-first leaf order, turning collapsed nodes into leaves>
+// Every subtree then has a contiguous primitive range. Returns the number of
+// nodes left under node.
+static int GatherTreeletPrimitives(BVHBuildNode* node,
+    const std::vector<std::shared_ptr<Primitive>>& primitives,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+  if (node->children[0] == nullptr) {
+    int first = orderedPrims.size();
+    orderedPrims.insert(orderedPrims.end(), primitives.begin() + node->firstPrimOffset,
+        primitives.begin() + node->firstPrimOffset + node->nPrimitives);
+    node->firstPrimOffset = first;
+    return 1;
+  }
+  if (node->nPrimitives > 0) {
+    int first = orderedPrims.size();
+    GatherTreeletPrimitives(node->children[0], primitives, orderedPrims);
+    GatherTreeletPrimitives(node->children[1], primitives, orderedPrims);
+    node->InitLeaf(first, node->nPrimitives, node->bounds);
+    return 1;
+  }
+  return 1 + GatherTreeletPrimitives(node->children[0], primitives, orderedPrims) +
+      GatherTreeletPrimitives(node->children[1], primitives, orderedPrims);
+}
+
+void BVHAccel::restructureTreelets(BVHBuildNode* root) {
+  // <optimize treelets, skipping more of the small subtrees in later passes>
+  for (int pass = 0; pass < treeletPasses; ++pass) {
+    RestructureTreelets(root, 0, treeletSize << pass, maxPrimsInNode);
+  }
+
+  std::vector<std::shared_ptr<Primitive>> orderedPrims;
+  orderedPrims.reserve(primitives.size());
+  totalNodes = GatherTreeletPrimitives(root, primitives, orderedPrims);
+  primitives.swap(orderedPrims);
+}
+
   Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
+    return rootBounds;
+  }
+
+// <traverse the binary nodes with a packet of rays>
+// Each stack entry remembers the first ray of the packet that may still hit it.
+// A node is first checked against the packet frustum, then ray by ray from that
+// first active ray; the first hit decides the child order for the whole packet.
+template <bool anyHit>
+void BVHAccel::intersectPacket(const Ray* rays, int nRays,
+    SurfaceInteraction* isects, bool* hits) const {
+
+  Vector3f invDir[maxPacketSize];
+  int dirIsNeg[maxPacketSize][3];
+  typedef LeafIntersector<anyHit> Leaves;
+  typename std::aligned_storage<sizeof(Leaves), alignof(Leaves)>::type
+      leafStorage[maxPacketSize];
+  Leaves *leaves = reinterpret_cast<Leaves*>(leafStorage);
+  for (int i = 0; i < nRays; ++i) {
+    const Ray &ray = rays[i];
+    invDir[i] = Vector3f(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+    for (int a = 0; a < 3; ++a) {
+      dirIsNeg[i][a] = invDir[i][a] < 0;
+    }
+    new (&leaves[i]) Leaves(primitives, leafQuadOffset, triangleQuads, ray,
+        anyHit ? nullptr : &isects[i]);
+    hits[i] = false;
+  }
+  PacketFrustum frustum(rays, invDir, nRays);
+  bool useFrustum = frustum.valid && nRays > 1;
+
+  struct StackEntry {
+    int nodeIndex, firstActive;
+  };
+  StackEntry nodesToVisit[64];
+  int toVisitOffset = 0, nOccluded = 0;
+  StackEntry current = {0, 0};
+  while (true) {
+    const LinearBVHNode *node = &nodes[current.nodeIndex];
+
+    // <find the first active ray that hits the node>
+    int first = nRays;
+    if (!useFrustum || !frustum.Misses(node->bounds)) {
+      for (first = current.firstActive; first < nRays; ++first) {
+        if (!(anyHit && hits[first]) &&
+            node->bounds.IntersectP(rays[first], invDir[first], dirIsNeg[first])) {
+          break;
+        }
+      }
+    }
+
+    if (first < nRays) {
+      // <count the node as visited by the active rays carried into it>
+      for (int i = first; i < nRays; ++i) {
+        if (!(anyHit && hits[i])) {
+          leaves[i].VisitNode();
+        }
+      }
+      if (node->nPrimitives > 0) {
+        // <intersect the remaining active rays with primitives in leaf>
+        for (int i = first; i < nRays; ++i) {
+          if ((anyHit && hits[i]) ||
+              (i > first && !node->bounds.IntersectP(rays[i], invDir[i], dirIsNeg[i]))) {
+            continue;
+          }
+          if (leaves[i].Intersect(node->primitiveOffset, node->nPrimitives)) {
+            hits[i] = true;
+            if (anyHit) {
+              ++nOccluded;
+            }
+          }
+        }
+        if (nOccluded == nRays) {
+          break;
+        }
+      }
+      else {
+        // <put far BVH node on nodesToVisit stack, advance to near node>
+        int child0 = current.nodeIndex + 1, child1 = node->secondChildOffset;
+        if (anyHit ? node->occluderChild : dirIsNeg[first][node->axis]) {
+          std::swap(child0, child1);
+        }
+        nodesToVisit[toVisitOffset++] = {child1, first};
+        current = {child0, first};
+        continue;
+      }
+    }
+    if (toVisitOffset == 0) {
+      break;
+    }
+    current = nodesToVisit[--toVisitOffset];
+  }
+
+  if (!anyHit) {
+    for (int i = 0; i < nRays; ++i) {
+      hits[i] = leaves[i].Finish(hits[i]);
+    }
+  }
+  for (int i = 0; i < nRays; ++i) {
+    leaves[i].~Leaves();
+  }
+}
+
+void BVHAccel::IntersectStream(const Ray* rays, int nRays,
+    SurfaceInteraction* isects, bool* hits) const {
+  // <packets use the binary nodes, which only the quantized layout frees>
+  // Their bounds cover the whole shutter, so motion BVHs trace rays one by one.
+  if (!nodes || motionBounds) {
+    Aggregate::IntersectStream(rays, nRays, isects, hits);
+    return;
+  }
+  for (int start = 0; start < nRays; start += maxPacketSize) {
+    int n = std::min(maxPacketSize, nRays - start);
+    intersectPacket<false>(&rays[start], n, &isects[start], &hits[start]);
+  }
+}
+
+void BVHAccel::IntersectPStream(const Ray* rays, int nRays, bool* occluded) const {
+  if (!nodes || motionBounds) {
+    Aggregate::IntersectPStream(rays, nRays, occluded);
+    return;
+  }
+  for (int start = 0; start < nRays; start += maxPacketSize) {
+    int n = std::min(maxPacketSize, nRays - start);
+    intersectPacket<true>(&rays[start], n, nullptr, &occluded[start]);
+  }
+}
+
+void BVHAccel::packTriangleLeaves() {
+
+  FreeAligned(triangleQuads);
+  triangleQuads = nullptr;
+  totalTriangleQuads = 0;
+
+  // <find the world space vertices of primitives that are plain triangles>
+  std::vector<const Triangle*> triangles(primitives.size());
+  ParallelFor([&](int64_t i) {
+    const Triangle *triangle = GetTriangle(primitives[i].get());
+    triangles[i] = (triangle && !triangle->HasAlphaMask()) ? triangle : nullptr;
+  }, primitives.size(), 4096);
+
+  // <assign quads to leaves made only of triangles>
+  std::vector<int> leaves;
+  int nQuads = 0;
+  leafQuadOffset.assign(primitives.size(), -1);
+  for (int i = 0; i < totalNodes; ++i) {
+    const LinearBVHNode &node = nodes[i];
+    if (node.nPrimitives == 0) continue;
+    bool allTriangles = true;
+    for (int j = 0; j < node.nPrimitives; ++j) {
+      allTriangles &= triangles[node.primitiveOffset + j] != nullptr;
+    }
+    if (allTriangles) {
+      leafQuadOffset[node.primitiveOffset] = nQuads;
+      nQuads += (node.nPrimitives + 3)/4;
+      leaves.push_back(i);
+    }
+  }
+  if (nQuads == 0) {
+    leafQuadOffset.clear();
+    return;
+  }
+
+  // <fill quads in parallel; unused lanes are padding>
+  triangleQuads = AllocAligned<TriangleQuad>(nQuads);
+  totalTriangleQuads = nQuads;
+  ParallelFor([&](int64_t l) {
+    const LinearBVHNode &node = nodes[leaves[l]];
+    TriangleQuad *quad = &triangleQuads[leafQuadOffset[node.primitiveOffset]];
+    for (int j = 0; j < (node.nPrimitives + 3)/4*4; ++j) {
+      TriangleQuad &q = quad[j/4];
+      int lane = j % 4;
+      Point3f p[3];
+      if (j < node.nPrimitives) {
+        triangles[node.primitiveOffset + j]->GetVertices(p);
+        q.primitive[lane] = node.primitiveOffset + j;
+      }
+      else {
+        q.primitive[lane] = -1;
+      }
+      for (int v = 0; v < 3; ++v) {
+        for (int a = 0; a < 3; ++a) {
+          q.p[v][a][lane] = p[v][a];
+        }
+      }
+    }
+  }, leaves.size(), 256);
+}
+
+// <BVH cache files>
+// A cache file holds the binary nodes of a BVH and the order its build put the
+// primitives in, keyed by a hash of the geometry and the build parameters.
+// Loading one maps it copy-on-write and uses the nodes in place; the other
+// layouts are derived from them as after a build.
+static constexpr char bvhCacheMagic[8] = {'p', 'b', 'r', 't', 'B', 'V', 'H', 0};
+static constexpr uint32_t bvhCacheVersion = 2;
+
+struct BVHCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nodeSize;        // sizeof(LinearBVHNode), which depends on Float
+  uint64_t geometryHash;
+  int32_t maxPrimsInNode;
+  int32_t splitMethod;
+  int32_t nPrimitives;
+  int32_t nReferences;      // more than nPrimitives if the build duplicated some
+  int32_t totalNodes;
+  uint64_t nodeOffset;      // followed by nReferences int32 input indices
+};
+
+uint64_t BVHAccel::hashGeometry() const {
+
+  // <hash fixed size chunks of primitives in parallel, then the chunk hashes>
+  // Triangles contribute their vertices, anything else its world bounds.
+  const int chunkSize = 4096;
+  int nChunks = (primitives.size() + chunkSize - 1)/chunkSize;
+  std::vector<uint64_t> chunkHash(nChunks);
+  ParallelFor([&](int64_t c) {
+    uint64_t hash = HashBytes(nullptr, 0);
+    int end = std::min<int>(primitives.size(), (c + 1)*chunkSize);
+    for (int i = c*chunkSize; i < end; ++i) {
+      if (const Triangle *triangle = GetTriangle(primitives[i].get())) {
+        Point3f p[3];
+        triangle->GetVertices(p);
+        hash = HashBytes(p, sizeof(p), hash);
+      }
+      else {
+        Bounds3f b = primitives[i]->WorldBound();
+        hash = HashBytes(&b, sizeof(b), hash);
+      }
+    }
+    chunkHash[c] = hash;
+  }, nChunks);
+
+  int32_t params[5] = {(int32_t)primitives.size(), maxPrimsInNode, (int32_t)splitMethod,
+      treeletPasses, (int32_t)sizeof(LinearBVHNode)};
+  uint64_t hash = HashBytes(params, sizeof(params));
+  hash = HashBytes(&maxSplitDuplication, sizeof(Float), hash);
+  return HashBytes(chunkHash.data(), chunkHash.size()*sizeof(uint64_t), hash);
+}
+
+bool BVHAccel::loadCache(const std::string& filename, uint64_t geometryHash) {
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BVHCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+
+  // <check that the file is a cache of this geometry and is complete>
+  const BVHCacheHeader &header = *(const BVHCacheHeader*)mapping;
+  int nPrimitives = primitives.size();
+  bool valid = std::equal(bvhCacheMagic, bvhCacheMagic + 8, header.magic) &&
+      header.version == bvhCacheVersion && header.nodeSize == sizeof(LinearBVHNode) &&
+      header.geometryHash == geometryHash && header.maxPrimsInNode == maxPrimsInNode &&
+      header.splitMethod == (int32_t)splitMethod && header.nPrimitives == nPrimitives &&
+      header.nReferences >= nPrimitives &&
+      header.totalNodes > 0 && header.nodeOffset % alignof(LinearBVHNode) == 0 &&
+      header.nodeOffset >= sizeof(BVHCacheHeader) + header.nReferences*sizeof(int32_t) &&
+      header.nodeOffset + header.totalNodes*sizeof(LinearBVHNode) <= size;
+  const int32_t *order = (const int32_t*)(&header + 1);
+  LinearBVHNode *cachedNodes = (LinearBVHNode*)((char*)mapping + header.nodeOffset);
+  // <check every offset so a damaged file can't send traversal out of bounds>
+  int nReferences = valid ? header.nReferences : 0;
+  for (int i = 0; valid && i < nReferences; ++i) {
+    valid = order[i] >= 0 && order[i] < nPrimitives;
+  }
+  for (int i = 0; valid && i < header.totalNodes; ++i) {
+    const LinearBVHNode &node = cachedNodes[i];
+    valid = node.nPrimitives > 0 ?
+        node.primitiveOffset >= 0 && node.primitiveOffset + node.nPrimitives <= nReferences :
+        node.secondChildOffset > i + 1 && node.secondChildOffset < header.totalNodes;
+  }
+  if (!valid) {
+    Warning("BVH cache \"%s\" is stale or damaged; rebuilding", filename.c_str());
+    munmap(mapping, size);
+    return false;
+  }
+
+  // <put primitives in the cached order and use the mapped nodes>
+  std::vector<std::shared_ptr<Primitive>> orderedPrims(nReferences);
+  for (int i = 0; i < nReferences; ++i) {
+    orderedPrims[i] = primitives[order[i]];
+  }
+  primitives.swap(orderedPrims);
+  cacheMapping = mapping;
+  cacheMappingSize = size;
+  nodes = cachedNodes;
+  totalNodes = header.totalNodes;
+  return true;
+}
+
+void BVHAccel::writeCache(const std::string& filename, uint64_t geometryHash,
+    const std::vector<std::shared_ptr<Primitive>>& inputPrims) const {
+
+  // <find where the build moved each input primitive>
+  std::unordered_map<const Primitive*, int32_t> inputIndex;
+  for (size_t i = 0; i < inputPrims.size(); ++i) {
+    inputIndex[inputPrims[i].get()] = i;
+  }
+  std::vector<int32_t> order(primitives.size());
+  for (size_t i = 0; i < primitives.size(); ++i) {
+    order[i] = inputIndex[primitives[i].get()];
+  }
+
+  BVHCacheHeader header;
+  std::copy(bvhCacheMagic, bvhCacheMagic + 8, header.magic);
+  header.version = bvhCacheVersion;
+  header.nodeSize = sizeof(LinearBVHNode);
+  header.geometryHash = geometryHash;
+  header.maxPrimsInNode = maxPrimsInNode;
+  header.splitMethod = (int32_t)splitMethod;
+  header.nPrimitives = inputPrims.size();
+  header.nReferences = primitives.size();
+  header.totalNodes = totalNodes;
+  size_t orderEnd = sizeof(header) + order.size()*sizeof(int32_t);
+  header.nodeOffset = (orderEnd + PBRT_L1_CACHE_LINE_SIZE - 1) &
+      ~(size_t)(PBRT_L1_CACHE_LINE_SIZE - 1);
+  std::vector<char> padding(header.nodeOffset - orderEnd, 0);
+
+  // <write the cache atomically, so readers never see a partial cache>
+  bool ok = WriteFileAtomically(filename, [&](FILE* f) {
+      return std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+        std::fwrite(order.data(), sizeof(int32_t), order.size(), f) == order.size() &&
+        std::fwrite(padding.data(), 1, padding.size(), f) == padding.size() &&
+        std::fwrite(nodes, sizeof(LinearBVHNode), totalNodes, f) == (size_t)totalNodes;
+    });
+  if (!ok) {
+    Warning("Couldn't write BVH cache \"%s\"", filename.c_str());
+  }
+}
+
+// <free a binary node array, which may live in a mapped cache file>
+void BVHAccel::releaseNodes(LinearBVHNode* n) {
+  char *mapping = (char*)cacheMapping;
+  if (mapping && (char*)n >= mapping && (char*)n < mapping + cacheMappingSize) {
+    munmap(cacheMapping, cacheMappingSize);
+    cacheMapping = nullptr;
+    return;
+  }
+  FreeAligned(n);
+}
+
+  size_t BVHAccel::NodeMemoryUsage() const {
+    switch (nodeLayout) {
+    case NodeLayout::Wide4:
+      return totalWideNodes*sizeof(WideBVHNode);
+    case NodeLayout::Quantized:
+      return totalNodes*sizeof(QuantizedBVHNode);
+    case NodeLayout::Stackless:
+      return totalNodes*(sizeof(LinearBVHNode) + sizeof(int));
+    case NodeLayout::Binary:
+    default:
+      return totalNodes*sizeof(LinearBVHNode) +
+          (motionBounds ? totalNodes*(motionSegments + 1)*sizeof(Bounds3f) : 0);
+    }
+  }
+
+  size_t BVHAccel::MemoryUsage() const {
+    return NodeMemoryUsage() + totalTriangleQuads*sizeof(TriangleQuad) +
+        leafQuadOffset.size()*sizeof(int) +
+        primitives.size()*sizeof(std::shared_ptr<Primitive>);
+  }
+
+  InstanceMemoryStats BVHAccel::InstanceMemoryUsage() const {
+    InstanceMemoryStats stats;
+    stats.topLevelBytes = MemoryUsage();
+    std::set<const BVHAccel*> objects;
+    std::set<const Primitive*> instances;
+    for (const auto& p : primitives) {
+      auto instance = dynamic_cast<const TransformedPrimitive*>(p.get());
+      auto object = instance ?
+          dynamic_cast<const BVHAccel*>(instance->GetPrimitive()) : nullptr;
+      // SBVH leaves can reference an instance more than once
+      if (!object || !instances.insert(instance).second) continue;
+      ++stats.nInstances;
+      stats.flattenedBytes += object->MemoryUsage();
+      if (objects.insert(object).second) {
+        stats.bottomLevelBytes += object->MemoryUsage();
+      }
+    }
+    stats.nObjects = objects.size();
+    return stats;
   }
 
-  BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+  BVHAccel::~BVHAccel() {
+    releaseNodes(nodes);
+    FreeAligned(wideNodes);
+    FreeAligned(quantizedNodes);
+    FreeAligned(parentIndex);
+    FreeAligned(triangleQuads);
+    FreeAligned(motionBounds);
+  }
   
 } // namespace pbrt
@@ -7,33 +7,120 @@
 #include <vector>
 #include <memory>
 #include <atomic>
+#include <string>
+#include <cstdio>
 
 namespace pbrt {
 
 struct BVHBuildNode;
 struct BVHPrimitiveInfo;
 struct MortonPrimitive;
+struct SBVHBuildState;
 struct LinearBVHNode;
- 
+struct WideBVHNode;
+struct QuantizedBVHNode;
+struct TriangleQuad;
+
+// Memory of a two-level BVH: a top-level BVH over TransformedPrimitive
+// instances whose shared bottom-level BVHAccels are counted once each.
+// flattenedBytes is what the bottom level would take if every instance had
+// its own copy, i.e. if the instances were flattened into one BVH.
+struct InstanceMemoryStats {
+  int nInstances = 0;
+  int nObjects = 0;
+  size_t topLevelBytes = 0;
+  size_t bottomLevelBytes = 0;
+  size_t flattenedBytes = 0;
+};
+
+// Quality of a BVH as last built or refit, gathered over its binary nodes.
+// sahCost is the SAH cost of the tree divided by the root's surface area, in
+// units of one primitive intersection, as used to pick splits. overlap sums the
+// surface area shared by the two children of every interior node, relative to
+// the root: the expected number of extra nodes a ray enters because siblings
+// overlap. leafDepths[d] counts the leaves at depth d (the root is at 0) and
+// leafSizes[n] the leaves with n primitive references.
+struct BVHTreeStats {
+  int nInteriorNodes = 0;
+  int nLeaves = 0;
+  int nPrimitiveReferences = 0;
+  Float sahCost = 0;
+  Float overlap = 0;
+  std::vector<int> leafDepths;
+  std::vector<int> leafSizes;
+  size_t nodeBytes = 0;
+  size_t totalBytes = 0;
+};
+
+void PrintBVHTreeStats(const BVHTreeStats& stats, FILE* dest);
+
 class BVHAccel : public Aggregate {
 
 public:
-  enum class SplitMethod {SAH, HLBVH, Middle, EqualCounts};
+  // SBVH: binned SAH that also considers spatial splits, which clip the
+  // primitives straddling a plane and reference them from both children.
+  // Duplicated references are limited to maxSplitDuplication times the
+  // number of primitives.
+  enum class SplitMethod {SAH, HLBVH, Middle, EqualCounts, SBVH};
+  // Binary: 32-byte two-child nodes, traversed one box at a time (reference path).
+  // Wide4: the binary tree collapsed into 4-child nodes with SoA bounds; all four
+  // children are tested with one SIMD slab test and visited nearest first.
+  // Quantized: 20-byte binary nodes whose child boxes are stored as 8-bit offsets
+  // into the parent box, conservatively rounded; the binary nodes are freed.
+  // Stackless: the binary nodes plus the index of each node's parent, traversed
+  // without a stack by walking back up through the parents; per-ray state is
+  // the current node and the direction it was entered from.
+  enum class NodeLayout {Binary, Wide4, Quantized, Stackless};
 
+  // With motionSegments > 0, every node also keeps bounds at motionSegments + 1
+  // times evenly spaced over the shutter, and rays are tested against them
+  // interpolated to ray.time instead of against bounds over the whole shutter.
+  // The topology is still built from the whole-shutter bounds, and such BVHs
+  // are always traversed with the Binary layout.
   BVHAccel(const std::vector<std::shared_ptr<Primitive>>& p,
-      int maxPrimsInNode, SplitMethod splitMethod);
+      int maxPrimsInNode, SplitMethod splitMethod,
+      NodeLayout nodeLayout = NodeLayout::Binary, Float maxSplitDuplication = .3f,
+      int treeletPasses = 0, int motionSegments = 0,
+      Float shutterOpen = 0, Float shutterClose = 1);
 
   Bounds3f WorldBound() const;
   ~BVHAccel();
+
+  // Bytes used by the node array that traversal reads for the active layout.
+  size_t NodeMemoryUsage() const;
+  // NodeMemoryUsage plus packed triangles and the primitive references.
+  size_t MemoryUsage() const;
+  InstanceMemoryStats InstanceMemoryUsage() const;
+  const BVHTreeStats& TreeStats() const { return treeStats; }
+
+  // Updates the BVH after its primitives moved (deformed vertices, instances
+  // given a new transform) without changing its topology. The SAH cost is
+  // tracked against the cost when the BVH was last (partly) rebuilt; once it grows past
+  // maxSAHGrowth times that, the subtrees that degraded are rebuilt, or the
+  // whole BVH if most of it did. Quantized BVHs keep no binary nodes and are
+  // always rebuilt.
+  void Refit(Float maxSAHGrowth = 1.5f);
+  // SAH cost of the tree after the last Refit relative to when it was built or
+  // last partly rebuilt.
+  Float SAHCostGrowth() const {
+    return builtSAHCost > 0 ? sahCost/builtSAHCost : 1;
+  }
   
-  BVHBuildNode* recursiveBuild(MemoryArena& arena,
-      std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int* totalNodes,
-      std::vector<std::shared_ptr<Primitive>>& orderedPrims);
+  BVHBuildNode* recursiveBuild(std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+      std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+      std::atomic<int>* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims) const;
 
   BVHBuildNode* HLBVHBuild(MemoryArena& arena,
       std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
       std::vector<std::shared_ptr<Primitive>>& orderedPrims) const;
 
+  BVHBuildNode* SBVHBuild(std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+      const std::vector<BVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+      std::vector<std::shared_ptr<Primitive>>& orderedPrims) const;
+
+  BVHBuildNode* recursiveSBVHBuild(std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+      std::vector<BVHPrimitiveInfo>& references, SBVHBuildState& state) const;
+
   BVHBuildNode* emitLBVH(BVHBuildNode *&buildNodes,
       const std::vector<BVHPrimitiveInfo>& primitiveInfo, MortonPrimitive* mortonPrims,
       int nPrimitives, int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims,
@@ -42,16 +129,90 @@ public:
   BVHBuildNode* buildUpperSAH(MemoryArena& arena, std::vector<BVHBuildNode*>& treeletRoots,
       int start, int end, int* totalNodes) const;
 
+  void restructureTreelets(BVHBuildNode* root);
+  void build();
+  void buildLayouts();
+  void releaseNodes(LinearBVHNode* n);
+  uint64_t hashGeometry() const;
+  bool loadCache(const std::string& filename, uint64_t geometryHash);
+  void writeCache(const std::string& filename, uint64_t geometryHash,
+      const std::vector<std::shared_ptr<Primitive>>& inputPrims) const;
   int flattenBVHTree(BVHBuildNode* node, int* offset);
+  int relinkBVHTree(const LinearBVHNode* oldNodes, int oldIndex,
+      const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt, int* offset);
+  Float initRefit();
+  void partitionRefitSubtrees(int nodeIndex, int end, int grain);
+  Float refitRange(int start, int end, bool updateBounds);
+  bool rebuildSubtrees(const std::vector<int>& subtrees);
+  Float computeOccluderOrder(int nodeIndex);
+  int collapseWideBVH(int nodeIndex, std::vector<WideBVHNode>& wide) const;
+  void quantizeBVH(int nodeIndex, const Bounds3f& frame, QuantizedBVHNode* quantized) const;
+  void packTriangleLeaves();
+  void computeMotionBounds();
+  void computeTreeStats();
 
   bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
   bool IntersectP(const Ray& ray) const;
+  // Packet traversal over the binary nodes, in packets of up to 16 rays.
+  void IntersectStream(const Ray* rays, int nRays,
+      SurfaceInteraction* isects, bool* hits) const;
+  void IntersectPStream(const Ray* rays, int nRays, bool* occluded) const;
 
 private:
+  bool intersectWide(const Ray& ray, SurfaceInteraction* isect) const;
+  bool intersectPWide(const Ray& ray) const;
+  bool intersectQuantized(const Ray& ray, SurfaceInteraction* isect) const;
+  bool intersectPQuantized(const Ray& ray) const;
+  bool intersectMotion(const Ray& ray, SurfaceInteraction* isect) const;
+  bool intersectPMotion(const Ray& ray) const;
+  bool intersectStackless(const Ray& ray, SurfaceInteraction* isect) const;
+  bool intersectPStackless(const Ray& ray) const;
+  template <bool anyHit>
+  void intersectPacket(const Ray* rays, int nRays,
+      SurfaceInteraction* isects, bool* hits) const;
+
   const int maxPrimsInNode;
   const SplitMethod splitMethod;
+  const NodeLayout nodeLayout;
+  const Float maxSplitDuplication;
+  // Treelet restructuring passes run over the built tree (TRBVH). With them,
+  // HLBVH splits down to one primitive per leaf where the Morton codes differ,
+  // and the passes collapse subtrees back into leaves of up to maxPrimsInNode
+  // primitives where that is cheaper, reordering the primitives so that every
+  // leaf keeps a contiguous range.
+  const int treeletPasses;
+  const int motionSegments;
+  const Float shutterOpen, shutterClose;
   std::vector<std::shared_ptr<Primitive>> primitives;
+  // An SBVH's primitives are leaf references, some of them duplicates; the
+  // unique input primitives are kept so that a rebuild starts from them again.
+  std::vector<std::shared_ptr<Primitive>> inputPrimitives;
   LinearBVHNode *nodes = nullptr;
+  int totalNodes = 0;
+  WideBVHNode *wideNodes = nullptr;
+  int totalWideNodes = 0;
+  QuantizedBVHNode *quantizedNodes = nullptr;
+  // Stackless layout: parentIndex[i] is the parent of node i, -1 for the root.
+  int *parentIndex = nullptr;
+  // Leaves holding only triangles keep a packed copy of their vertices;
+  // leafQuadOffset maps a leaf's primitive offset to its first quad, or -1.
+  TriangleQuad *triangleQuads = nullptr;
+  int totalTriangleQuads = 0;
+  std::vector<int> leafQuadOffset;
+  Bounds3f rootBounds;
+  // motionSegments + 1 bounds per node, consecutive for each node.
+  Bounds3f *motionBounds = nullptr;
+  // Refit splits the binary nodes into subtrees [refitRoots[i], refitEnds[i])
+  // that are refit in parallel, then refits refitUpperNodes above them.
+  // refitBuiltCost[i] is the subtree's SAH cost when it was last built.
+  std::vector<int> refitRoots, refitEnds, refitUpperNodes;
+  std::vector<Float> refitBuiltCost;
+  Float builtSAHCost = 0, sahCost = 0;
+  BVHTreeStats treeStats;
+  // When the BVH was loaded from a cache file, nodes point into this
+  // copy-on-write mapping of it.
+  void *cacheMapping = nullptr;
+  size_t cacheMappingSize = 0;
 };
 
 } // namespace pbrt
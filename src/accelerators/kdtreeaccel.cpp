@@ -0,0 +1,335 @@
+#include "kdtreeaccel.h"
+#include "primitive.h"
+#include "memory.h"
+#include "geometry.h"
+#include "interaction.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+namespace pbrt {
+
+// The low two bits of flags hold the split axis, or 3 for a leaf; the rest
+// hold the leaf's primitive count or the interior node's above child.
+struct KdAccelNode {
+  void InitLeaf(const int* primNums, int np, std::vector<int>* primitiveIndices) {
+    flags = 3;
+    nPrims |= (np << 2);
+    // <store primitive ids for leaf node>
+    if (np == 0) {
+      onePrimitive = 0;
+    }
+    else if (np == 1) {
+      onePrimitive = primNums[0];
+    }
+    else {
+      primitiveIndicesOffset = primitiveIndices->size();
+      primitiveIndices->insert(primitiveIndices->end(), primNums, primNums + np);
+    }
+  }
+  void InitInterior(int axis, int ac, Float s) {
+    split = s;
+    flags = axis;
+    aboveChild |= (ac << 2);
+  }
+  Float SplitPos() const { return split; }
+  int nPrimitives() const { return nPrims >> 2; }
+  int SplitAxis() const { return flags & 3; }
+  bool IsLeaf() const { return (flags & 3) == 3; }
+  int AboveChild() const { return aboveChild >> 2; }
+
+  union {
+    Float split;                 // interior
+    int onePrimitive;            // leaf
+    int primitiveIndicesOffset;  // leaf
+  };
+
+private:
+  union {
+    int flags;       // both
+    int nPrims;      // leaf
+    int aboveChild;  // interior
+  };
+};
+
+enum class EdgeType { Start, End };
+
+struct BoundEdge {
+  BoundEdge() {}
+  BoundEdge(Float t, int primNum, bool starting) : t(t), primNum(primNum) {
+    type = starting ? EdgeType::Start : EdgeType::End;
+  }
+  Float t;
+  int primNum;
+  EdgeType type;
+};
+
+// <entry on the kd-tree traversal stack: a node and the ray's span inside it>
+struct KdToDo {
+  const KdAccelNode *node;
+  Float tMin, tMax;
+};
+
+KdTreeAccel::KdTreeAccel(const std::vector<std::shared_ptr<Primitive>>& p,
+    int isectCost, int traversalCost, Float emptyBonus, int maxPrims, int maxDepth)
+: isectCost(isectCost), traversalCost(traversalCost), maxPrims(maxPrims),
+  emptyBonus(emptyBonus), primitives(p) {
+
+  // <build kd-tree for accelerator>
+  int nPrimitives = primitives.size();
+  if (maxDepth <= 0) {
+    maxDepth = std::round(8 + 1.3f*std::log2(std::max(1, nPrimitives)));
+  }
+
+  // <compute bounds for kd-tree construction>
+  std::vector<Bounds3f> primBounds;
+  primBounds.reserve(nPrimitives);
+  for (const std::shared_ptr<Primitive>& prim : primitives) {
+    Bounds3f b = prim->WorldBound();
+    bounds = Union(bounds, b);
+    primBounds.push_back(b);
+  }
+
+  // <allocate working memory for kd-tree construction>
+  // Below children are built first, so prims0 can be reused by every level;
+  // the above primitives of each level stay in their own slice of prims1.
+  std::unique_ptr<BoundEdge[]> edges[3];
+  for (int i = 0; i < 3; ++i) {
+    edges[i].reset(new BoundEdge[2*nPrimitives]);
+  }
+  std::unique_ptr<int[]> prims0(new int[nPrimitives]);
+  std::unique_ptr<int[]> prims1(new int[(maxDepth + 1)*nPrimitives]);
+
+  // <initialize primNums for kd-tree construction>
+  std::unique_ptr<int[]> primNums(new int[nPrimitives]);
+  std::iota(primNums.get(), primNums.get() + nPrimitives, 0);
+
+  // <start recursive construction of kd-tree>
+  buildTree(0, bounds, primBounds, primNums.get(), nPrimitives, maxDepth, edges,
+      prims0.get(), prims1.get());
+}
+
+void KdTreeAccel::buildTree(int nodeNum, const Bounds3f& nodeBounds,
+    const std::vector<Bounds3f>& allPrimBounds, int* primNums, int nPrimitives,
+    int depth, const std::unique_ptr<BoundEdge[]> edges[3],
+    int* prims0, int* prims1, int badRefines) {
+
+  // <get next free node from nodes array>
+  if (nextFreeNode == nAllocedNodes) {
+    int nNewAllocNodes = std::max(2*nAllocedNodes, 512);
+    KdAccelNode *n = AllocAligned<KdAccelNode>(nNewAllocNodes);
+    if (nAllocedNodes > 0) {
+      std::memcpy(n, nodes, nAllocedNodes*sizeof(KdAccelNode));
+      FreeAligned(nodes);
+    }
+    nodes = n;
+    nAllocedNodes = nNewAllocNodes;
+  }
+  ++nextFreeNode;
+
+  // <initialize leaf node if termination criteria met>
+  if (nPrimitives <= maxPrims || depth == 0) {
+    nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+    return;
+  }
+
+  // <choose split axis position for interior node>
+  int bestAxis = -1, bestOffset = -1;
+  Float bestCost = Infinity;
+  Float oldCost = isectCost*Float(nPrimitives);
+  Float invTotalSA = 1/nodeBounds.SurfaceArea();
+  Vector3f d = nodeBounds.pMax - nodeBounds.pMin;
+
+  // <try the axes from the longest until one has a split inside the node>
+  int axis = nodeBounds.MaximumExtent();
+  for (int retries = 0; retries < 3 && bestAxis == -1; ++retries, axis = (axis + 1) % 3) {
+    // <initialize edges for axis>
+    for (int i = 0; i < nPrimitives; ++i) {
+      int pn = primNums[i];
+      const Bounds3f &b = allPrimBounds[pn];
+      edges[axis][2*i] = BoundEdge(b.pMin[axis], pn, true);
+      edges[axis][2*i + 1] = BoundEdge(b.pMax[axis], pn, false);
+    }
+    std::sort(&edges[axis][0], &edges[axis][2*nPrimitives],
+        [](const BoundEdge& e0, const BoundEdge& e1) {
+      if (e0.t == e1.t) {
+        return (int)e0.type < (int)e1.type;
+      }
+      return e0.t < e1.t;
+    });
+
+    // <compute cost of all splits for axis to find best>
+    int nBelow = 0, nAbove = nPrimitives;
+    for (int i = 0; i < 2*nPrimitives; ++i) {
+      if (edges[axis][i].type == EdgeType::End) {
+        --nAbove;
+      }
+      Float edgeT = edges[axis][i].t;
+      if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis]) {
+        // <compute cost for split at ith edge>
+        int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+        Float belowSA = 2*(d[otherAxis0]*d[otherAxis1] +
+            (edgeT - nodeBounds.pMin[axis])*(d[otherAxis0] + d[otherAxis1]));
+        Float aboveSA = 2*(d[otherAxis0]*d[otherAxis1] +
+            (nodeBounds.pMax[axis] - edgeT)*(d[otherAxis0] + d[otherAxis1]));
+        Float pBelow = belowSA*invTotalSA, pAbove = aboveSA*invTotalSA;
+        Float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
+        Float cost = traversalCost + isectCost*(1 - eb)*(pBelow*nBelow + pAbove*nAbove);
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestOffset = i;
+        }
+      }
+      if (edges[axis][i].type == EdgeType::Start) {
+        ++nBelow;
+      }
+    }
+  }
+
+  // <create leaf if no good splits were found>
+  if (bestCost > oldCost) {
+    ++badRefines;
+  }
+  if ((bestCost > 4*oldCost && nPrimitives < 16) || bestAxis == -1 || badRefines == 3) {
+    nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+    return;
+  }
+
+  // <classify primitives with respect to split>
+  int n0 = 0, n1 = 0;
+  for (int i = 0; i < bestOffset; ++i) {
+    if (edges[bestAxis][i].type == EdgeType::Start) {
+      prims0[n0++] = edges[bestAxis][i].primNum;
+    }
+  }
+  for (int i = bestOffset + 1; i < 2*nPrimitives; ++i) {
+    if (edges[bestAxis][i].type == EdgeType::End) {
+      prims1[n1++] = edges[bestAxis][i].primNum;
+    }
+  }
+
+  // <recursively initialize children nodes>
+  Float tSplit = edges[bestAxis][bestOffset].t;
+  Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
+  bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
+  buildTree(nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1, edges,
+      prims0, prims1 + nPrimitives, badRefines);
+  int aboveChild = nextFreeNode;
+  nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
+  buildTree(aboveChild, bounds1, allPrimBounds, prims1, n1, depth - 1, edges,
+      prims0, prims1 + nPrimitives, badRefines);
+}
+
+// <traverse the kd-tree front to back; shadow rays (anyHit) stop at the first occluder>
+// Nodes are visited in the order the ray crosses them, so closest-hit rays
+// stop as soon as the closest hit so far lies before the next node.
+template <bool anyHit>
+static bool TraverseKdTree(const KdAccelNode* nodes, const Bounds3f& bounds,
+    const std::vector<std::shared_ptr<Primitive>>& primitives,
+    const std::vector<int>& primitiveIndices, const Ray& ray, SurfaceInteraction* isect) {
+
+  // <compute initial parametric range of ray inside kd-tree extent>
+  Float tMin, tMax;
+  if (!bounds.IntersectP(ray, &tMin, &tMax)) {
+    return false;
+  }
+
+  Vector3f invDir(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+  constexpr int maxTodo = 64;
+  KdToDo todo[maxTodo];
+  int todoPos = 0;
+
+  // <traverse kd-tree nodes in order for ray>
+  bool hit = false;
+  const KdAccelNode *node = &nodes[0];
+  while (node != nullptr) {
+    // <bail out if we found a hit closer than the current node>
+    if (ray.tMax < tMin) {
+      break;
+    }
+    if (!node->IsLeaf()) {
+      // <compute parametric distance along ray to split plane>
+      int axis = node->SplitAxis();
+      Float tPlane = (node->SplitPos() - ray.o[axis])*invDir[axis];
+
+      // <get node children pointers for ray>
+      const KdAccelNode *firstChild, *secondChild;
+      bool belowFirst = (ray.o[axis] < node->SplitPos()) ||
+          (ray.o[axis] == node->SplitPos() && ray.d[axis] <= 0);
+      if (belowFirst) {
+        firstChild = node + 1;
+        secondChild = &nodes[node->AboveChild()];
+      }
+      else {
+        firstChild = &nodes[node->AboveChild()];
+        secondChild = node + 1;
+      }
+
+      // <advance to next child node, possibly enqueue other child>
+      if (tPlane > tMax || tPlane <= 0) {
+        node = firstChild;
+      }
+      else if (tPlane < tMin) {
+        node = secondChild;
+      }
+      else {
+        todo[todoPos++] = {secondChild, tPlane, tMax};
+        node = firstChild;
+        tMax = tPlane;
+      }
+    }
+    else {
+      // <check for intersections inside leaf node>
+      int nPrimitives = node->nPrimitives();
+      for (int i = 0; i < nPrimitives; ++i) {
+        int index = nPrimitives == 1 ? node->onePrimitive :
+            primitiveIndices[node->primitiveIndicesOffset + i];
+        const Primitive &prim = *primitives[index];
+        if (anyHit ? prim.IntersectP(ray) : prim.Intersect(ray, isect)) {
+          if (anyHit) {
+            return true;
+          }
+          hit = true;
+        }
+      }
+
+      // <grab next node to process from todo list>
+      if (todoPos == 0) {
+        break;
+      }
+      --todoPos;
+      node = todo[todoPos].node;
+      tMin = todo[todoPos].tMin;
+      tMax = todo[todoPos].tMax;
+    }
+  }
+  return hit;
+}
+
+bool KdTreeAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
+  if (!nodes) {
+    return false;
+  }
+  return TraverseKdTree<false>(nodes, bounds, primitives, primitiveIndices, ray, isect);
+}
+
+bool KdTreeAccel::IntersectP(const Ray& ray) const {
+  if (!nodes) {
+    return false;
+  }
+  return TraverseKdTree<true>(nodes, bounds, primitives, primitiveIndices, ray, nullptr);
+}
+
+size_t KdTreeAccel::MemoryUsage() const {
+  return nextFreeNode*sizeof(KdAccelNode) + primitiveIndices.size()*sizeof(int) +
+      primitives.size()*sizeof(std::shared_ptr<Primitive>);
+}
+
+KdTreeAccel::~KdTreeAccel() {
+  FreeAligned(nodes);
+}
+
+} // namespace pbrt
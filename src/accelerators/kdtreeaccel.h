@@ -0,0 +1,51 @@
+#ifndef ACCELERATORS_KDTREEACCEL_H
+#define ACCELERATORS_KDTREEACCEL_H
+
+#include "pbrt.h"
+#include "primitive.h"
+
+#include <vector>
+#include <memory>
+
+namespace pbrt {
+
+struct KdAccelNode;
+struct BoundEdge;
+
+// SAH kd-tree over the primitives, with 8-byte nodes: interior nodes keep the
+// split position and the offset of their above child (the below child follows
+// them), leaves one primitive index or an offset into primitiveIndices.
+// Primitives straddling a split are referenced from both sides.
+class KdTreeAccel : public Aggregate {
+public:
+  // maxDepth <= 0 picks 8 + 1.3 log2(number of primitives).
+  KdTreeAccel(const std::vector<std::shared_ptr<Primitive>>& p,
+      int isectCost = 80, int traversalCost = 1, Float emptyBonus = .5f,
+      int maxPrims = 1, int maxDepth = -1);
+  ~KdTreeAccel();
+
+  Bounds3f WorldBound() const { return bounds; }
+  // Bytes of the nodes plus the primitive references of the leaves.
+  size_t MemoryUsage() const;
+
+  bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
+  bool IntersectP(const Ray& ray) const;
+
+private:
+  void buildTree(int nodeNum, const Bounds3f& nodeBounds,
+      const std::vector<Bounds3f>& allPrimBounds, int* primNums, int nPrimitives,
+      int depth, const std::unique_ptr<BoundEdge[]> edges[3],
+      int* prims0, int* prims1, int badRefines = 0);
+
+  const int isectCost, traversalCost, maxPrims;
+  const Float emptyBonus;
+  std::vector<std::shared_ptr<Primitive>> primitives;
+  std::vector<int> primitiveIndices;
+  KdAccelNode *nodes = nullptr;
+  int nAllocedNodes = 0, nextFreeNode = 0;
+  Bounds3f bounds;
+};
+
+} // namespace pbrt
+
+#endif // ACCELERATORS_KDTREEACCEL_H
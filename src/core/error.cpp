@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <string>
+#include <cstdio>
 #include <cstring>
 #include <mutex>
 
@@ -40,16 +41,19 @@ namespace pbrt {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
     if (errorString != lastError) {
-      if (!strcmp(errorType, "Warning")) {
-	// TODO
-      }
-      else {
-	// LOG(ERROR) << errorString;
-      }
+      fprintf(stderr, "%s: %s\n", errorType, errorString.c_str());
       lastError = errorString;
     }
   }
 
+  void Warning(const char* format, ...) {
+
+    va_list args;
+    va_start(args, format);
+    processError(format, args, "Warning");
+    va_end(args);
+  }
+
   void Error(const char* format, ...) {
 
     va_list args;
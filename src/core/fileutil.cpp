@@ -0,0 +1,26 @@
+#include "fileutil.h"
+
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+namespace pbrt {
+
+bool WriteFileAtomically(const std::string& name, const std::function<bool(FILE*)>& write) {
+
+  // <the process id keeps concurrent writers of name off each other's files>
+  std::string tmpFile = name + ".tmp" + std::to_string(getpid());
+  FILE *f = std::fopen(tmpFile.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  bool ok = write(f);
+  ok = (std::fclose(f) == 0) && ok;
+  if (!ok || std::rename(tmpFile.c_str(), name.c_str()) != 0) {
+    std::remove(tmpFile.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace pbrt
@@ -0,0 +1,21 @@
+#ifndef CORE_FILEUTIL_H
+#define CORE_FILEUTIL_H
+
+#include "pbrt.h"
+
+#include <cstdio>
+#include <functional>
+#include <string>
+
+namespace pbrt {
+
+// Calls write on a temporary file next to name and, if it returns true and the
+// file closes cleanly, renames the file over name, so a reader never sees a
+// partly written file and a killed job leaves the previous one in place. On
+// failure the temporary file is removed and false is returned; reporting the
+// error is up to the caller.
+bool WriteFileAtomically(const std::string& name, const std::function<bool(FILE*)>& write);
+
+} // namespace pbrt
+
+#endif // CORE_FILEUTIL_H
@@ -1,5 +1,6 @@
 #include "film.h"
 #include "geometry.h"
+#include "imageio.h"
 
 namespace pbrt {
 
@@ -26,7 +27,7 @@ Film::Film(const Point2i& resolution, const Bounds2f& cropWindow,
       Point2f p;
       p.x = (x + 0.5f)*filter->radius.x / filterTableWidth;
       p.y = (y + 0.5f)*filter->radius.y / filterTableWidth;
-      filterTable[offset] = filter->Evaluate(p);
+      filterTable[offset++] = filter->Evaluate(p);
     }
   }
 }
@@ -61,17 +62,32 @@ Bounds2f Film::GePhysicalExtent() const {
 
 void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
 
-  std::lock_guard<std::mutex> lock(mutex);
-  for (Point2i pixel : tile->GetPixelBounds()) {
-    // <merge tile into Film::pixels>
-    const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
-    Pixel &mergePixel = GetPixel(pixel);
+  // <convert tile pixels to XYZ before taking any lock>
+  Bounds2i tileBounds = tile->GetPixelBounds();
+  struct MergeValue {
     Float xyz[3];
-    tilePixel.contribSum.ToXYZ(xyz);
-    for (int i = 0; i < 3; ++i) {
-      mergePixel.xyz[i] += xyz[i];
+    Float filterWeightSum;
+  };
+  std::vector<MergeValue> values(std::max(0, tileBounds.Area()));
+  int offset = 0;
+  for (Point2i pixel : tileBounds) {
+    const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
+    tilePixel.contribSum.ToXYZ(values[offset].xyz);
+    values[offset].filterWeightSum = tilePixel.filterWeightSum;
+    ++offset;
+  }
+
+  // <merge tile into Film::pixels one row at a time under that row's stripe lock>
+  offset = 0;
+  for (int y = tileBounds.pMin.y; y < tileBounds.pMax.y; ++y) {
+    std::lock_guard<std::mutex> lock(mergeMutexes[y % nMergeStripes]);
+    for (int x = tileBounds.pMin.x; x < tileBounds.pMax.x; ++x, ++offset) {
+      Pixel &mergePixel = GetPixel(Point2i(x, y));
+      for (int i = 0; i < 3; ++i) {
+        mergePixel.xyz[i] += values[offset].xyz[i];
+      }
+      mergePixel.filterWeigthSum += values[offset].filterWeightSum;
     }
-    mergePixel.filterWeigthSum += tilePixel.filterWeightSum;
   }
 }
 
@@ -135,7 +151,49 @@ void Film::WriteImage(Float splatScale) {
   }
 
   // <write RGB image>
-  // TODO ::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
+  if (!filename.empty()) {
+    pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds);
+  }
+}
+
+// <pixel accumulators in file order: xyz, filter weight sum, splat xyz>
+static constexpr int pixelFileValues = 7;
+
+bool Film::WritePixels(FILE* f) const {
+  int nPixels = croppedPixelBounds.Area();
+  std::vector<Float> values(pixelFileValues*nPixels);
+  for (int i = 0; i < nPixels; ++i) {
+    const Pixel &p = pixels[i];
+    Float *v = &values[pixelFileValues*i];
+    v[0] = p.xyz[0];
+    v[1] = p.xyz[1];
+    v[2] = p.xyz[2];
+    v[3] = p.filterWeigthSum;
+    v[4] = p.splatXYZ[0];
+    v[5] = p.splatXYZ[1];
+    v[6] = p.splatXYZ[2];
+  }
+  return std::fwrite(values.data(), sizeof(Float), values.size(), f) == values.size();
+}
+
+bool Film::ReadPixels(FILE* f) {
+  int nPixels = croppedPixelBounds.Area();
+  std::vector<Float> values(pixelFileValues*nPixels);
+  if (std::fread(values.data(), sizeof(Float), values.size(), f) != values.size()) {
+    return false;
+  }
+  for (int i = 0; i < nPixels; ++i) {
+    Pixel &p = pixels[i];
+    const Float *v = &values[pixelFileValues*i];
+    p.xyz[0] = v[0];
+    p.xyz[1] = v[1];
+    p.xyz[2] = v[2];
+    p.filterWeigthSum = v[3];
+    p.splatXYZ[0] = v[4];
+    p.splatXYZ[1] = v[5];
+    p.splatXYZ[2] = v[6];
+  }
+  return true;
 }
 
 }
@@ -6,6 +6,7 @@
 #include "pbrt.h"
 #include "parallel.h"
 #include "spectrum.h"
+#include <cstdio>
 #include <vector>
 #include <memory>
 #include <mutex>
@@ -15,6 +16,15 @@ namespace pbrt {
 struct FilmTilePixel {
   Spectrum contribSum = 0.0f;
 	Float filterWeightSum = 0.0f;
+	// <running mean and variance of the luminance of the pixel's own samples>
+	// Only adaptive sampling updates these, through FilmTile::AddPixelStats.
+	int64_t nSamples = 0;
+	Float meanY = 0, m2Y = 0;
+
+	// Variance of meanY as an estimate of the pixel's expected luminance.
+	Float MeanVariance() const {
+	  return nSamples > 1 ? m2Y/((nSamples - 1)*nSamples) : Infinity;
+	}
 };
 
 class FilmTile {
@@ -63,6 +73,16 @@ public:
 	  }
 	}
 
+	// Welford update of the luminance statistics of the pixel that took sample L.
+	void AddPixelStats(const Point2i& p, const Spectrum& L) {
+	  FilmTilePixel &pixel = GetPixel(p);
+	  Float y = L.y();
+	  ++pixel.nSamples;
+	  Float delta = y - pixel.meanY;
+	  pixel.meanY += delta/pixel.nSamples;
+	  pixel.m2Y += delta*(y - pixel.meanY);
+	}
+
 	FilmTilePixel& GetPixel(const Point2i& p) {
 
 	  int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
@@ -93,6 +113,10 @@ public:
 	void AddSplat(const Point2f& p, const Spectrum& v);
 
 	void WriteImage(Float splatScale=1);
+	// Write and read the raw pixel accumulators, so that an interrupted render
+	// can continue adding samples to them; false on I/O errors or a short file.
+	bool WritePixels(FILE* f) const;
+	bool ReadPixels(FILE* f);
 
 	const Point2i fullResolution;
 	const Float diagonal;
@@ -111,7 +135,9 @@ private:
 	const Float scale;
 	static constexpr int filterTableWidth = 16;
 	Float filterTable[filterTableWidth*filterTableWidth];
-	std::mutex mutex;
+	// <row-striped merge locks: row y is guarded by mergeMutexes[y % nMergeStripes]>
+	static constexpr int nMergeStripes = 64;
+	std::mutex mergeMutexes[nMergeStripes];
 
 	Pixel& GetPixel(const Point2i& p) const {
     int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
@@ -32,14 +32,14 @@ public:
         return Vector2(x + v.x, y + v.y);
     }
     Vector2<T>& operator+=(const Vector2<T>& v) {
-        x += v.x; y + v.y;;
+        x += v.x; y += v.y;
         return *this;
     }
     Vector2<T> operator-(const Vector2<T>& v) const {
         return Vector2(x - v.x, y - v.y);
     }
     Vector2<T>& operator-=(const Vector2<T>& v) {
-        x -= v.x; y - v.y;;
+        x -= v.x; y -= v.y;
         return *this;
     }
     Vector2<T> operator*(T s) const {
@@ -87,7 +87,7 @@ public:
     }
 
     explicit Vector3(const Normal3<T>& n) : x(n.x), y(n.y), z(n.z) {
-        Assert(HasNaNs());
+        Assert(!HasNaNs());
     }
 
     T operator[](int i) const {
@@ -106,14 +106,14 @@ public:
         return Vector3(x + v.x, y + v.y, z + v.z);
     }
     Vector3<T>& operator+=(const Vector3<T>& v) {
-        x += v.x; y + v.y; z + v.z;
+        x += v.x; y += v.y; z += v.z;
         return *this;
     }
     Vector3<T> operator-(const Vector3<T>& v) const {
         return Vector3(x - v.x, y - v.y, z - v.z);
     }
     Vector3<T>& operator-=(const Vector3<T>& v) {
-        x -= v.x; y - v.y; z - v.z;
+        x -= v.x; y -= v.y; z -= v.z;
         return *this;
     }
     Vector3<T> operator*(T s) const {
@@ -678,8 +678,8 @@ public:
 
     Point3<T> Corner(int corner) const {
         return Point3<T>((*this)[(corner & 1)].x,
-                (*this)[(corner & 2)].y,
-                (*this)[(corner & 4)].z);
+                (*this)[(corner & 2) ? 1 : 0].y,
+                (*this)[(corner & 4) ? 1 : 0].z);
     }
 
     Vector3<T> Diagonal() { return pMax - pMin; }
@@ -724,7 +724,9 @@ public:
     }
 
     inline bool IntersectP(const Ray& ray, Float* hitt0, Float* hitt1) const;
-    inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNeg[3]) const;
+    // hitt0, if given, is set to where the ray enters the bounds (0 if inside).
+    inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNeg[3],
+        Float* hitt0 = nullptr) const;
 
     Point3<T> pMin, pMax;
 };
@@ -836,7 +838,8 @@ inline Point3f OffsetRayOrigin(const Point3f& p, const Vector3f& pError,
 }
 
 template <typename T> inline bool
-Bounds3<T>::IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNeg[3]) const {
+Bounds3<T>::IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNeg[3],
+    Float* hitt0) const {
 
   const Bounds3f &bounds = *this;
 
@@ -865,27 +868,35 @@ Bounds3<T>::IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNe
   if (tzMin > tMin) tMin = tzMin;
   if (tzMax < tMax) tMax = tzMax;
 
+  if (hitt0) *hitt0 = std::max<Float>(tMin, 0);
   return (tMin < ray.tMax) && (tMax > 0);
 }
 
+// Union assigns pMin/pMax directly rather than going through the two-point
+// constructor, which would reorder the corners of two empty bounds into an
+// infinite box.
 template <typename T> Bounds3<T>
 Union(const Bounds3<T>& b, const Point3<T>& p) {
-    return Bounds3<T>(Point3<T>(std::min(b.pMin.x, p.x),
-                                std::min(b.pMin.y, p.y),
-                                std::min(b.pMin.z, p.z)),
-                      Point3<T>(std::max(b.pMax.x, p.x),
-                                std::max(b.pMax.y, p.y),
-                                std::max(b.pMax.z, p.z)));
+    Bounds3<T> ret;
+    ret.pMin = Point3<T>(std::min(b.pMin.x, p.x),
+                         std::min(b.pMin.y, p.y),
+                         std::min(b.pMin.z, p.z));
+    ret.pMax = Point3<T>(std::max(b.pMax.x, p.x),
+                         std::max(b.pMax.y, p.y),
+                         std::max(b.pMax.z, p.z));
+    return ret;
 }
 
 template <typename T> Bounds3<T>
 Union(const Bounds3<T>& b1, const Bounds3<T>& b2) {
-    return Bounds3<T>(Point3<T>(std::min(b1.pMin.x, b2.pMin.x),
-                                std::min(b1.pMin.y, b2.pMin.y),
-                                std::min(b1.pMin.z, b2.pMin.z)),
-                      Point3<T>(std::max(b1.pMax.x, b2.pMax.x),
-                                std::max(b1.pMax.y, b2.pMax.y),
-                                std::max(b1.pMax.z, b2.pMax.z)));
+    Bounds3<T> ret;
+    ret.pMin = Point3<T>(std::min(b1.pMin.x, b2.pMin.x),
+                         std::min(b1.pMin.y, b2.pMin.y),
+                         std::min(b1.pMin.z, b2.pMin.z));
+    ret.pMax = Point3<T>(std::max(b1.pMax.x, b2.pMax.x),
+                         std::max(b1.pMax.y, b2.pMax.y),
+                         std::max(b1.pMax.z, b2.pMax.z));
+    return ret;
 }
 
 template <typename T> Bounds2<T>
@@ -0,0 +1,84 @@
+#include "imageio.h"
+#include "error.h"
+#include "fileutil.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace pbrt {
+
+// <imageio local definitions>
+static bool HasExtension(const std::string& name, const std::string& ext) {
+  if (ext.size() > name.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < ext.size(); ++i) {
+    if (std::tolower(name[name.size() - ext.size() + i]) != ext[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Float GammaCorrect(Float value) {
+  if (value <= 0.0031308f) {
+    return 12.92f*value;
+  }
+  return 1.055f*std::pow(value, (Float)(1.f/2.4f)) - 0.055f;
+}
+
+// PFM stores rows from the bottom; a negative scale marks little-endian floats.
+static bool WritePFM(FILE* f, const Float* rgb, int width, int height) {
+  if (std::fprintf(f, "PF\n%d %d\n-1\n", width, height) < 0) {
+    return false;
+  }
+  std::vector<float> row(3*width);
+  for (int y = height - 1; y >= 0; --y) {
+    for (int i = 0; i < 3*width; ++i) {
+      row[i] = rgb[3*width*y + i];
+    }
+    if (std::fwrite(row.data(), sizeof(float), row.size(), f) != row.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool WritePPM(FILE* f, const Float* rgb, int width, int height) {
+  if (std::fprintf(f, "P6\n%d %d\n255\n", width, height) < 0) {
+    return false;
+  }
+  std::vector<unsigned char> row(3*width);
+  for (int y = 0; y < height; ++y) {
+    for (int i = 0; i < 3*width; ++i) {
+      row[i] = (unsigned char)Clamp(255.f*GammaCorrect(rgb[3*width*y + i]) + 0.5f, 0, 255);
+    }
+    if (std::fwrite(row.data(), 1, row.size(), f) != row.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void WriteImage(const std::string& name, const Float* rgb, const Bounds2i& outputBounds) {
+
+  Vector2i resolution = outputBounds.Diagonal();
+  bool pfm = HasExtension(name, ".pfm");
+  if (!pfm && !HasExtension(name, ".ppm")) {
+    Error("Can't write image \"%s\": only .pfm and .ppm are supported", name.c_str());
+    return;
+  }
+
+  bool ok = WriteFileAtomically(name, [&](FILE* f) {
+      return pfm ? WritePFM(f, rgb, resolution.x, resolution.y) :
+        WritePPM(f, rgb, resolution.x, resolution.y);
+    });
+  if (!ok) {
+    Error("Couldn't write image \"%s\"", name.c_str());
+  }
+}
+
+} // namespace pbrt
@@ -0,0 +1,20 @@
+#ifndef CORE_IMAGEIO_H
+#define CORE_IMAGEIO_H
+
+#include "pbrt.h"
+#include "geometry.h"
+
+#include <string>
+
+namespace pbrt {
+
+// Writes the RGB pixels of outputBounds, three Floats per pixel in rows from the
+// top, to the file name. The extension picks the format: ".pfm" keeps the
+// linear values as 32-bit floats, ".ppm" stores 8-bit sRGB. The image goes to a
+// temporary file first and is renamed over name, so a reader never sees a
+// partly written image; previews rely on that.
+void WriteImage(const std::string& name, const Float* rgb, const Bounds2i& outputBounds);
+
+} // namespace pbrt
+
+#endif // CORE_IMAGEIO_H
@@ -7,9 +7,407 @@
 #include "camera.h"
 #include "spectrum.h"
 #include "reflection.h"
+#include "api.h"
+#include "error.h"
+#include "fileutil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <typeinfo>
+#include <vector>
 
 namespace pbrt {
 
+// <map (x,y) on a 2^order x 2^order grid to its distance along the Hilbert curve>
+static uint64_t HilbertIndex(int order, int x, int y) {
+    const int n = 1 << order;
+    uint64_t d = 0;
+    for (int s = n/2; s > 0; s /= 2) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += (uint64_t)s*(uint64_t)s*((3*rx) ^ ry);
+        // <rotate quadrant so the sub-curve has the canonical orientation>
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// <pick a tile size giving each thread enough tiles to balance, without tiny tiles>
+static int ComputeTileSize(const Vector2i& sampleExtent) {
+    constexpr int tilesPerThread = 16;
+    constexpr int minTileSize = 8, maxTileSize = 32;
+    Float area = (Float)sampleExtent.x*(Float)sampleExtent.y;
+    int tileSize = (int)std::sqrt(area/(MaxThreadIndex()*tilesPerThread));
+    // <round down to a multiple of 4 so tiles stay aligned to small pixel blocks>
+    tileSize &= ~3;
+    return Clamp(tileSize, minTileSize, maxTileSize);
+}
+
+// <render a tile with its camera rays traced in batches of whole pixels>
+// cameraSampler generates the camera samples of a batch; tileSampler then replays
+// the same pixels to supply the remaining sample dimensions while shading.
+void SamplerIntegrator::renderTileBatched(const Scene& scene, const Bounds2i& tileBounds,
+                                          Sampler& tileSampler, Sampler& cameraSampler,
+                                          FilmTile& filmTile, MemoryArena& arena) const {
+    constexpr int maxBatchRays = 1024;
+    std::vector<Point2i> pixels;
+    std::vector<CameraSample> cameraSamples;
+    std::vector<RayDifferential> rays;
+    std::vector<Float> rayWeights;
+    std::vector<Ray> primaryRays;
+    std::vector<SurfaceInteraction> isects;
+    std::unique_ptr<bool[]> hits(new bool[maxBatchRays + tileSampler.samplesPerPixel]);
+
+    auto traceAndShade = [&]() {
+        // <trace the batch as one stream>
+        // IntersectStream takes plain rays, so the differentials stay behind.
+        int nRays = rays.size();
+        primaryRays.assign(rays.begin(), rays.end());
+        isects.resize(nRays);
+        scene.IntersectStream(primaryRays.data(), nRays, isects.data(), hits.get());
+
+        // <shade samples in the order they were generated>
+        int k = 0;
+        for (Point2i pixel : pixels) {
+            tileSampler.StartPixel(pixel);
+            do {
+                // keeps the sampler's dimensions in step with unbatched rendering
+                tileSampler.GetCameraSample(pixel);
+                Spectrum L(0.0f);
+                if (rayWeights[k] > 0) {
+                    rays[k].tMax = primaryRays[k].tMax;
+                    L = LiIntersected(rays[k], hits[k], isects[k], scene, tileSampler, arena);
+                }
+                filmTile.AddSample(cameraSamples[k].pFilm, L, rayWeights[k]);
+                arena.Reset();
+                ++k;
+            } while (tileSampler.StartNextSample());
+        }
+        pixels.clear();
+        cameraSamples.clear();
+        rays.clear();
+        rayWeights.clear();
+    };
+
+    for (Point2i pixel : tileBounds) {
+        if (!pixels.empty() && rays.size() + tileSampler.samplesPerPixel > maxBatchRays) {
+            traceAndShade();
+        }
+        // <generate camera rays for all samples of pixel>
+        pixels.push_back(pixel);
+        cameraSampler.StartPixel(pixel);
+        do {
+            CameraSample cameraSample = cameraSampler.GetCameraSample(pixel);
+            RayDifferential ray;
+            Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+            ray.ScaleDifferentials(1/std::sqrt(cameraSampler.samplesPerPixel));
+            cameraSamples.push_back(cameraSample);
+            rays.push_back(ray);
+            rayWeights.push_back(rayWeight);
+        } while (cameraSampler.StartNextSample());
+    }
+    if (!pixels.empty()) {
+        traceAndShade();
+    }
+}
+
+// <render samples [firstSample, endSample) of a pixel, continuing its seeded sample set>
+void SamplerIntegrator::renderPixelSamples(const Scene& scene, const Point2i& pixel,
+                                           int64_t firstSample, int64_t endSample,
+                                           Sampler& tileSampler, FilmTile& filmTile,
+                                           MemoryArena& arena, bool addPixelStats) const {
+    tileSampler.SeedPixel(pixel);
+    tileSampler.StartPixel(pixel);
+    tileSampler.SetSampleNumber(firstSample);
+    for (int64_t i = firstSample; i < endSample; ++i) {
+        CameraSample cameraSample = tileSampler.GetCameraSample(pixel);
+        RayDifferential ray;
+        Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+        ray.ScaleDifferentials(1/std::sqrt((Float)tileSampler.samplesPerPixel));
+        Spectrum L(0.0f);
+        if (rayWeight > 0) {
+            L = Li(ray, scene, tileSampler, arena);
+        }
+        filmTile.AddSample(cameraSample.pFilm, L, rayWeight);
+        if (addPixelStats) {
+            filmTile.AddPixelStats(pixel, L);
+        }
+        arena.Reset();
+        tileSampler.StartNextSample();
+    }
+}
+
+// <render in passes, each adding samples only to the pixels that are still noisy>
+// Every tile keeps its sampler and FilmTile across passes. Pixels are seeded, so
+// a later pass regenerates a pixel's sample set and continues it where the last
+// pass stopped, and a pixel that reaches samplesPerPixel has the same stratified
+// set as in uniform rendering. The pixels' running statistics live in the
+// FilmTiles and keep accumulating until the tiles are merged at the end. The first
+// pass takes adaptiveFirstPassSamples in every pixel; each later pass doubles
+// the sample count of the pixels whose relative standard error is above
+// PbrtOptions.adaptiveErrorThreshold, up to the sampler's samplesPerPixel.
+// Passes stop once no pixel needs more samples or the time budget is spent.
+void SamplerIntegrator::renderAdaptive(const Scene& scene,
+                                       const std::vector<Bounds2i>& tiles) const {
+    constexpr int64_t adaptiveFirstPassSamples = 16;
+    // keeps pixels that are black or nearly so from demanding samples forever
+    constexpr Float minRelativeLuminance = 1e-3f;
+    const int64_t maxSamples = sampler->samplesPerPixel;
+    const int64_t firstPassSamples = std::min(maxSamples, adaptiveFirstPassSamples);
+    const Float threshold = PbrtOptions.adaptiveErrorThreshold;
+    auto startTime = std::chrono::steady_clock::now();
+
+    int nTiles = tiles.size();
+    std::vector<std::unique_ptr<Sampler>> tileSamplers(nTiles);
+    std::vector<std::unique_ptr<FilmTile>> filmTiles(nTiles);
+    for (int i = 0; i < nTiles; ++i) {
+        tileSamplers[i] = sampler->Clone(i);
+        filmTiles[i] = camera->film->GetFilmTile(tiles[i]);
+    }
+
+    // <whether a pixel's mean is known to within the relative error threshold>
+    auto converged = [&](const FilmTilePixel& stats) {
+        Float scale = std::max(std::abs(stats.meanY), minRelativeLuminance);
+        return stats.nSamples >= maxSamples ||
+            stats.MeanVariance() <= threshold*threshold*scale*scale;
+    };
+
+    int64_t totalSamples = 0;
+    int nPasses = 0;
+    for (bool firstPass = true; ; firstPass = false) {
+        std::atomic<int64_t> passSamples(0);
+        ParallelForWorkStealing([&](int64_t tileIndex) {
+            MemoryArena arena;
+            Sampler &tileSampler = *tileSamplers[tileIndex];
+            FilmTile &filmTile = *filmTiles[tileIndex];
+            Bounds2i statsBounds = filmTile.GetPixelBounds();
+            int64_t tileSamples = 0;
+            for (Point2i pixel : tiles[tileIndex]) {
+                // <find the pixel's sample count before and after the pass>
+                // Pixels outside the film keep no statistics and get only the first pass.
+                bool hasStats = InsideExclusive(pixel, statsBounds);
+                int64_t taken = 0, target = firstPassSamples;
+                if (!firstPass) {
+                    if (!hasStats) {
+                        continue;
+                    }
+                    const FilmTilePixel &stats = filmTile.GetPixel(pixel);
+                    if (converged(stats)) {
+                        continue;
+                    }
+                    taken = stats.nSamples;
+                    target = std::min(maxSamples, 2*taken);
+                }
+
+                renderPixelSamples(scene, pixel, taken, target, tileSampler, filmTile, arena,
+                                   hasStats);
+                tileSamples += target - taken;
+            }
+            passSamples += tileSamples;
+        }, nTiles);
+        totalSamples += passSamples;
+        ++nPasses;
+
+        // <stop when every pixel is done or the time budget is spent>
+        Float elapsed = std::chrono::duration<Float>(std::chrono::steady_clock::now() -
+                                                     startTime).count();
+        if (passSamples == 0 ||
+            (PbrtOptions.timeBudget > 0 && elapsed >= PbrtOptions.timeBudget)) {
+            break;
+        }
+    }
+
+    // <merge image tiles into Film>
+    for (std::unique_ptr<FilmTile>& filmTile : filmTiles) {
+        camera->film->MergeFilmTile(std::move(filmTile));
+    }
+    if (PbrtOptions.printStats) {
+        int64_t nPixels = 0;
+        for (const Bounds2i& b : tiles) {
+            nPixels += b.Area();
+        }
+        std::printf("Adaptive sampling: %d passes, %lld samples, %.1f%% of %lld spp\n",
+                    nPasses, (long long)totalSamples,
+                    100.0*totalSamples/(double)(nPixels*maxSamples), (long long)maxSamples);
+    }
+}
+
+// <progressive checkpoint file: header, then the Film's pixel accumulators>
+// Pixels are seeded, so the sampler state comes down to the number of samples
+// every pixel has taken; the rest of each pixel's set regenerates from it.
+// The header identifies the film and sampler configuration, and a key for the
+// rest of the render (see CheckpointKey).
+static constexpr char checkpointMagic[8] = {'p', 'b', 'r', 't', 'C', 'K', 'P', 0};
+static constexpr uint32_t checkpointVersion = 2;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t floatSize;
+    int32_t pixelBounds[4];   // the Film's croppedPixelBounds
+    int64_t samplesPerPixel;
+    int64_t samplesTaken;     // by every pixel
+    uint64_t key;             // CheckpointKey of the render
+};
+
+// Identifies what a checkpoint was rendered from beyond the film and sample count:
+// PbrtOptions.checkpointKey, the integrator and sampler types, the output file, the
+// scene bounds and lights, and camera rays through the film corners and center at
+// the ends of the shutter. Settings that none of these see, such as an integrator's
+// maximum depth or a material edit, must go into checkpointKey.
+static uint64_t CheckpointKey(const Integrator& integrator, const Scene& scene,
+                              const Camera& camera, const Sampler& sampler) {
+    const std::string &userKey = PbrtOptions.checkpointKey;
+    uint64_t hash = HashBytes(userKey.data(), userKey.size());
+    for (const char *name : {typeid(integrator).name(), typeid(sampler).name()}) {
+        hash = HashBytes(name, std::char_traits<char>::length(name) + 1, hash);
+    }
+    hash = HashBytes(camera.film->filename.data(), camera.film->filename.size(), hash);
+    const Bounds3f &bounds = scene.WorldBound();
+    hash = HashBytes(&bounds, sizeof(bounds), hash);
+    for (const auto &light : scene.lights) {
+        Float power[3];
+        light->Power().ToRGB(power);
+        hash = HashBytes(power, sizeof(power), hash);
+    }
+    Point2f extent(camera.film->fullResolution);
+    for (Point2f p : {Point2f(0, 0), Point2f(extent.x, 0), Point2f(0, extent.y), extent,
+                      extent*Float(.5)}) {
+        for (Float time : {Float(0), Float(1)}) {
+            CameraSample cameraSample;
+            cameraSample.pFilm = p;
+            cameraSample.pLens = Point2f(.5, .5);
+            cameraSample.time = time;
+            Ray ray;
+            camera.GenerateRay(cameraSample, &ray);
+            Float values[6] = {ray.o.x, ray.o.y, ray.o.z, ray.d.x, ray.d.y, ray.d.z};
+            hash = HashBytes(values, sizeof(values), hash);
+        }
+    }
+    return hash;
+}
+
+static CheckpointHeader MakeCheckpointHeader(const Film& film, int64_t samplesPerPixel,
+                                             int64_t samplesTaken, uint64_t key) {
+    CheckpointHeader header;
+    std::copy(checkpointMagic, checkpointMagic + 8, header.magic);
+    header.version = checkpointVersion;
+    header.floatSize = sizeof(Float);
+    header.pixelBounds[0] = film.croppedPixelBounds.pMin.x;
+    header.pixelBounds[1] = film.croppedPixelBounds.pMin.y;
+    header.pixelBounds[2] = film.croppedPixelBounds.pMax.x;
+    header.pixelBounds[3] = film.croppedPixelBounds.pMax.y;
+    header.samplesPerPixel = samplesPerPixel;
+    header.samplesTaken = samplesTaken;
+    header.key = key;
+    return header;
+}
+
+// Restores film from a checkpoint of the same configuration and key and returns
+// the samples per pixel it holds; 0 if there is no usable checkpoint.
+static int64_t LoadCheckpoint(const std::string& filename, Film& film,
+                              int64_t samplesPerPixel, uint64_t key) {
+    FILE *f = std::fopen(filename.c_str(), "rb");
+    if (!f) {
+        return 0;
+    }
+    CheckpointHeader header, expected = MakeCheckpointHeader(film, samplesPerPixel, 0, key);
+    bool valid = std::fread(&header, sizeof(header), 1, f) == 1 &&
+        std::equal(checkpointMagic, checkpointMagic + 8, header.magic) &&
+        header.version == expected.version && header.floatSize == expected.floatSize &&
+        std::equal(expected.pixelBounds, expected.pixelBounds + 4, header.pixelBounds) &&
+        header.samplesPerPixel == samplesPerPixel && header.key == key &&
+        header.samplesTaken > 0 && header.samplesTaken <= samplesPerPixel &&
+        film.ReadPixels(f);
+    std::fclose(f);
+    if (!valid) {
+        Warning("Checkpoint \"%s\" doesn't match this render or is damaged; starting over",
+                filename.c_str());
+        return 0;
+    }
+    return header.samplesTaken;
+}
+
+static void WriteCheckpoint(const std::string& filename, const Film& film,
+                            int64_t samplesPerPixel, int64_t samplesTaken, uint64_t key) {
+    // <write the checkpoint atomically, so a killed job leaves the last checkpoint>
+    CheckpointHeader header = MakeCheckpointHeader(film, samplesPerPixel, samplesTaken, key);
+    bool ok = WriteFileAtomically(filename, [&](FILE* f) {
+        return std::fwrite(&header, sizeof(header), 1, f) == 1 && film.WritePixels(f);
+    });
+    if (!ok) {
+        Warning("Couldn't write checkpoint \"%s\"", filename.c_str());
+    }
+}
+
+// <render in passes that each add the next samples of every pixel to the Film>
+// A pass merges its FilmTiles into the Film as it finishes, so after each pass
+// the Film holds a complete image at a lower sample count. Passes grow from one
+// sample per pixel by doubling, up to max(16, samplesPerPixel/8) samples, which
+// bounds the work a preempted job loses. Every pass regenerates the sample sets
+// of all pixels, which costs a PixelSampler O(samplesPerPixel) per pixel and pass;
+// the cap keeps the passes few. After each pass the state is saved to
+// PbrtOptions.checkpointFile, and a preview is written once previewInterval has
+// passed since the last. Rendering resumes from the checkpoint if one matches,
+// and stops early, with the checkpoint left to resume from, once timeBudget is spent.
+void SamplerIntegrator::renderProgressive(const Scene& scene,
+                                          const std::vector<Bounds2i>& tiles) const {
+    Film *film = camera->film;
+    const int64_t maxSamples = sampler->samplesPerPixel;
+    const int64_t maxPassSamples = std::max<int64_t>(16, maxSamples/8);
+    const std::string &checkpoint = PbrtOptions.checkpointFile;
+    const uint64_t checkpointKey =
+        checkpoint.empty() ? 0 : CheckpointKey(*this, scene, *camera, *sampler);
+    int64_t samplesTaken =
+        checkpoint.empty() ? 0 : LoadCheckpoint(checkpoint, *film, maxSamples, checkpointKey);
+    auto startTime = std::chrono::steady_clock::now();
+    auto lastPreview = startTime;
+
+    while (samplesTaken < maxSamples) {
+        int64_t passSamples = std::min(maxSamples - samplesTaken,
+                                       Clamp(samplesTaken, 1, maxPassSamples));
+        ParallelForWorkStealing([&](int64_t tileIndex) {
+            MemoryArena arena;
+            std::unique_ptr<Sampler> tileSampler = sampler->Clone(tileIndex);
+            std::unique_ptr<FilmTile> filmTile = film->GetFilmTile(tiles[tileIndex]);
+            for (Point2i pixel : tiles[tileIndex]) {
+                renderPixelSamples(scene, pixel, samplesTaken, samplesTaken + passSamples,
+                                   *tileSampler, *filmTile, arena, false);
+            }
+            film->MergeFilmTile(std::move(filmTile));
+        }, tiles.size());
+        samplesTaken += passSamples;
+
+        // <checkpoint the pass, write a preview when due and check the time budget>
+        if (!checkpoint.empty()) {
+            WriteCheckpoint(checkpoint, *film, maxSamples, samplesTaken, checkpointKey);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (PbrtOptions.previewInterval > 0 && samplesTaken < maxSamples &&
+            std::chrono::duration<Float>(now - lastPreview).count() >= PbrtOptions.previewInterval) {
+            film->WriteImage();
+            lastPreview = now;
+        }
+        if (PbrtOptions.timeBudget > 0 &&
+            std::chrono::duration<Float>(now - startTime).count() >= PbrtOptions.timeBudget) {
+            break;
+        }
+    }
+    if (PbrtOptions.printStats) {
+        std::printf("Progressive rendering: %lld of %lld samples per pixel\n",
+                    (long long)samplesTaken, (long long)maxSamples);
+    }
+}
+
 void SamplerIntegrator::Render(const Scene& scene) {
     Preprocess(scene, *sampler);
 
@@ -17,25 +415,70 @@ void SamplerIntegrator::Render(const Scene& scene) {
     // <compute number of tiles, nTiles, to use for parallel rendering>
     Bounds2i sampleBounds = camera->film->GetSampleBounds();
     Vector2i sampleExtent(sampleBounds.Diagonal());
-    const int tileSize = 16;
+    const int tileSize = ComputeTileSize(sampleExtent);
     Point2i nTiles((sampleExtent.x + tileSize - 1)/tileSize,
                    (sampleExtent.y + tileSize - 1)/tileSize);
 
-    ParallelFor2D([&](Point2i tile) {
+    // <order tiles along a Hilbert curve so consecutive tiles are image neighbours>
+    int hilbertOrder = 1;
+    while ((1 << hilbertOrder) < std::max(nTiles.x, nTiles.y)) {
+        ++hilbertOrder;
+    }
+    std::vector<std::pair<uint64_t, Point2i>> tileOrder;
+    tileOrder.reserve(nTiles.x*nTiles.y);
+    for (int y = 0; y < nTiles.y; ++y) {
+        for (int x = 0; x < nTiles.x; ++x) {
+            tileOrder.push_back(std::make_pair(HilbertIndex(hilbertOrder, x, y), Point2i(x, y)));
+        }
+    }
+    std::sort(tileOrder.begin(), tileOrder.end(),
+              [](const std::pair<uint64_t, Point2i>& a, const std::pair<uint64_t, Point2i>& b) {
+        return a.first < b.first;
+    });
+
+    // <compute sample bounds for tile>
+    auto computeTileBounds = [&](const Point2i& tile) {
+        int x0 = sampleBounds.pMin.x + tile.x*tileSize;
+        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+        int y0 = sampleBounds.pMin.y + tile.y*tileSize;
+        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+        return Bounds2i(Point2i(x0, y0), Point2i(x1, y1));
+    };
+
+    if (PbrtOptions.progressive || PbrtOptions.adaptiveSampling) {
+        std::vector<Bounds2i> tiles;
+        tiles.reserve(tileOrder.size());
+        for (const std::pair<uint64_t, Point2i>& t : tileOrder) {
+            tiles.push_back(computeTileBounds(t.second));
+        }
+        if (PbrtOptions.progressive) {
+            renderProgressive(scene, tiles);
+        }
+        else {
+            renderAdaptive(scene, tiles);
+        }
+        camera->film->WriteImage();
+        return;
+    }
+
+    ParallelForWorkStealing([&](int64_t tileIndex) {
+        Point2i tile = tileOrder[tileIndex].second;
         // <render section of image corresponding to tile>
         // <allocate memory arena for tile>
         MemoryArena arena;
         // <get sampler instance for tile>
         int seed = tile.y*nTiles.x + tile.x;
         std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-        // <compute sample bounds for tile>
-        int x0 = sampleBounds.pMin.x + tile.x*tileSize;
-        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-        int y0 = sampleBounds.pMin.y + tile.y*tileSize;
-        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-        Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+        Bounds2i tileBounds = computeTileBounds(tile);
         // <get FilmTile for tile>
         std::unique_ptr<FilmTile> filmTile = camera->film->GetFilmTile(tileBounds);
+        if (PbrtOptions.batchPrimaryRays) {
+            std::unique_ptr<Sampler> cameraSampler = sampler->Clone(seed);
+            renderTileBatched(scene, tileBounds, *tileSampler, *cameraSampler,
+                              *filmTile, arena);
+            camera->film->MergeFilmTile(std::move(filmTile));
+            return;
+        }
         // <loop over pixel in tile to render them>
         for (Point2i pixel : tileBounds) {
         	tileSampler->StartPixel(pixel);
@@ -65,7 +508,7 @@ void SamplerIntegrator::Render(const Scene& scene) {
         }
         // <merge image tile into Film>
         camera->film->MergeFilmTile(std::move(filmTile));
-    }, nTiles);
+    }, tileOrder.size());
     // <save final image after rendering>
     camera->film->WriteImage();
 }
@@ -83,11 +526,111 @@ Spectrum SamplerIntegrator::SpecularReflect(const RayDifferential& ray,
     const Normal3f ns = isect.shading.n;
     if (pdf > 0 && !f.IsBlack() && AbsDot(wi, ns) != 0) {
         // <compute ray differential rd for specular reflection>
-        return f*Li(rd, scene, sampler, arena, isect, depth+1)*AbsDot(wi,ns)/pdf;
+        // SurfaceInteraction carries no dpdx/dpdy yet, so rd has no differentials.
+        RayDifferential rd = isect.SpawnRay(wi);
+        return f*Li(rd, scene, sampler, arena, depth+1)*AbsDot(wi,ns)/pdf;
     }
     else {
         return Spectrum(0.0f);
     }
 }
 
+Spectrum UniformSampleOneLight(const SurfaceInteraction& it, const Scene& scene,
+                               MemoryArena& arena, Sampler& sampler) {
+
+    // <randomly choose a single light to sample>
+    int nLights = int(scene.lights.size());
+    if (nLights == 0) {
+        return Spectrum(0.f);
+    }
+    int lightNum = std::min((int)(sampler.Get1D()*nLights), nLights - 1);
+    const std::shared_ptr<Light> &light = scene.lights[lightNum];
+    Point2f uLight = sampler.Get2D();
+    return (Float)nLights*EstimateDirect(it, *light, uLight, scene);
+}
+
+// <sample a light at a surface point, leaving the shadow test to the caller>
+// Returns false if the sample carries no light. Otherwise *Ld is its unshadowed
+// contribution, which counts only if *shadowRay is unoccluded.
+static bool SampleDirect(const SurfaceInteraction& it, const Light& light,
+                         const Point2f& uLight, Spectrum* Ld, Ray* shadowRay) {
+
+    // <sample light source>
+    Vector3f wi;
+    Float lightPdf = 0;
+    VisibilityTester visibility;
+    Spectrum Li = light.Sample_Li(it, uLight, &wi, &lightPdf, &visibility);
+    if (lightPdf == 0 || Li.IsBlack()) {
+        return false;
+    }
+
+    // <evaluate BSDF for light sampling point>
+    Spectrum f = it.bsdf->f(it.wo, wi)*AbsDot(wi, it.shading.n);
+    if (f.IsBlack()) {
+        return false;
+    }
+    *Ld = f*Li/lightPdf;
+    *shadowRay = visibility.P0().SpawnRayTo(visibility.P1());
+    return true;
+}
+
+Spectrum UniformSampleAllLights(const SurfaceInteraction& it, const Scene& scene,
+                                MemoryArena& arena, Sampler& sampler,
+                                const std::vector<int>& nLightSamples) {
+
+    // <sample every light, queueing a shadow ray for each sample that carries light>
+    // Without a Preprocess that sized nLightSamples for the scene, every light
+    // gets a single sample.
+    bool requested = nLightSamples.size() == scene.lights.size();
+    int maxShadowRays = 0;
+    for (size_t j = 0; j < scene.lights.size(); ++j) {
+        maxShadowRays += requested ? nLightSamples[j] : 1;
+    }
+    Ray *shadowRays = arena.Alloc<Ray>(maxShadowRays);
+    Spectrum *Ld = arena.Alloc<Spectrum>(maxShadowRays);
+    int nShadowRays = 0;
+    for (size_t j = 0; j < scene.lights.size(); ++j) {
+        int nSamples = requested ? nLightSamples[j] : 1;
+        const Point2f *uLightArray = requested ? sampler.Get2DArray(nSamples) : nullptr;
+        // <fall back to a single sample once the requested arrays are used up>
+        Point2f uLight;
+        if (!uLightArray) {
+            uLight = sampler.Get2D();
+            uLightArray = &uLight;
+            nSamples = 1;
+        }
+        for (int k = 0; k < nSamples; ++k) {
+            if (SampleDirect(it, *scene.lights[j], uLightArray[k], &Ld[nShadowRays],
+                             &shadowRays[nShadowRays])) {
+                Ld[nShadowRays++] /= nSamples;
+            }
+        }
+    }
+    if (nShadowRays == 0) {
+        return Spectrum(0.f);
+    }
+
+    // <trace the shadow rays of the point as one batch>
+    bool *occluded = arena.Alloc<bool>(nShadowRays, false);
+    scene.IntersectPStream(shadowRays, nShadowRays, occluded);
+    Spectrum L(0.f);
+    for (int i = 0; i < nShadowRays; ++i) {
+        if (!occluded[i]) {
+            L += Ld[i];
+        }
+    }
+    return L;
+}
+
+Spectrum EstimateDirect(const SurfaceInteraction& it, const Light& light,
+                        const Point2f& uLight, const Scene& scene) {
+
+    Spectrum Ld;
+    Ray shadowRay;
+    if (!SampleDirect(it, light, uLight, &Ld, &shadowRay) || scene.IntersectP(shadowRay)) {
+        return Spectrum(0.f);
+    }
+    return Ld;
+}
+
 }
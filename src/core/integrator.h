@@ -6,6 +6,7 @@
 #include "sampler.h"
 #include "memory.h"
 #include <memory>
+#include <vector>
 
 namespace pbrt {
 
@@ -29,15 +30,48 @@ namespace pbrt {
     virtual void Render(const Scene& scene);
     virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
 			Sampler& sampler, MemoryArena& arena, int depth = 0) const = 0;
+    // Radiance along ray when its closest intersection is already known; hit tells
+    // whether isect is valid. Batched rendering shades camera rays through this.
+    // The default ignores the intersection and calls Li().
+    virtual Spectrum LiIntersected(const RayDifferential& ray, bool hit,
+                                   SurfaceInteraction& isect, const Scene& scene,
+                                   Sampler& sampler, MemoryArena& arena, int depth = 0) const {
+      return Li(ray, scene, sampler, arena, depth);
+    }
     Spectrum SpecularReflect(const RayDifferential& ray, const SurfaceInteraction& isect,
                              const Scene& scene, Sampler& sampler, MemoryArena &arena,
                              int depth) const;
   protected:
     std::shared_ptr<const Camera> camera;
   private:
+    void renderTileBatched(const Scene& scene, const Bounds2i& tileBounds,
+                           Sampler& tileSampler, Sampler& cameraSampler,
+                           FilmTile& filmTile, MemoryArena& arena) const;
+    void renderPixelSamples(const Scene& scene, const Point2i& pixel, int64_t firstSample,
+                            int64_t endSample, Sampler& tileSampler, FilmTile& filmTile,
+                            MemoryArena& arena, bool addPixelStats) const;
+    void renderAdaptive(const Scene& scene, const std::vector<Bounds2i>& tiles) const;
+    void renderProgressive(const Scene& scene, const std::vector<Bounds2i>& tiles) const;
+
     std::shared_ptr<Sampler> sampler;
     const Bounds2i pixelBounds;
   };
 
+  // Direct lighting at a surface point from one light chosen uniformly, scaled
+  // by the number of lights. Light sampling only: there are no area lights, so
+  // every light is a delta light and BSDF sampling could never reach one.
+  Spectrum UniformSampleOneLight(const SurfaceInteraction& it, const Scene& scene,
+                                 MemoryArena& arena, Sampler& sampler);
+  // Direct lighting at a surface point from every light, averaging
+  // nLightSamples[j] samples of light j taken from the 2D arrays requested in
+  // Preprocess, or a single sample once those are used up or if nLightSamples
+  // doesn't have an entry for every light. The shadow rays of all samples are
+  // traced together through Scene::IntersectPStream.
+  Spectrum UniformSampleAllLights(const SurfaceInteraction& it, const Scene& scene,
+                                  MemoryArena& arena, Sampler& sampler,
+                                  const std::vector<int>& nLightSamples);
+  Spectrum EstimateDirect(const SurfaceInteraction& it, const Light& light,
+                          const Point2f& uLight, const Scene& scene);
+
 }
 #endif//INTEGRATOR_H
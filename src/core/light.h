@@ -20,6 +20,7 @@ inline bool IsDeltaLight(int flags) {
 
 class VisibilityTester {
 public:
+  VisibilityTester() {}
   VisibilityTester(const Interaction& p0, const Interaction& p1)
 : p0(p0), p1(p1) {}
 
@@ -22,6 +22,13 @@ class MemoryArena {
 
 public:
     MemoryArena(size_t blockSize = 262144) : blockSize(blockSize) {}
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+    ~MemoryArena() {
+        FreeAligned(currentBlock);
+        for (auto &block : usedBlocks) FreeAligned(block.second);
+        for (auto &block : availableBlocks) FreeAligned(block.second);
+    }
 
     void* Alloc(size_t nBytes) {
         // <round up to a minimum machine alignment>
@@ -1,27 +1,268 @@
 #include "parallel.h"
 #include "geometry.h"
+#include "api.h"
+
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 
 namespace pbrt {
 
+// <parallel local definitions>
+static std::vector<std::thread> threads;
+static bool shutdownThreads = false;
+class ParallelForLoop;
+static ParallelForLoop *workList = nullptr;
+static std::mutex workListMutex;
+static std::condition_variable workListCondition;
+
+thread_local int ThreadIndex = 0;
+
+class ParallelForLoop {
+public:
+  ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex, int chunkSize)
+  : func1D(std::move(func1D)), maxIndex(maxIndex), chunkSize(chunkSize) {}
+  ParallelForLoop(std::function<void(Point2i)> f, const Point2i& count)
+  : func2D(std::move(f)), maxIndex(count.x*count.y), chunkSize(1) {
+    nX = count.x;
+  }
+
+  bool Finished() const {
+    return nextIndex >= maxIndex && activeWorkers == 0;
+  }
+
+  // <ParallelForLoop data>
+  std::function<void(int64_t)> func1D;
+  std::function<void(Point2i)> func2D;
+  const int64_t maxIndex;
+  const int chunkSize;
+  int64_t nextIndex = 0;
+  int activeWorkers = 0;
+  ParallelForLoop *next = nullptr;
+  int nX = -1;
+};
+
+// <unlink a loop whose iterations have all been handed out; it need not be the list head>
+static void RemoveFromWorkList(ParallelForLoop* loop) {
+  ParallelForLoop **link = &workList;
+  while (*link && *link != loop) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = loop->next;
+  }
+}
+
+// <run a chunk of loop iterations; workListMutex must be held on entry and is held on exit>
+static void RunChunk(ParallelForLoop& loop, std::unique_lock<std::mutex>& lock) {
+
+  // <find the set of loop iterations to run next>
+  int64_t indexStart = loop.nextIndex;
+  int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+
+  // <update loop to reflect iterations this thread will run>
+  loop.nextIndex = indexEnd;
+  if (loop.nextIndex == loop.maxIndex) {
+    RemoveFromWorkList(&loop);
+  }
+  loop.activeWorkers++;
+
+  // <run loop indices in [indexStart, indexEnd)>
+  lock.unlock();
+  for (int64_t index = indexStart; index < indexEnd; ++index) {
+    if (loop.func1D) {
+      loop.func1D(index);
+    }
+    else {
+      loop.func2D(Point2i(index % loop.nX, index / loop.nX));
+    }
+  }
+  lock.lock();
+
+  // <update loop to reflect completion of iterations>
+  loop.activeWorkers--;
+  if (loop.Finished()) {
+    workListCondition.notify_all();
+  }
+}
+
+static void workerThreadFunc(int tIndex) {
+
+  ThreadIndex = tIndex;
+  std::unique_lock<std::mutex> lock(workListMutex);
+  while (!shutdownThreads) {
+    if (!workList) {
+      // <sleep until there are more tasks to run>
+      workListCondition.wait(lock);
+    }
+    else {
+      // <get work from workList and run loop iterations>
+      RunChunk(*workList, lock);
+    }
+  }
+}
+
+// <enqueue loop and help with its iterations until all of them are done>
+static void RunLoop(ParallelForLoop& loop) {
+
+  std::unique_lock<std::mutex> lock(workListMutex);
+  loop.next = workList;
+  workList = &loop;
+  lock.unlock();
+  workListCondition.notify_all();
+
+  // <help out with parallel loop iterations in the current thread>
+  lock.lock();
+  while (!loop.Finished()) {
+    if (loop.nextIndex < loop.maxIndex) {
+      RunChunk(loop, lock);
+    }
+    else {
+      // <wait for iterations running on other threads to complete>
+      workListCondition.wait(lock);
+    }
+  }
+}
+
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i& count) {
 
-//    if (threads.size() == 0) {
-        for (int y = 0; y < count.y; ++y) {
-            for (int x = 0; x < count.x; ++x) {
-                func(Point2i(x,y));
-            }
-        }
-//    }
+  if (threads.empty() || count.x*count.y <= 1) {
+    for (int y = 0; y < count.y; ++y) {
+      for (int x = 0; x < count.x; ++x) {
+        func(Point2i(x,y));
+      }
+    }
+    return;
+  }
+
+  ParallelForLoop loop(std::move(func), count);
+  RunLoop(loop);
 }
 
 void ParallelFor(const std::function<void(int64_t)> &func, int64_t count, int chunkSize) {
 
-//  if (PbrtOptions.nThreads == 1 || count < chunkSize) {
-    for (int i = 0; i < count; ++i) {
+  // <run iterations immediately if not using threads or if count is small>
+  if (threads.empty() || count < chunkSize) {
+    for (int64_t i = 0; i < count; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  ParallelForLoop loop(func, count, std::max(1, chunkSize));
+  RunLoop(loop);
+}
+
+// <work-stealing deque of loop indices owned by one worker>
+struct WorkStealingDeque {
+  std::mutex mutex;
+  int64_t begin = 0, end = 0;
+};
+
+// <pop the next index from the front of the worker's own deque>
+static bool PopFront(WorkStealingDeque& deque, int64_t* index) {
+  std::lock_guard<std::mutex> lock(deque.mutex);
+  if (deque.begin == deque.end) {
+    return false;
+  }
+  *index = deque.begin++;
+  return true;
+}
+
+// <move the back half of victim's indices into thief>
+static bool StealHalf(WorkStealingDeque& victim, WorkStealingDeque& thief) {
+  int64_t begin, end;
+  {
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    int64_t remaining = victim.end - victim.begin;
+    if (remaining <= 0) {
+      return false;
+    }
+    begin = victim.end - (remaining + 1)/2;
+    end = victim.end;
+    victim.end = begin;
+  }
+  std::lock_guard<std::mutex> lock(thief.mutex);
+  thief.begin = begin;
+  thief.end = end;
+  return true;
+}
+
+void ParallelForWorkStealing(const std::function<void(int64_t)> &func, int64_t count) {
+
+  int nWorkers = threads.empty() ? 1 : MaxThreadIndex();
+  if (nWorkers == 1 || count <= 1) {
+    for (int64_t i = 0; i < count; ++i) {
       func(i);
     }
-//  }
+    return;
+  }
+
+  // <seed each worker's deque with a contiguous slice of the index range>
+  std::unique_ptr<WorkStealingDeque[]> deques(new WorkStealingDeque[nWorkers]);
+  for (int w = 0; w < nWorkers; ++w) {
+    deques[w].begin = count*w/nWorkers;
+    deques[w].end = count*(w + 1)/nWorkers;
+  }
+
+  // <run one worker per pool slot until no deque has work left>
+  ParallelFor([&](int64_t w) {
+    WorkStealingDeque &own = deques[w];
+    while (true) {
+      int64_t index;
+      while (PopFront(own, &index)) {
+        func(index);
+      }
+      // <own deque is empty; try to steal from the other workers in turn>
+      bool stole = false;
+      for (int i = 1; i < nWorkers && !stole; ++i) {
+        stole = StealHalf(deques[(w + i) % nWorkers], own);
+      }
+      if (!stole) {
+        break;
+      }
+    }
+  }, nWorkers);
+}
+
+int NumSystemCores() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+int MaxThreadIndex() {
+  return PbrtOptions.nThreads == 0 ? NumSystemCores() : PbrtOptions.nThreads;
+}
+
+void ParallelInit() {
+
+  if (!threads.empty()) {
+    return;
+  }
+  // <launch one fewer worker than MaxThreadIndex; the calling thread works too>
+  int nThreads = MaxThreadIndex();
+  ThreadIndex = 0;
+  for (int i = 0; i < nThreads - 1; ++i) {
+    threads.push_back(std::thread(workerThreadFunc, i + 1));
+  }
+}
+
+void ParallelCleanup() {
+
+  if (threads.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(workListMutex);
+    shutdownThreads = true;
+  }
+  workListCondition.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  threads.erase(threads.begin(), threads.end());
+  shutdownThreads = false;
 }
 
 }
@@ -8,9 +8,26 @@
 
 namespace pbrt {
 
+// Loops run on a persistent worker pool started by ParallelInit(); until then (or with
+// nThreads == 1) they run serially on the calling thread. Iterations are handed out in
+// chunks of chunkSize to whichever thread asks next. Nested calls are allowed.
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i& count);
 void ParallelFor(const std::function<void(int64_t)> &func, int64_t count, int chunkSize = 1);
 
+// Like ParallelFor, but each worker owns a deque seeded with a contiguous slice of
+// [0, count) and runs it front to back; idle workers steal the back half of another
+// worker's deque. Callers that order indices spatially keep each worker on a coherent
+// region while still balancing uneven per-index cost.
+void ParallelForWorkStealing(const std::function<void(int64_t)> &func, int64_t count);
+
+// Index of the calling thread in [0, MaxThreadIndex()); 0 is the thread that called ParallelInit().
+extern thread_local int ThreadIndex;
+int MaxThreadIndex();
+int NumSystemCores();
+
+void ParallelInit();
+void ParallelCleanup();
+
 class AtomicFloat {
 public:
   explicit AtomicFloat(Float v = 0) { bits = FloatToBits(v); }
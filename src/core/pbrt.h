@@ -46,7 +46,18 @@ namespace pbrt {
   //typedef SampledSpectrum Spectrum;
 
   struct Options {
-    /* int nThreads = 0; */
+    int nThreads = 0; // 0 -> one thread per core
+    bool batchPrimaryRays = false; // trace each tile's camera rays as one stream
+    std::string bvhCacheDir; // where BVHAccel caches built BVHs; empty -> no cache
+    std::string accelerator = "bvh"; // scene aggregate: "bvh" or "kdtree"
+    bool printStats = false; // report BVH quality after builds and traversal counts after rendering
+    bool adaptiveSampling = false; // render in passes that add samples only to noisy pixels
+    float adaptiveErrorThreshold = 0.02f; // relative standard error at which a pixel is done
+    bool progressive = false; // render in passes over the whole image, merging each into the Film
+    float timeBudget = 0; // seconds after which adaptive or progressive rendering starts no new pass; 0 -> no limit
+    float previewInterval = 0; // seconds between progressive preview images; 0 -> final image only
+    std::string checkpointFile; // progressive state saved after each pass and resumed from; empty -> none
+    std::string checkpointKey; // identifies the scene and frame; a checkpoint written under another key isn't resumed
     /* bool quickRender = false; */
     /* bool quiet = false; */
     /* bool cat = false, toPly = false; */
@@ -165,6 +176,18 @@ namespace pbrt {
     return (n * MachineEpsilon) / (1 - n*MachineEpsilon);
   }
 
+  // <64-bit FNV-1a>
+  // Pass the previous result as hash to continue a hash over several buffers.
+  inline uint64_t HashBytes(const void* data, size_t size,
+                            uint64_t hash = 14695981039346656037ull) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
 } // namespace pbrt
 
 #endif//PBRT_H
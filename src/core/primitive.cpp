@@ -3,6 +3,27 @@
 
 namespace pbrt {
 
+void Primitive::LinearMotionBounds(Float /*time0*/, Float /*time1*/, int nSegments,
+    Bounds3f* bounds) const {
+  Bounds3f b = WorldBound();
+  for (int i = 0; i <= nSegments; ++i) {
+    bounds[i] = b;
+  }
+}
+
+void Primitive::IntersectStream(const Ray* rays, int nRays,
+    SurfaceInteraction* isects, bool* hits) const {
+  for (int i = 0; i < nRays; ++i) {
+    hits[i] = Intersect(rays[i], &isects[i]);
+  }
+}
+
+void Primitive::IntersectPStream(const Ray* rays, int nRays, bool* occluded) const {
+  for (int i = 0; i < nRays; ++i) {
+    occluded[i] = IntersectP(rays[i]);
+  }
+}
+
 bool GeometricPrimitive::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
 
   Float tHit;
@@ -28,7 +49,7 @@ const AreaLight* GeometricPrimitive::GetAreaLight() const {
 }
 
 const Material* GeometricPrimitive::GetMaterial() const {
-  material.get();
+  return material.get();
 }
 
 void GeometricPrimitive::ComputeScatteringFunctions(SurfaceInteraction* isect,
@@ -59,6 +80,13 @@ bool TransformedPrimitive::Intersect(const Ray& r, SurfaceInteraction* isect) co
   return true;
 }
 
+bool TransformedPrimitive::IntersectP(const Ray& r) const {
+
+  Transform interpolatedPrimToWorld;
+  primitiveToWorld.Interpolate(r.time, &interpolatedPrimToWorld);
+  return primitive->IntersectP(Inverse(interpolatedPrimToWorld)(r));
+}
+
 const AreaLight* Aggregate::GetAreaLight() const {
   // TODO
   return nullptr;
@@ -16,10 +16,21 @@ class Primitive {
 public:
 
   virtual Bounds3f WorldBound() const = 0;
+  // Bounds at nSegments + 1 evenly spaced times from time0 to time1 such that
+  // interpolating consecutive ones linearly bounds the primitive at every time
+  // between them. Primitives that do not move return WorldBound at every time.
+  virtual void LinearMotionBounds(Float time0, Float time1, int nSegments,
+      Bounds3f* bounds) const;
 
   virtual bool Intersect(const Ray& ray, SurfaceInteraction* isect) const = 0;
   virtual bool IntersectP(const Ray& ray) const = 0;
 
+  // Intersect nRays rays at once; hits[i] tells whether isects[i] was filled in.
+  // Aggregates override these to share traversal work between coherent rays.
+  virtual void IntersectStream(const Ray* rays, int nRays,
+      SurfaceInteraction* isects, bool* hits) const;
+  virtual void IntersectPStream(const Ray* rays, int nRays, bool* occluded) const;
+
   virtual const AreaLight* GetAreaLight() const = 0;
 
   virtual const Material* GetMaterial() const = 0;
@@ -50,6 +61,8 @@ public:
   virtual void ComputeScatteringFunctions(SurfaceInteraction* isect,
       MemoryArena& arena, TransportMode mode, bool allowMultipleLobes) const;
 
+  const Shape* GetShape() const { return shape.get(); }
+
 private:
 
   std::shared_ptr<Shape> shape;
@@ -58,10 +71,14 @@ private:
   MediumInterface mediumInterface;
 };
 
+// An instance of a shared primitive (usually a BVHAccel over one object's
+// geometry) placed in the world by primitiveToWorld. Many instances can share
+// one primitive, so a top-level BVH over instances only stores the geometry
+// and its bottom-level BVH once per object.
 class TransformedPrimitive : public Primitive {
 
 public:
-  TransformedPrimitive(std::shared_ptr<Primitive>& _primitive,
+  TransformedPrimitive(const std::shared_ptr<Primitive>& _primitive,
       const AnimatedTransform& _primitiveToWorld)
 : primitive(_primitive), primitiveToWorld(_primitiveToWorld) {}
 
@@ -69,11 +86,33 @@ public:
     return primitiveToWorld.MotionBounds(primitive->WorldBound());
   }
 
+  virtual void LinearMotionBounds(Float time0, Float time1, int nSegments,
+      Bounds3f* bounds) const {
+    primitiveToWorld.LinearMotionBounds(primitive->WorldBound(), time0, time1,
+        nSegments, bounds);
+  }
+
   virtual bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
+  virtual bool IntersectP(const Ray& ray) const;
+
+  // Hits report the instanced primitive's GeometricPrimitive, so these are
+  // never asked of the instance itself.
+  virtual const AreaLight* GetAreaLight() const { return nullptr; }
+  virtual const Material* GetMaterial() const { return nullptr; }
+  virtual void ComputeScatteringFunctions(SurfaceInteraction* isect,
+      MemoryArena& arena, TransportMode mode, bool allowMultipleLobes) const {}
+
+  const Primitive* GetPrimitive() const { return primitive.get(); }
+
+  // Moves the instance. Aggregates holding it must be refit (BVHAccel::Refit)
+  // before they are traversed again.
+  void SetPrimitiveToWorld(const AnimatedTransform& _primitiveToWorld) {
+    primitiveToWorld = _primitiveToWorld;
+  }
 
 private:
   std::shared_ptr<Primitive> primitive;
-  const AnimatedTransform primitiveToWorld;
+  AnimatedTransform primitiveToWorld;
 };
 
 class Aggregate : public Primitive {
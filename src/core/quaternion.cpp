@@ -48,12 +48,12 @@ Transform Quaternion::ToTransform() const {
   Matrix4x4 m;
   m.m[0][0] = 1 - 2*(yy + zz);
   m.m[0][1] = 2*(xy + wz);
-  m.m[0][2] = 2*(xz + wy);
-  m.m[1][0] = 2*(xy + wz);
+  m.m[0][2] = 2*(xz - wy);
+  m.m[1][0] = 2*(xy - wz);
   m.m[1][1] = 1 - 2*(xx + zz);
   m.m[1][2] = 2*(yz + wx);
   m.m[2][0] = 2*(xz + wy);
-  m.m[2][1] = 2*(yz + wx);
+  m.m[2][1] = 2*(yz - wx);
   m.m[2][2] = 1 - 2*(xx + yy);
 
   return Transform(Transpose(m), m);
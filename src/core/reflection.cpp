@@ -147,4 +147,93 @@ Spectrum BSDF::f(const Vector3f& woW, const Vector3f& wiW, BxDFType flags) const
   return f;
 }
 
+int BSDF::NumComponents(BxDFType flags) const {
+  int num = 0;
+  for (int i = 0; i < nBxDFs; ++i) {
+    if (bxdfs[i]->MatchesFlags(flags)) {
+      ++num;
+    }
+  }
+  return num;
+}
+
+Spectrum BSDF::Sample_f(const Vector3f& woW, Vector3f* wiW, const Point2f& u, Float* pdf,
+    BxDFType type, BxDFType* sampledType) const {
+
+  // <choose which BxDF to sample>
+  *pdf = 0;
+  if (sampledType) {
+    *sampledType = BxDFType(0);
+  }
+  int matchingComps = NumComponents(type);
+  if (matchingComps == 0) {
+    return Spectrum(0.f);
+  }
+  int comp = std::min((int)std::floor(u[0]*matchingComps), matchingComps - 1);
+  BxDF *bxdf = nullptr;
+  int count = comp;
+  for (int i = 0; i < nBxDFs; ++i) {
+    if (bxdfs[i]->MatchesFlags(type) && count-- == 0) {
+      bxdf = bxdfs[i];
+      break;
+    }
+  }
+
+  // <remap u[0] to [0,1) and sample the chosen BxDF>
+  Point2f uRemapped(std::min(u[0]*matchingComps - comp, OneMinusEpsilon), u[1]);
+  Vector3f wi, wo = WorldToLocal(woW);
+  if (wo.z == 0) {
+    return Spectrum(0.f);
+  }
+  Spectrum f = bxdf->Sample_f(wo, &wi, uRemapped, pdf);
+  if (*pdf == 0) {
+    return Spectrum(0.f);
+  }
+  if (sampledType) {
+    *sampledType = bxdf->type;
+  }
+  *wiW = LocalToWorld(wi);
+
+  // <compute overall pdf and value of the matching BxDFs for a non-specular sample>
+  if (bxdf->type & BSDF_SPECULAR) {
+    *pdf /= matchingComps;
+    return f;
+  }
+  bool reflect = Dot(*wiW, ng)*Dot(woW, ng) > 0;
+  f = Spectrum(0.f);
+  for (int i = 0; i < nBxDFs; ++i) {
+    if (!bxdfs[i]->MatchesFlags(type)) {
+      continue;
+    }
+    if (bxdfs[i] != bxdf) {
+      *pdf += bxdfs[i]->Pdf(wo, wi);
+    }
+    if ((reflect && (bxdfs[i]->type & BSDF_REFLECTION)) ||
+        (!reflect && (bxdfs[i]->type & BSDF_TRANSMISSION))) {
+      f += bxdfs[i]->f(wo, wi);
+    }
+  }
+  *pdf /= matchingComps;
+  return f;
+}
+
+Float BSDF::Pdf(const Vector3f& woW, const Vector3f& wiW, BxDFType flags) const {
+  if (nBxDFs == 0) {
+    return 0;
+  }
+  Vector3f wo = WorldToLocal(woW), wi = WorldToLocal(wiW);
+  if (wo.z == 0) {
+    return 0;
+  }
+  Float pdf = 0;
+  int matchingComps = 0;
+  for (int i = 0; i < nBxDFs; ++i) {
+    if (bxdfs[i]->MatchesFlags(flags)) {
+      ++matchingComps;
+      pdf += bxdfs[i]->Pdf(wo, wi);
+    }
+  }
+  return matchingComps > 0 ? pdf/matchingComps : 0;
+}
+
 } // namespace pbrt
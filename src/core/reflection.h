@@ -78,7 +78,7 @@ public:
       const Point2f& sample, Float* pdf, BxDFType* sampledType = nullptr) const;
   virtual Spectrum rho(const Vector3f& w, int nSamples, const Point2f* samples) const;
   virtual Spectrum rho(int nSamples, const Point2f* samples1, const Point2f* samples2) const;
-  Float Pdf(const Vector3f& wo, const Vector3f& wi) const;
+  virtual Float Pdf(const Vector3f& wo, const Vector3f& wi) const;
 
   const BxDFType type;
 };
@@ -141,6 +141,7 @@ public:
   }
   Spectrum Sample_f(const Vector3f& wo, Vector3f* wi,
       const Point2f& sample, Float* pdf, BxDFType* sampledType) const override;
+  Float Pdf(const Vector3f& wo, const Vector3f& wi) const override { return 0; }
 private:
   const Spectrum R;
   const Fresnel *fresnel;
@@ -185,7 +186,12 @@ public:
     ss.z*v.x + ts.z*v.y + ns.z*v.z);
   }
 
-  Spectrum f(const Vector3f& woW, const Vector3f& wiW, BxDFType flags) const;
+  Spectrum f(const Vector3f& woW, const Vector3f& wiW, BxDFType flags = BSDF_ALL) const;
+  // Samples wiW from one BxDF matching type, chosen with u[0]; the pdf and the
+  // value returned are those of all matching BxDFs unless the chosen one is specular.
+  Spectrum Sample_f(const Vector3f& woW, Vector3f* wiW, const Point2f& u, Float* pdf,
+      BxDFType type = BSDF_ALL, BxDFType* sampledType = nullptr) const;
+  Float Pdf(const Vector3f& woW, const Vector3f& wiW, BxDFType flags = BSDF_ALL) const;
   Spectrum rho(int nSamples, const Point2f* samples1,
       const Point2f* samples2, BxDFType flags = BSDF_ALL) const;
   Spectrum rho(const Vector3f& wo, int nSamples,
@@ -3,35 +3,44 @@
 
 #include "pbrt.h"
 
-#include <chrono>
-#include <random>
-#include <limits>
+#include <algorithm>
+#include <cstdint>
 
 namespace pbrt {
+// Largest Float below one, written out since hex float literals need C++17.
 #ifdef PBRT_FLOAT_IS_DOUBLE
-static const Float OneMinusEpsilon = 0x1.fffffffffffffp-1;
+static const Float OneMinusEpsilon = 0.99999999999999989;
 #else
-static const Float OneMinusEpsilon = 0x1.fffffep-1;
+static const Float OneMinusEpsilon = 0.99999994f;
 #endif
 
+#define PCG32_DEFAULT_STATE 0x853c49e6748fea9bULL
+#define PCG32_DEFAULT_STREAM 0xda3e39cb94b95bdbULL
+#define PCG32_MULT 0x5851f42d4c957f2dULL
+
+// PCG32 generator (O'Neill, pcg-random.org). Every sequence index selects a
+// distinct stream, so a given index always yields the same numbers.
 class RNG {
 public:
-  RNG()
-: distribution(0,std::numeric_limits<uint32_t>::max()) { }
-  RNG(uint64_t sequenceIndex)
-  : distribution(0,std::numeric_limits<uint32_t>::max()) {
+  RNG() : state(PCG32_DEFAULT_STATE), inc(PCG32_DEFAULT_STREAM) {}
+  RNG(uint64_t sequenceIndex) {
     SetSequence(sequenceIndex);
   }
 
   void SetSequence(uint64_t sequenceIndex) {
-    // TODO
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    generator.seed(seed);
+    state = 0u;
+    inc = (sequenceIndex << 1u) | 1u;
+    UniformUInt32();
+    state += PCG32_DEFAULT_STATE;
+    UniformUInt32();
   }
 
   uint32_t UniformUInt32() {
-    // TODO (preliminary version currently)
-    return distribution(generator);
+    uint64_t oldState = state;
+    state = oldState*PCG32_MULT + inc;
+    uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+    uint32_t rot = (uint32_t)(oldState >> 59u);
+    return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
   }
   uint32_t UniformUInt32(uint32_t b) {
     uint32_t threshold = (~b + 1u)%b;
@@ -44,12 +53,11 @@ public:
   }
 
   Float UniformFloat() {
-    return std::min(OneMinusEpsilon, UniformUInt32()*0x1p-32f);
+    return std::min(OneMinusEpsilon, Float(UniformUInt32()*2.3283064365386963e-10f));
   }
 
 private:
-  std::default_random_engine generator;
-  std::uniform_int_distribution<uint32_t> distribution;
+  uint64_t state, inc;
 };
 
 } // namespace pbrt
@@ -70,11 +70,33 @@ bool PixelSampler::StartNextSample() {
   return Sampler::StartNextSample();
 }
 
+// <hash a pixel, and optionally a sample index, to an RNG sequence>
+static uint64_t MixBits(uint64_t v) {
+  v ^= (v >> 31);
+  v *= 0x7fb5d329728ea185ULL;
+  v ^= (v >> 27);
+  v *= 0x81dadef4bc2dd44dULL;
+  v ^= (v >> 33);
+  return v;
+}
+
+static uint64_t PixelSequence(const Point2i& p, uint64_t salt) {
+  return MixBits((((uint64_t)(uint32_t)p.x << 32) | (uint32_t)p.y) ^ MixBits(salt));
+}
+
 bool PixelSampler::SetSampleNumber(int64_t sampleNum) {
   current1DDimension = current2DDimension = 0;
+  // <restart the dimensions past the sampled ones on a stream of the sample's own>
+  // Otherwise a later visit starting at sampleNum would reuse the numbers that
+  // the samples of an earlier visit drew.
+  rng.SetSequence(PixelSequence(currentPixel, sampleNum + 1));
   return Sampler::SetSampleNumber(sampleNum);
 }
 
+void PixelSampler::SeedPixel(const Point2i& p) {
+  rng.SetSequence(PixelSequence(p, 0));
+}
+
 Float PixelSampler::Get1D() {
   if (current1DDimension < samples1D.size()) {
     return samples1D[current1DDimension++][currentPixelSampleIndex];
@@ -85,7 +107,7 @@ Float PixelSampler::Get1D() {
 }
 
 Point2f PixelSampler::Get2D() {
-  if (current1DDimension < samples1D.size()) {
+  if (current2DDimension < samples2D.size()) {
     return samples2D[current2DDimension++][currentPixelSampleIndex];
   }
   else {
@@ -5,6 +5,7 @@
 #include "geometry.h"
 #include "rng.h"
 #include <memory>
+#include <vector>
 
 namespace pbrt {
 
@@ -12,6 +13,7 @@ class Sampler {
 public:
 
     Sampler(int64_t samplesPerPixel);
+    virtual ~Sampler() {}
     virtual std::unique_ptr<Sampler> Clone(int seed) = 0;
 
     virtual void StartPixel(const Point2i& p);
@@ -30,6 +32,11 @@ public:
     }
 
     virtual bool SetSampleNumber(int64_t sampleNum);
+    // Makes the samples of pixel p depend on p alone: after SeedPixel(p), the
+    // next StartPixel(p) regenerates the set of any earlier seeded visit, and
+    // SetSampleNumber(i) continues it from sample i. Renderers that come back
+    // to a pixel in later passes use it to keep extending one sample set.
+    virtual void SeedPixel(const Point2i& p) {}
 
     const Float* Get1DArray(int n);
     const Point2f* Get2DArray(int n);
@@ -59,6 +66,7 @@ public:
 
   virtual bool StartNextSample() override;
   virtual bool SetSampleNumber(int64_t sampleNum) override;
+  virtual void SeedPixel(const Point2i& p) override;
   virtual Float Get1D() override;
   virtual Point2f Get2D() override;
 
@@ -11,4 +11,13 @@ bool Scene::IntersectP(const Ray& ray) const {
     return aggregate->IntersectP(ray);
 }
 
+void Scene::IntersectStream(const Ray* rays, int nRays,
+                            SurfaceInteraction* isects, bool* hits) const {
+    aggregate->IntersectStream(rays, nRays, isects, hits);
+}
+
+void Scene::IntersectPStream(const Ray* rays, int nRays, bool* occluded) const {
+    aggregate->IntersectPStream(rays, nRays, occluded);
+}
+
 }
@@ -26,6 +26,21 @@ public:
     bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
     bool IntersectP(const Ray& ray) const;
 
+    // <batched queries; coherent rays (camera rays of a tile, shadow rays towards
+    //  one light) share traversal work in the aggregate>
+    void IntersectStream(const Ray* rays, int nRays,
+                         SurfaceInteraction* isects, bool* hits) const;
+    void IntersectPStream(const Ray* rays, int nRays, bool* occluded) const;
+    void Intersect4(const Ray rays[4], SurfaceInteraction isects[4], bool hits[4]) const {
+        IntersectStream(rays, 4, isects, hits);
+    }
+    void Intersect8(const Ray rays[8], SurfaceInteraction isects[8], bool hits[8]) const {
+        IntersectStream(rays, 8, isects, hits);
+    }
+    void Intersect16(const Ray rays[16], SurfaceInteraction isects[16], bool hits[16]) const {
+        IntersectStream(rays, 16, isects, hits);
+    }
+
     const Bounds3f& WorldBound() const { return worldBound; }
     // <scene public data>
     std::vector<std::shared_ptr<Light>> lights;
@@ -70,16 +70,22 @@ public:
     }
     return ret;
   }
+  CoefficientSpectrum& operator/=(Float a) {
+    for (int i = 0; i < nSpectrumSamples; ++i) {
+      c[i] /= a;
+    }
+    return *this;
+  }
   CoefficientSpectrum operator/(Float a) const {
     CoefficientSpectrum ret = *this;
-    for (int i = 0; i < nSpectralSamples; ++i) {
+    for (int i = 0; i < nSpectrumSamples; ++i) {
       ret.c[i] /= a;
     }
     return ret;
   }
   CoefficientSpectrum operator/(const CoefficientSpectrum& s) const {
     CoefficientSpectrum ret = *this;
-    for (int i = 0; i < nSpectralSamples; ++i) {
+    for (int i = 0; i < nSpectrumSamples; ++i) {
       ret.c[i] /= s.c[i];
     }
     return ret;
@@ -132,6 +138,14 @@ public:
     return ret;
   }
 
+  Float MaxComponentValue() const {
+    Float m = c[0];
+    for (int i = 1; i < nSpectrumSamples; ++i) {
+      m = std::max(m, c[i]);
+    }
+    return m;
+  }
+
   CoefficientSpectrum HasNaNs() const {
     for (int i = 0; i < nSpectrumSamples; ++i) {
       if (std::isnan(c[i])) {
@@ -182,6 +196,10 @@ public:
     xyz[2] = 0.019334f*c[0] + 0.119193f*c[1] + 0.950227f*c[2];
   }
 
+  Float y() const {
+    return 0.212671f*c[0] + 0.715160f*c[1] + 0.072169f*c[2];
+  }
+
   static RGBSpectrum FromXYZ(const Float xyz[3]) {
     RGBSpectrum s;
     s.c[0] =  3.240479f*xyz[0] - 1.537150f*xyz[1] - 0.498535f*xyz[2];
@@ -0,0 +1,60 @@
+#include "stats.h"
+#include "memory.h"
+
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace pbrt {
+
+// <stats local definitions>
+// Blocks are cache-line aligned so threads never write to the same line.
+static std::mutex statsMutex;
+static std::vector<ThreadStats*> threadStats;
+
+ThreadStats* RegisterThreadStats() {
+  ThreadStats *stats = AllocAligned<ThreadStats>(1);
+  std::memset(stats, 0, sizeof(ThreadStats));
+  std::lock_guard<std::mutex> lock(statsMutex);
+  threadStats.push_back(stats);
+  return stats;
+}
+
+int64_t StatTotal(Stat stat) {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  int64_t total = 0;
+  for (const ThreadStats *stats : threadStats) {
+    total += stats->counts[(int)stat];
+  }
+  return total;
+}
+
+void ClearStats() {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  for (ThreadStats *stats : threadStats) {
+    std::memset(stats, 0, sizeof(ThreadStats));
+  }
+}
+
+// <print a ray count with its nodes visited and primitives tested per ray>
+static void PrintRayStats(FILE* dest, const char* title, Stat rays, Stat nodes, Stat prims) {
+  int64_t nRays = StatTotal(rays);
+  std::fprintf(dest, "    %-30s %14lld\n", title, (long long)nRays);
+  if (nRays > 0) {
+    std::fprintf(dest, "      %-28s %14.2f\n", "Nodes visited per ray",
+        StatTotal(nodes)/(double)nRays);
+    std::fprintf(dest, "      %-28s %14.2f\n", "Primitives tested per ray",
+        StatTotal(prims)/(double)nRays);
+  }
+}
+
+void PrintStats(FILE* dest) {
+  std::fprintf(dest, "Statistics:\n");
+  std::fprintf(dest, "  BVH traversal\n");
+  PrintRayStats(dest, "Closest-hit rays", Stat::BVHRays,
+      Stat::BVHNodesVisited, Stat::BVHPrimitivesTested);
+  PrintRayStats(dest, "Shadow rays", Stat::BVHShadowRays,
+      Stat::BVHShadowNodesVisited, Stat::BVHShadowPrimitivesTested);
+}
+
+} // namespace pbrt
@@ -0,0 +1,42 @@
+#ifndef CORE_STATS_H
+#define CORE_STATS_H
+
+#include "pbrt.h"
+#include <cstdio>
+
+namespace pbrt {
+
+// Render-time counters. Every thread counts into a block of its own, so
+// counting takes no atomics or locks; a thread's block is registered the first
+// time it counts and outlives the thread. The blocks of all threads are merged
+// when the counters are read, which is only exact while no thread is counting.
+enum class Stat {
+  BVHRays, BVHNodesVisited, BVHPrimitivesTested,
+  BVHShadowRays, BVHShadowNodesVisited, BVHShadowPrimitivesTested,
+  Count
+};
+
+struct ThreadStats {
+  int64_t counts[(int)Stat::Count];
+};
+
+ThreadStats* RegisterThreadStats();
+
+inline ThreadStats& CurrentThreadStats() {
+  static thread_local ThreadStats *stats = RegisterThreadStats();
+  return *stats;
+}
+
+inline void AddStat(Stat stat, int64_t n) {
+  CurrentThreadStats().counts[(int)stat] += n;
+}
+
+// Sum of a counter over all threads.
+int64_t StatTotal(Stat stat);
+void ClearStats();
+// Prints the merged counters and the per-ray averages derived from them.
+void PrintStats(FILE* dest);
+
+} // namespace pbrt
+
+#endif // CORE_STATS_H
@@ -230,19 +230,10 @@ Transform Perspective(Float fov, Float zNear, Float zFar) {
 }
 Bounds3f Transform::operator()(const Bounds3f& b) const {
   const Transform &M = *this;
-  Point3f p0 = M(Point3f(b.pMin.x, b.pMin.y, b.pMin.z));
-  Vector3f vx = M(Point3f(b.pMax.x, b.pMin.y, b.pMin.z)-p0);
-  Vector3f vy = M(Point3f(b.pMin.x, b.pMax.y, b.pMin.z)-p0);
-  Vector3f vz = M(Point3f(b.pMin.x, b.pMin.y, b.pMax.z)-p0);
-
-  Bounds3f ret(p0);
-  ret = Union(ret, p0+vx);
-  ret = Union(ret, p0+vy);
-  ret = Union(ret, p0+vz);
-  ret = Union(ret, p0+vy+vz);
-  ret = Union(ret, p0+vx+vy);
-  ret = Union(ret, p0+vx+vz);
-  ret = Union(ret, p0+vx+vy+vz);
+  Bounds3f ret(M(b.Corner(0)));
+  for (int corner = 1; corner < 8; ++corner) {
+    ret = Union(ret, M(b.Corner(corner)));
+  }
   return ret;
 }
 
@@ -281,7 +272,7 @@ SurfaceInteraction Transform::operator()(const SurfaceInteraction& si) const {
 //  ret.dpdy = t(si.dpdy); // TODO
 //  ret.bsdf = si.bsdf; // TODO
 //  ret.bssrdf = si.bssrdf; // TODO
-//  ret.primitive = si.primitive; // TODO
+  ret.primitive = si.primitive;
   //    ret.n = Faceforward(ret.n, ret.shading.n); // was commented...
   ret.shading.n = Faceforward(ret.shading.n, ret.n);
 
@@ -332,7 +323,7 @@ void AnimatedTransform::Decompose(const Matrix4x4& m, Vector3f* T,
 
   // <extract rotation R from transformation matrix>
   Float norm;
-  int count;
+  int count = 0;
   Matrix4x4 R = M;
   do {
     // <compute next matrix Rnext in series>
@@ -394,10 +385,20 @@ void AnimatedTransform::Interpolate(Float time, Transform* t) const {
 }
 
 Ray AnimatedTransform::operator()(const Ray& r) const {
-
+  if (!actuallyAnimated || r.time <= startTime) {
+    return (*startTransform)(r);
+  }
+  else if (r.time >= endTime) {
+    return (*endTransform)(r);
+  }
+  else {
+    Transform t;
+    Interpolate(r.time, &t);
+    return t(r);
+  }
 }
 RayDifferential AnimatedTransform::operator()(RayDifferential& r) const {
-  if (actuallyAnimated || r.time <= startTime) {
+  if (!actuallyAnimated || r.time <= startTime) {
     return (*startTransform)(r);
   }
   else if (r.time > endTime) {
@@ -424,11 +425,78 @@ Bounds3f AnimatedTransform::MotionBounds(const Bounds3f& b) const {
     return Union((*startTransform)(b),(*endTransform)(b));
   }
   // <return motion bounds accounting for animated rotation>
-  Bounds3f bounds;
-  for (int corner = 0; corner < 8; ++corner) {
-    // TODO 110 bounds = Union(bounds, BoundPointMotion(b.Corner(corner)));
+  // Every point stays within the linear interpolation of the knot bounds,
+  // which in turn stays within their union.
+  constexpr int nSegments = 8;
+  Bounds3f knots[nSegments + 1], bounds;
+  LinearMotionBounds(b, startTime, endTime, nSegments, knots);
+  for (const Bounds3f& knot : knots) {
+    bounds = Union(bounds, knot);
   }
   return bounds;
 }
 
+// Bounds the motion of b piecewise linearly. Translation and scale are
+// interpolated linearly in time, so under them alone every corner of b moves
+// on a straight line and the interpolated knot bounds contain it; the points
+// of b stay within the corners' convex hull. Rotation at a constant angular
+// velocity theta moves a point q = R S x off its straight line by at most
+// h^2/8 max |q''| over an interval of length h, with
+// |q''| <= theta^2 |S x| + 2 theta |S' x|, so the knots are padded by that.
+void AnimatedTransform::LinearMotionBounds(const Bounds3f& b, Float time0, Float time1,
+    int nSegments, Bounds3f* bounds) const {
+
+  Transform t;
+  for (int i = 0; i <= nSegments; ++i) {
+    Interpolate(Lerp(Float(i)/nSegments, time0, time1), &t);
+    bounds[i] = t(b);
+  }
+  if (!actuallyAnimated) {
+    return;
+  }
+
+  // <cover segments where the animation starts or stops>
+  // Motion is only linear on either side of startTime and endTime, so a
+  // segment containing one is bounded by its ends and the bounds there.
+  for (int i = 0; i < nSegments; ++i) {
+    Float t0 = Lerp(Float(i)/nSegments, time0, time1);
+    Float t1 = Lerp(Float(i + 1)/nSegments, time0, time1);
+    Bounds3f segment = Union(bounds[i], bounds[i + 1]);
+    bool kinked = false;
+    for (Float time : {startTime, endTime}) {
+      if (t0 < time && time < t1) {
+        Interpolate(time, &t);
+        segment = Union(segment, t(b));
+        kinked = true;
+      }
+    }
+    if (kinked) {
+      bounds[i] = Union(bounds[i], segment);
+      bounds[i + 1] = Union(bounds[i + 1], segment);
+    }
+  }
+
+  // <pad the knots for points rotating off their straight paths>
+  if (hasRotation) {
+    auto apply = [](const Matrix4x4& m, const Point3f& p) {
+      return Vector3f(m.m[0][0]*p.x + m.m[0][1]*p.y + m.m[0][2]*p.z,
+                      m.m[1][0]*p.x + m.m[1][1]*p.y + m.m[1][2]*p.z,
+                      m.m[2][0]*p.x + m.m[2][1]*p.y + m.m[2][2]*p.z);
+    };
+    Float radius = 0, scaleRate = 0;
+    for (int corner = 0; corner < 8; ++corner) {
+      Point3f p = b.Corner(corner);
+      Vector3f s0 = apply(S[0], p), s1 = apply(S[1], p);
+      radius = std::max(radius, std::max(s0.Length(), s1.Length()));
+      scaleRate = std::max(scaleRate, (s1 - s0).Length());
+    }
+    Float theta = 2*std::acos(Clamp(Dot(R[0], R[1]), -1, 1));
+    Float h = std::min<Float>(1, (time1 - time0)/(nSegments*(endTime - startTime)));
+    Float pad = h*h/8*(theta*theta*radius + 2*theta*scaleRate);
+    for (int i = 0; i <= nSegments; ++i) {
+      bounds[i] = Expand(bounds[i], pad);
+    }
+  }
+}
+
 } /* namespace pbrt */
@@ -11,7 +11,7 @@ struct Matrix4x4 {
   Matrix4x4() {
     m[0][0] = m[1][1] = m[2][2] = m[3][3] = 1.f;
     m[0][1] = m[0][2] = m[0][3] =
-        m[1][0] = m[1][2] = m[1][2] =
+        m[1][0] = m[1][2] = m[1][3] =
             m[2][0] = m[2][1] = m[2][3] =
                 m[3][0] = m[3][1] = m[3][2] = 0.f;
   }
@@ -28,7 +28,7 @@ struct Matrix4x4 {
     Matrix4x4 r;
     for (int i = 0; i < 4; ++i)
       for (int j = 0; j < 4; ++j)
-        r.m[i][j] += m1.m[i][0]*m2.m[0][j] +
+        r.m[i][j] = m1.m[i][0]*m2.m[0][j] +
         m1.m[i][1]*m2.m[1][j] +
         m1.m[i][2]*m2.m[2][j] +
         m1.m[i][3]*m2.m[3][j];
@@ -316,10 +316,15 @@ public:
     Point3f operator()(Float time, const Point3f& p) const;
     Vector3f operator()(Float time, const Vector3f& v) const;
     Bounds3f MotionBounds(const Bounds3f& b) const;
+    // Bounds of b at nSegments + 1 evenly spaced times from time0 to time1,
+    // padded so that interpolating consecutive ones linearly bounds b at every
+    // time between them.
+    void LinearMotionBounds(const Bounds3f& b, Float time0, Float time1, int nSegments,
+        Bounds3f* bounds) const;
 private:
   const Transform *startTransform, *endTransform;
-  const Float startTime, endTime;
-  const bool actuallyAnimated;
+  Float startTime, endTime;
+  bool actuallyAnimated;
 
   Vector3f T[2];
   Quaternion R[2];
@@ -2,14 +2,41 @@
 
 namespace pbrt {
 
+void DirectLightingIntegrator::Preprocess(const Scene& scene, Sampler& sampler) {
+
+  if (strategy == LightStrategy::UniformSampleAll) {
+    // Compute number of samples to use for each light
+    nLightSamples.clear();
+    for (const auto &light : scene.lights) {
+      nLightSamples.push_back(sampler.RoundCount(light->nSamples));
+    }
+
+    // Request sample arrays for every light at each depth Li can recurse to
+    for (int i = 0; i < maxDepth; ++i) {
+      for (int n : nLightSamples) {
+        sampler.Request2DArray(n);
+      }
+    }
+  }
+}
+
 Spectrum DirectLightingIntegrator::Li(const RayDifferential& ray, const Scene& scene,
     Sampler& sampler, MemoryArena& arena, int depth) const {
 
+  // Find closest ray intersection
+  SurfaceInteraction isect;
+  bool hit = scene.Intersect(ray, &isect);
+  return LiIntersected(ray, hit, isect, scene, sampler, arena, depth);
+}
+
+Spectrum DirectLightingIntegrator::LiIntersected(const RayDifferential& ray, bool hit,
+    SurfaceInteraction& isect, const Scene& scene, Sampler& sampler, MemoryArena& arena,
+    int depth) const {
+
   Spectrum L(0.f);
 
-  // Find closest ray intersection or return background radiance
-  SurfaceInteraction isect;
-  if (!scene.Intersect(ray, &isect)) {
+  // Return background radiance if the ray escaped
+  if (!hit) {
     for (const auto &light : scene.lights) {
       L += light->Le(ray);
     }
@@ -28,7 +55,7 @@ Spectrum DirectLightingIntegrator::Li(const RayDifferential& ray, const Scene& s
 
   if (scene.lights.size() > 0) {
     if (strategy == LightStrategy::UniformSampleAll) {
-      // TODO L += UniformSampleAllLights(isect, scene, arena, sampler, nLightSamples);
+      L += UniformSampleAllLights(isect, scene, arena, sampler, nLightSamples);
     }
     else {
       L += UniformSampleOneLight(isect, scene, arena, sampler);
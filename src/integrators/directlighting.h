@@ -21,8 +21,13 @@ namespace pbrt {
       : SamplerIntegrator(camera, sampler, pixelBounds),
       strategy(strategy), maxDepth(maxDepth) {}
     
+    virtual void Preprocess(const Scene& scene, Sampler& sampler) override;
     virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
 			Sampler& sampler, MemoryArena& arena, int depth = 0) const override;
+    virtual Spectrum LiIntersected(const RayDifferential& ray, bool hit,
+                                   SurfaceInteraction& isect, const Scene& scene,
+                                   Sampler& sampler, MemoryArena& arena,
+                                   int depth = 0) const override;
 
   private:
     const LightStrategy strategy;
@@ -0,0 +1,82 @@
+#include "path.h"
+#include "reflection.h"
+
+namespace pbrt {
+
+Spectrum PathIntegrator::Li(const RayDifferential& ray, const Scene& scene,
+    Sampler& sampler, MemoryArena& arena, int depth) const {
+
+  // Find closest ray intersection
+  SurfaceInteraction isect;
+  bool hit = scene.Intersect(ray, &isect);
+  return LiIntersected(ray, hit, isect, scene, sampler, arena, depth);
+}
+
+Spectrum PathIntegrator::LiIntersected(const RayDifferential& r, bool hit,
+    SurfaceInteraction& isect, const Scene& scene, Sampler& sampler,
+    MemoryArena& arena, int depth) const {
+
+  Spectrum L(0.f), beta(1.f);
+  RayDifferential ray(r);
+  bool specularBounce = false;
+
+  for (int bounces = depth; ; ++bounces) {
+    // <add emission at path vertex when it cannot be sampled directly>
+    if (bounces == depth || specularBounce) {
+      if (hit) {
+        L += beta*isect.Le(-ray.d);
+      }
+      else {
+        for (const auto &light : scene.lights) {
+          L += beta*light->Le(ray);
+        }
+      }
+    }
+
+    // <terminate path if ray escaped or maxDepth was reached>
+    if (!hit || bounces >= maxDepth) {
+      break;
+    }
+
+    // <compute scattering functions and skip over medium boundaries>
+    isect.ComputeScatteringFunctions(ray, arena, true);
+    if (!isect.bsdf) {
+      ray = isect.SpawnRay(ray.d);
+      hit = scene.Intersect(ray, &isect);
+      --bounces;
+      continue;
+    }
+
+    // <sample illumination from lights to find path contribution>
+    if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0) {
+      L += beta*UniformSampleOneLight(isect, scene, arena, sampler);
+    }
+
+    // <sample BSDF to get new path direction>
+    Vector3f wo = -ray.d, wi;
+    Float pdf;
+    BxDFType flags;
+    Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf, BSDF_ALL, &flags);
+    if (f.IsBlack() || pdf == 0) {
+      break;
+    }
+    beta *= f*AbsDot(wi, isect.shading.n)/pdf;
+    specularBounce = (flags & BSDF_SPECULAR) != 0;
+    ray = isect.SpawnRay(wi);
+
+    // <possibly terminate the path with Russian roulette>
+    if (beta.MaxComponentValue() < rrThreshold && bounces - depth > rrMinDepth) {
+      Float q = std::max((Float).05, 1 - beta.MaxComponentValue());
+      if (sampler.Get1D() < q) {
+        break;
+      }
+      beta /= 1 - q;
+    }
+
+    // <find next path vertex>
+    hit = scene.Intersect(ray, &isect);
+  }
+  return L;
+}
+
+} // namespace pbrt
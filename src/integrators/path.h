@@ -0,0 +1,43 @@
+#ifndef INTEGRATORS_PATH_H
+#define INTEGRATORS_PATH_H
+
+#include "pbrt.h"
+#include "integrator.h"
+#include "scene.h"
+
+#include <memory>
+
+namespace pbrt {
+
+  // Unidirectional path tracer. Li follows the path in a loop that carries the
+  // path throughput beta from bounce to bounce, so the stack stays flat however
+  // large maxDepth is. After rrMinDepth bounces, paths whose throughput has
+  // dropped below rrThreshold are ended with Russian roulette, and survivors
+  // are reweighted so the estimate stays unbiased. All BSDFs of a sample come
+  // from the arena that Render resets after each sample.
+  class PathIntegrator : public SamplerIntegrator {
+
+  public:
+    PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+                   std::shared_ptr<Sampler> sampler,
+                   const Bounds2i& pixelBounds,
+                   Float rrThreshold = 1, int rrMinDepth = 3)
+      : SamplerIntegrator(camera, sampler, pixelBounds),
+      maxDepth(maxDepth), rrThreshold(rrThreshold), rrMinDepth(rrMinDepth) {}
+
+    virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
+                        Sampler& sampler, MemoryArena& arena, int depth = 0) const override;
+    virtual Spectrum LiIntersected(const RayDifferential& ray, bool hit,
+                                   SurfaceInteraction& isect, const Scene& scene,
+                                   Sampler& sampler, MemoryArena& arena,
+                                   int depth = 0) const override;
+
+  private:
+    const int maxDepth;
+    const Float rrThreshold;
+    const int rrMinDepth;
+  };
+
+} // namespace pbrt
+
+#endif//INTEGRATORS_PATH_H
@@ -0,0 +1,299 @@
+#include "wavefront.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "light.h"
+#include "memory.h"
+#include "parallel.h"
+#include "reflection.h"
+#include "rng.h"
+#include "sampler.h"
+#include "spectrum.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace pbrt {
+
+// <wave sizing>
+// A wave holds as many whole tiles as fit in maxWavePaths camera samples, and
+// at least one. Kernels hand out queue entries in chunks of streamSize, which
+// is also the number of rays given to one stream query.
+static constexpr int waveTileSize = 16;
+static constexpr int maxWavePaths = 64*1024;
+static constexpr int streamSize = 64;
+
+// <state of the paths of a wave, one entry per camera sample>
+struct PathStates {
+  void Resize(int n) {
+    pFilm.resize(n);
+    cameraWeight.resize(n);
+    time.resize(n);
+    L.resize(n);
+    beta.resize(n);
+    rng.resize(n);
+    depth.resize(n);
+    specularBounce.resize(n);
+  }
+
+  std::vector<Point2f> pFilm;
+  std::vector<Float> cameraWeight, time;
+  std::vector<Spectrum> L, beta;
+  std::vector<RNG> rng;
+  std::vector<int> depth;
+  std::vector<uint8_t> specularBounce;
+};
+
+// <rays to trace, each continuing path[i]; entries are claimed with size++>
+struct RayQueue {
+  void Resize(int n) {
+    o.resize(n);
+    d.resize(n);
+    path.resize(n);
+    size = 0;
+  }
+  void Push(int p, const Ray& ray) {
+    int i = size++;
+    o[i] = ray.o;
+    d[i] = ray.d;
+    path[i] = p;
+  }
+
+  std::vector<Point3f> o;
+  std::vector<Vector3f> d;
+  std::vector<int> path;
+  std::atomic<int> size{0};
+};
+
+// <shadow rays towards sampled lights and the light each one carries if unoccluded>
+struct ShadowQueue {
+  void Resize(int n) {
+    o.resize(n);
+    d.resize(n);
+    Ld.resize(n);
+    path.resize(n);
+    size = 0;
+  }
+  void Push(int p, const Ray& ray, const Spectrum& L) {
+    int i = size++;
+    o[i] = ray.o;
+    d[i] = ray.d;
+    Ld[i] = L;
+    path[i] = p;
+  }
+
+  std::vector<Point3f> o;
+  std::vector<Vector3f> d;
+  std::vector<Spectrum> Ld;
+  std::vector<int> path;
+  std::atomic<int> size{0};
+};
+
+void WavefrontIntegrator::Render(const Scene& scene) {
+
+  // <split the image into tiles and the tiles into waves>
+  Film *film = camera->film;
+  Bounds2i sampleBounds = film->GetSampleBounds();
+  Vector2i sampleExtent(sampleBounds.Diagonal());
+  Point2i nTiles((sampleExtent.x + waveTileSize - 1)/waveTileSize,
+                 (sampleExtent.y + waveTileSize - 1)/waveTileSize);
+  int nTilesTotal = nTiles.x*nTiles.y;
+  int64_t maxTilePaths = (int64_t)waveTileSize*waveTileSize*sampler->samplesPerPixel;
+  int tilesPerWave = (int)std::max<int64_t>(1, maxWavePaths/maxTilePaths);
+  auto tileBounds = [&](int tileIndex) {
+    int x0 = sampleBounds.pMin.x + (tileIndex % nTiles.x)*waveTileSize;
+    int y0 = sampleBounds.pMin.y + (tileIndex / nTiles.x)*waveTileSize;
+    return Bounds2i(Point2i(x0, y0), Point2i(std::min(x0 + waveTileSize, sampleBounds.pMax.x),
+                                             std::min(y0 + waveTileSize, sampleBounds.pMax.y)));
+  };
+
+  // <allocate the wave's path states and queues>
+  int maxPaths = (int)std::min<int64_t>(nTilesTotal, tilesPerWave)*maxTilePaths;
+  PathStates paths;
+  paths.Resize(maxPaths);
+  RayQueue rayQueues[2];
+  rayQueues[0].Resize(maxPaths);
+  rayQueues[1].Resize(maxPaths);
+  ShadowQueue shadows;
+  shadows.Resize(maxPaths);
+  std::vector<SurfaceInteraction> isects(maxPaths);
+  std::unique_ptr<bool[]> hits(new bool[maxPaths]);
+  // BSDFs must outlive the shade kernel until the bounce is over, so every
+  // thread allocates from an arena of its own, reset after each bounce.
+  std::vector<std::unique_ptr<MemoryArena>> threadArenas;
+  for (int i = 0; i < MaxThreadIndex(); ++i) {
+    threadArenas.push_back(std::unique_ptr<MemoryArena>(new MemoryArena));
+  }
+  int nLights = scene.lights.size();
+
+  for (int firstTile = 0; firstTile < nTilesTotal; firstTile += tilesPerWave) {
+    int nWaveTiles = std::min(tilesPerWave, nTilesTotal - firstTile);
+    std::vector<int> tilePathStart(nWaveTiles + 1, 0);
+    for (int t = 0; t < nWaveTiles; ++t) {
+      tilePathStart[t + 1] = tilePathStart[t] +
+          tileBounds(firstTile + t).Area()*sampler->samplesPerPixel;
+    }
+    int nPaths = tilePathStart[nWaveTiles];
+
+    // <generate camera rays for the wave's tiles, in sample order>
+    RayQueue *rays = &rayQueues[0], *nextRays = &rayQueues[1];
+    ParallelFor([&](int64_t t) {
+      int tileIndex = firstTile + t;
+      std::unique_ptr<Sampler> tileSampler = sampler->Clone(tileIndex);
+      int p = tilePathStart[t];
+      for (Point2i pixel : tileBounds(tileIndex)) {
+        tileSampler->StartPixel(pixel);
+        do {
+          CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
+          RayDifferential ray;
+          Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+          paths.pFilm[p] = cameraSample.pFilm;
+          paths.cameraWeight[p] = rayWeight;
+          paths.time[p] = ray.time;
+          paths.L[p] = Spectrum(0.f);
+          paths.beta[p] = Spectrum(1.f);
+          paths.rng[p].SetSequence((uint64_t)tileIndex*maxTilePaths + (p - tilePathStart[t]));
+          paths.depth[p] = 0;
+          paths.specularBounce[p] = false;
+          // <camera rays take the queue entry of their path; -1 marks no ray>
+          rays->o[p] = ray.o;
+          rays->d[p] = ray.d;
+          rays->path[p] = rayWeight > 0 ? p : -1;
+          ++p;
+        } while (tileSampler->StartNextSample());
+      }
+    }, nWaveTiles);
+    rays->size = nPaths;
+
+    while (rays->size > 0) {
+      int nRays = rays->size;
+
+      // <intersect kernel: trace the ray queue in streams>
+      ParallelFor([&](int64_t chunk) {
+        int start = chunk*streamSize, n = std::min(streamSize, nRays - start);
+        Ray streamRays[streamSize];
+        for (int i = 0; i < n; ++i) {
+          int p = rays->path[start + i];
+          // a dead entry still takes part, as a ray too short to hit anything
+          streamRays[i] = Ray(rays->o[start + i], rays->d[start + i],
+                              p >= 0 ? Infinity : 0, p >= 0 ? paths.time[p] : 0);
+        }
+        scene.IntersectStream(streamRays, n, &isects[start], &hits[start]);
+      }, (nRays + streamSize - 1)/streamSize);
+
+      // <shade kernel: materials, light sampling and the paths' next rays>
+      nextRays->size = 0;
+      shadows.size = 0;
+      ParallelFor([&](int64_t chunk) {
+        MemoryArena &arena = *threadArenas[ThreadIndex];
+        int start = chunk*streamSize, end = std::min(start + streamSize, nRays);
+        for (int i = start; i < end; ++i) {
+          int p = rays->path[i];
+          if (p < 0) {
+            continue;
+          }
+          RayDifferential ray(rays->o[i], rays->d[i], Infinity, paths.time[p]);
+          Spectrum &beta = paths.beta[p];
+          bool addEmitted = paths.depth[p] == 0 || paths.specularBounce[p];
+          if (!hits[i]) {
+            // <add the light of infinite lights to escaped paths>
+            if (addEmitted) {
+              for (const auto &light : scene.lights) {
+                paths.L[p] += beta*light->Le(ray);
+              }
+            }
+            continue;
+          }
+
+          SurfaceInteraction &isect = isects[i];
+          isect.ComputeScatteringFunctions(ray, arena, true);
+          if (!isect.bsdf) {
+            // <continue through surfaces without a material, on the same bounce>
+            nextRays->Push(p, isect.SpawnRay(ray.d));
+            continue;
+          }
+          Vector3f wo = isect.wo;
+          if (addEmitted) {
+            paths.L[p] += beta*isect.Le(wo);
+          }
+          if (paths.depth[p] >= maxDepth) {
+            continue;
+          }
+          RNG &rng = paths.rng[p];
+
+          // <sample one light and queue its shadow ray>
+          if (nLights > 0) {
+            int lightNum = std::min((int)(rng.UniformFloat()*nLights), nLights - 1);
+            Point2f uLight(rng.UniformFloat(), rng.UniformFloat());
+            Vector3f wi;
+            Float lightPdf = 0;
+            VisibilityTester visibility;
+            Spectrum Li = scene.lights[lightNum]->Sample_Li(isect, uLight, &wi,
+                                                            &lightPdf, &visibility);
+            if (lightPdf > 0 && !Li.IsBlack()) {
+              Spectrum f = isect.bsdf->f(wo, wi)*AbsDot(wi, isect.shading.n);
+              if (!f.IsBlack()) {
+                shadows.Push(p, visibility.P0().SpawnRayTo(visibility.P1()),
+                             beta*f*Li*(Float)nLights/lightPdf);
+              }
+            }
+          }
+
+          // <sample the BSDF for the path's next ray>
+          Point2f uBSDF(rng.UniformFloat(), rng.UniformFloat());
+          Vector3f wi;
+          Float pdf;
+          BxDFType flags;
+          Spectrum f = isect.bsdf->Sample_f(wo, &wi, uBSDF, &pdf, BSDF_ALL, &flags);
+          if (f.IsBlack() || pdf == 0) {
+            continue;
+          }
+          beta *= f*AbsDot(wi, isect.shading.n)/pdf;
+          paths.specularBounce[p] = (flags & BSDF_SPECULAR) != 0;
+          ++paths.depth[p];
+          nextRays->Push(p, isect.SpawnRay(wi));
+        }
+      }, (nRays + streamSize - 1)/streamSize);
+
+      // <shadow kernel: trace the shadow rays and add the light they carry>
+      int nShadows = shadows.size;
+      ParallelFor([&](int64_t chunk) {
+        int start = chunk*streamSize, n = std::min(streamSize, nShadows - start);
+        Ray streamRays[streamSize];
+        bool occluded[streamSize];
+        for (int i = 0; i < n; ++i) {
+          streamRays[i] = Ray(shadows.o[start + i], shadows.d[start + i], 1 - ShadowEpsilon,
+                              paths.time[shadows.path[start + i]]);
+        }
+        scene.IntersectPStream(streamRays, n, occluded);
+        for (int i = 0; i < n; ++i) {
+          if (!occluded[i]) {
+            paths.L[shadows.path[start + i]] += shadows.Ld[start + i];
+          }
+        }
+      }, (nShadows + streamSize - 1)/streamSize);
+
+      // <free the bounce's BSDFs; the next rays become the ray queue>
+      for (const std::unique_ptr<MemoryArena> &arena : threadArenas) {
+        arena->Reset();
+      }
+      std::swap(rays, nextRays);
+    }
+
+    // <add the wave's samples to the film, one FilmTile per tile>
+    ParallelFor([&](int64_t t) {
+      std::unique_ptr<FilmTile> filmTile = film->GetFilmTile(tileBounds(firstTile + t));
+      for (int p = tilePathStart[t]; p < tilePathStart[t + 1]; ++p) {
+        filmTile->AddSample(paths.pFilm[p], paths.cameraWeight[p] > 0 ? paths.L[p] : Spectrum(0.f),
+                            paths.cameraWeight[p]);
+      }
+      film->MergeFilmTile(std::move(filmTile));
+    }, nWaveTiles);
+  }
+
+  // <save final image after rendering>
+  film->WriteImage();
+}
+
+} // namespace pbrt
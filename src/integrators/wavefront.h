@@ -0,0 +1,45 @@
+#ifndef INTEGRATORS_WAVEFRONT_H
+#define INTEGRATORS_WAVEFRONT_H
+
+#include "pbrt.h"
+#include "integrator.h"
+#include "scene.h"
+
+#include <memory>
+
+namespace pbrt {
+
+  // Path tracer that advances many paths together, one bounce at a time,
+  // instead of recursing through Li for each sample. The image is rendered in
+  // waves of whole tiles. For every bounce of a wave, the rays of the live
+  // paths sit in one queue, and separate parallel kernels run over the queues:
+  //   intersect: traces the ray queue in streams with Scene::IntersectStream;
+  //   shade: evaluates the materials at the hits, samples one light per path
+  //     into the shadow-ray queue and the BSDF into the next bounce's ray queue;
+  //   shadow: traces the shadow-ray queue with Scene::IntersectPStream and adds
+  //     the light that arrives to the paths.
+  // Queues are structures of arrays whose entries point back to their path.
+  // Camera samples come from the sampler; the later dimensions of a path come
+  // from a random number stream of its own, since the paths of a wave no longer
+  // consume one sampler in order.
+  class WavefrontIntegrator : public Integrator {
+
+  public:
+    WavefrontIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+                        std::shared_ptr<Sampler> sampler,
+                        const Bounds2i& pixelBounds)
+      : maxDepth(maxDepth), camera(camera), sampler(sampler),
+      pixelBounds(pixelBounds) {}
+
+    virtual void Render(const Scene& scene) override;
+
+  private:
+    const int maxDepth;
+    std::shared_ptr<const Camera> camera;
+    std::shared_ptr<Sampler> sampler;
+    const Bounds2i pixelBounds;
+  };
+
+} // namespace pbrt
+
+#endif//INTEGRATORS_WAVEFRONT_H
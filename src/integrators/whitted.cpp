@@ -8,10 +8,20 @@ namespace pbrt {
 				 Sampler& sampler, MemoryArena& arena,
 				 int depth) const {
 
-    Spectrum L(0.0f);
-    // <find closest ray intersection or return background radiance>
+    // <find closest ray intersection>
     SurfaceInteraction isect;
-    if (!scene.Intersect(ray, &isect)) {
+    bool hit = scene.Intersect(ray, &isect);
+    return LiIntersected(ray, hit, isect, scene, sampler, arena, depth);
+  }
+
+  Spectrum WhittedIntegrator::LiIntersected(const RayDifferential& ray, bool hit,
+					    SurfaceInteraction& isect, const Scene& scene,
+					    Sampler& sampler, MemoryArena& arena,
+					    int depth) const {
+
+    Spectrum L(0.0f);
+    // <return background radiance if the ray escaped>
+    if (!hit) {
       for (const auto &light : scene.lights) {
 	L += light->Le(ray);
       }
@@ -15,6 +15,9 @@ public:
 					  std::shared_ptr<Sampler> sampler);
 	virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
 	                        Sampler& sampler, MemoryArena& arena, int depth = 0) const;
+	virtual Spectrum LiIntersected(const RayDifferential& ray, bool hit,
+	                               SurfaceInteraction& isect, const Scene& scene,
+	                               Sampler& sampler, MemoryArena& arena, int depth = 0) const;
 private:
 	const int maxDepth;
 };
@@ -0,0 +1,473 @@
+// bvhbench: builds a BVHAccel over a triangle mesh for every node layout and
+// reports node memory and ray throughput, so layout changes can be compared
+// on the same geometry. Every layout is built with SAH, SBVH at its default
+// duplication budget, HLBVH, and HLBVH followed by three treelet restructuring
+// passes (trbvh), and a KdTreeAccel is built over the same triangles for
+// comparison. Intersect is timed with rays entering the scene from
+// outside, IntersectP with shadow segments between points inside it; each
+// BVH's SAH cost and overlap are reported with the nodes visited and the
+// primitives tested per ray.
+//
+//   bvhbench [mesh.ply] [grid] [nRays] [cacheDir]
+//
+// The mesh (ASCII PLY with triangle faces, default scenes/geometry/sphere.ply)
+// is replicated grid^3 times to get a scene large enough to be interesting.
+// With a cacheDir, the binary BVH is also built through the BVH cache twice,
+// so the second build shows the time to load it instead.
+// Refit is timed after deforming the copies, against building from scratch,
+// and a quantized SBVH is rebuilt through Refit to check its reference count.
+// The same copies are then built as instances of one shared bottom-level BVH
+// under a top-level BVH, and timed again along with a refit after moving them.
+// Finally the instances move and turn over the shutter, by up to their own size
+// and then by several times it, and rays at random times are traced with
+// whole-shutter bounds and with 4 motion segments. Both report the top-level
+// nodes visited and instance tests per ray, and are checked twice against brute
+// force over the instances on the first 10000 rays.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pbrt.h"
+#include "parallel.h"
+#include "transform.h"
+#include "primitive.h"
+#include "interaction.h"
+#include "api.h"
+#include "stats.h"
+#include "../shapes/triangle.h"
+#include "../accelerators/bvh.h"
+#include "../accelerators/kdtreeaccel.h"
+
+using namespace pbrt;
+
+// <read vertex positions and triangle indices from an ASCII PLY file>
+static bool ReadPly(const std::string& filename, std::vector<Point3f>& P,
+    std::vector<int>& indices) {
+  std::ifstream in(filename);
+  if (!in) return false;
+  std::string line;
+  int nVertices = 0, nFaces = 0;
+  while (std::getline(in, line)) {
+    std::istringstream ls(line);
+    std::string token, element;
+    ls >> token;
+    if (token == "element") {
+      ls >> element;
+      if (element == "vertex") ls >> nVertices;
+      else if (element == "face") ls >> nFaces;
+    }
+    else if (token == "format") {
+      ls >> token;
+      if (token != "ascii") return false;
+    }
+    else if (token == "end_header")
+      break;
+  }
+  for (int i = 0; i < nVertices; ++i) {
+    Float x, y, z;
+    in >> x >> y >> z;
+    std::getline(in, line); // skip any further vertex properties
+    P.push_back(Point3f(x, y, z));
+  }
+  for (int i = 0; i < nFaces; ++i) {
+    int n;
+    in >> n;
+    std::vector<int> face(n);
+    for (int j = 0; j < n; ++j) in >> face[j];
+    // <triangulate polygons as fans>
+    for (int j = 2; j < n; ++j) {
+      indices.push_back(face[0]);
+      indices.push_back(face[j-1]);
+      indices.push_back(face[j]);
+    }
+  }
+  return (bool)in;
+}
+
+static const char* LayoutName(BVHAccel::NodeLayout layout) {
+  switch (layout) {
+  case BVHAccel::NodeLayout::Binary: return "binary";
+  case BVHAccel::NodeLayout::Wide4: return "wide4";
+  case BVHAccel::NodeLayout::Quantized: return "quantized";
+  case BVHAccel::NodeLayout::Stackless: return "stackless";
+  }
+  return "?";
+}
+
+// <an instance that counts how often the top level tests it, and the bottom-level
+//  nodes those tests visit, so the top-level nodes per ray can be told apart>
+static int64_t instanceTests, bottomNodesVisited;
+
+class CountedInstance : public TransformedPrimitive {
+public:
+  using TransformedPrimitive::TransformedPrimitive;
+
+  bool Intersect(const Ray& ray, SurfaceInteraction* isect) const override {
+    int64_t& nodes = CurrentThreadStats().counts[(int)Stat::BVHNodesVisited];
+    int64_t before = nodes;
+    bool hit = TransformedPrimitive::Intersect(ray, isect);
+    ++instanceTests;
+    bottomNodesVisited += nodes - before;
+    return hit;
+  }
+
+  bool IntersectP(const Ray& ray) const override {
+    int64_t& nodes = CurrentThreadStats().counts[(int)Stat::BVHShadowNodesVisited];
+    int64_t before = nodes;
+    bool hit = TransformedPrimitive::IntersectP(ray);
+    ++instanceTests;
+    bottomNodesVisited += nodes - before;
+    return hit;
+  }
+};
+
+int main(int argc, char* argv[]) {
+
+  std::string filename = argc > 1 ? argv[1] : "../scenes/geometry/sphere.ply";
+  int grid = argc > 2 ? std::atoi(argv[2]) : 20;
+  int nRays = argc > 3 ? std::atoi(argv[3]) : 1000000;
+  std::string cacheDir = argc > 4 ? argv[4] : "";
+
+  std::vector<Point3f> P;
+  std::vector<int> indices;
+  if (!ReadPly(filename, P, indices)) {
+    std::cerr << "bvhbench: couldn't read \"" << filename << "\"" << std::endl;
+    return 1;
+  }
+
+  ParallelInit();
+
+  // <instantiate grid^3 copies of the mesh as world space triangles>
+  Transform identity;
+  std::vector<std::shared_ptr<Primitive>> prims;
+  std::vector<std::shared_ptr<TriangleMesh>> meshes;
+  int nTriangles = (int)indices.size()/3;
+  for (int z = 0; z < grid; ++z)
+    for (int y = 0; y < grid; ++y)
+      for (int x = 0; x < grid; ++x) {
+        Transform toWorld = Translate(Vector3f(x, y, z));
+        std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
+            toWorld, nTriangles, indices.data(), (int)P.size(), P.data(),
+            nullptr, nullptr, nullptr, nullptr);
+        meshes.push_back(mesh);
+        for (int i = 0; i < nTriangles; ++i)
+          prims.push_back(std::make_shared<GeometricPrimitive>(
+              std::make_shared<Triangle>(&identity, &identity, false, mesh, i),
+              nullptr, nullptr, MediumInterface()));
+      }
+  std::cout << prims.size() << " triangles" << std::endl;
+
+  // <generate rays between random points around the scene bounds>
+  Bounds3f bounds;
+  for (const auto& p : prims) bounds = Union(bounds, p->WorldBound());
+  Vector3f pad = bounds.Diagonal()*Float(.25);
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<Float> u(0, 1);
+  auto randomPoint = [&](const Point3f& pMin, const Point3f& pMax) {
+    return Point3f(Lerp(u(rng), pMin.x, pMax.x), Lerp(u(rng), pMin.y, pMax.y),
+                   Lerp(u(rng), pMin.z, pMax.z));
+  };
+  std::vector<Ray> rays, shadowRays;
+  rays.reserve(nRays);
+  shadowRays.reserve(nRays);
+  for (int i = 0; i < nRays; ++i) {
+    Point3f o = randomPoint(bounds.pMin - pad, bounds.pMax + pad);
+    Point3f t = randomPoint(bounds.pMin, bounds.pMax);
+    rays.push_back(Ray(o, Normalize(t - o)));
+    // <shadow rays are finite segments between two points inside the scene>
+    Point3f s = randomPoint(bounds.pMin, bounds.pMax);
+    shadowRays.push_back(Ray(s, t - s, 1 - ShadowEpsilon));
+  }
+
+  auto seconds = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  };
+
+  // <build through the BVH cache: the first build may write it, the second loads it>
+  if (!cacheDir.empty()) {
+    PbrtOptions.bvhCacheDir = cacheDir;
+    for (int pass = 0; pass < 2; ++pass) {
+      auto t0 = std::chrono::steady_clock::now();
+      BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+      auto t1 = std::chrono::steady_clock::now();
+      std::printf("cached     build %7.1f ms (pass %d)\n", 1000*seconds(t1 - t0), pass);
+    }
+    PbrtOptions.bvhCacheDir.clear();
+  }
+
+  const BVHAccel::NodeLayout layouts[] = { BVHAccel::NodeLayout::Binary,
+      BVHAccel::NodeLayout::Wide4, BVHAccel::NodeLayout::Quantized,
+      BVHAccel::NodeLayout::Stackless };
+  struct Builder { const char* name; BVHAccel::SplitMethod splitMethod; int treeletPasses; };
+  const Builder builders[] = { {"sah", BVHAccel::SplitMethod::SAH, 0},
+      {"sbvh", BVHAccel::SplitMethod::SBVH, 0}, {"hlbvh", BVHAccel::SplitMethod::HLBVH, 0},
+      {"trbvh", BVHAccel::SplitMethod::HLBVH, 3} };
+  for (const Builder& builder : builders)
+  for (BVHAccel::NodeLayout layout : layouts) {
+    auto t0 = std::chrono::steady_clock::now();
+    BVHAccel bvh(prims, 4, builder.splitMethod, layout, .3f, builder.treeletPasses);
+    auto t1 = std::chrono::steady_clock::now();
+    ClearStats();
+
+    int nHits = 0;
+    for (const Ray& r : rays) {
+      Ray ray = r;
+      SurfaceInteraction isect;
+      if (bvh.Intersect(ray, &isect)) ++nHits;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    int nOccluded = 0;
+    for (const Ray& r : shadowRays)
+      if (bvh.IntersectP(r)) ++nOccluded;
+    auto t3 = std::chrono::steady_clock::now();
+
+    std::printf("%-5s %-10s nodes %8.2f MB  build %7.1f ms  Intersect %6.2f Mrays/s (%d hits)"
+        "  IntersectP %6.2f Mrays/s (%d occluded)\n",
+        builder.name, LayoutName(layout),
+        bvh.NodeMemoryUsage()/(1024.*1024.), 1000*seconds(t1 - t0),
+        nRays/(1e6*seconds(t2 - t1)), nHits, nRays/(1e6*seconds(t3 - t2)), nOccluded);
+    const BVHTreeStats &tree = bvh.TreeStats();
+    std::printf("      SAH cost %7.2f  overlap %6.3f  max depth %3d  per ray: nodes %6.1f"
+        " prims %5.1f  shadow nodes %6.1f prims %5.1f\n",
+        tree.sahCost, tree.overlap, (int)tree.leafDepths.size() - 1,
+        StatTotal(Stat::BVHNodesVisited)/(double)nRays,
+        StatTotal(Stat::BVHPrimitivesTested)/(double)nRays,
+        StatTotal(Stat::BVHShadowNodesVisited)/(double)nRays,
+        StatTotal(Stat::BVHShadowPrimitivesTested)/(double)nRays);
+  }
+
+  // <the kd-tree alternative, timed the same way>
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    KdTreeAccel kdtree(prims);
+    auto t1 = std::chrono::steady_clock::now();
+
+    int nHits = 0;
+    for (const Ray& r : rays) {
+      Ray ray = r;
+      SurfaceInteraction isect;
+      if (kdtree.Intersect(ray, &isect)) ++nHits;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    int nOccluded = 0;
+    for (const Ray& r : shadowRays)
+      if (kdtree.IntersectP(r)) ++nOccluded;
+    auto t3 = std::chrono::steady_clock::now();
+
+    std::printf("%-5s %-10s nodes %8.2f MB  build %7.1f ms  Intersect %6.2f Mrays/s (%d hits)"
+        "  IntersectP %6.2f Mrays/s (%d occluded)\n",
+        "kd", "kdtree", kdtree.MemoryUsage()/(1024.*1024.), 1000*seconds(t1 - t0),
+        nRays/(1e6*seconds(t2 - t1)), nHits, nRays/(1e6*seconds(t3 - t2)), nOccluded);
+  }
+
+  // <deform the meshes and refit, first a little, then moving some copies far>
+  {
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+    std::vector<Point3f> rest;
+    for (const auto& mesh : meshes)
+      rest.insert(rest.end(), mesh->p.get(), mesh->p.get() + mesh->nVertices);
+    struct Frame { const char* name; Float jitter; Float moved; };
+    const Frame frames[] = { {"wobble", .01f, 0}, {"scatter", .01f, .05f} };
+    for (const Frame& frame : frames) {
+      size_t v = 0;
+      for (const auto& mesh : meshes) {
+        Vector3f offset;
+        if (u(rng) < frame.moved)
+          offset = Vector3f(u(rng) - .5f, u(rng) - .5f, u(rng) - .5f)*Float(grid);
+        for (int i = 0; i < mesh->nVertices; ++i, ++v)
+          mesh->p[i] = rest[v] + offset + Vector3f(u(rng), u(rng), u(rng))*frame.jitter;
+      }
+      auto t0 = std::chrono::steady_clock::now();
+      bvh.Refit();
+      auto t1 = std::chrono::steady_clock::now();
+      BVHAccel rebuilt(prims, 4, BVHAccel::SplitMethod::SAH);
+      auto t2 = std::chrono::steady_clock::now();
+      std::printf("%-10s refit %7.1f ms (SAH cost x%.2f)  full build %7.1f ms\n", frame.name,
+          1000*seconds(t1 - t0), bvh.SAHCostGrowth(), 1000*seconds(t2 - t1));
+    }
+    size_t v = 0;
+    for (const auto& mesh : meshes)
+      for (int i = 0; i < mesh->nVertices; ++i) mesh->p[i] = rest[v++];
+  }
+
+  // <rebuild a quantized SBVH through Refit; its references must not pile up>
+  {
+    BVHAccel sbvh(prims, 4, BVHAccel::SplitMethod::SBVH, BVHAccel::NodeLayout::Quantized);
+    std::printf("sbvh rebuilds  primitive references %d", sbvh.TreeStats().nPrimitiveReferences);
+    for (int i = 0; i < 3; ++i) {
+      sbvh.Refit();
+      std::printf(" -> %d", sbvh.TreeStats().nPrimitiveReferences);
+    }
+    std::printf("  (%d primitives)\n", (int)prims.size());
+  }
+
+  // <build one bottom-level BVH and a top-level BVH over grid^3 instances of it>
+  auto t0 = std::chrono::steady_clock::now();
+  std::shared_ptr<TriangleMesh> objectMesh = std::make_shared<TriangleMesh>(
+      identity, nTriangles, indices.data(), (int)P.size(), P.data(),
+      nullptr, nullptr, nullptr, nullptr);
+  std::vector<std::shared_ptr<Primitive>> objectPrims;
+  for (int i = 0; i < nTriangles; ++i)
+    objectPrims.push_back(std::make_shared<GeometricPrimitive>(
+        std::make_shared<Triangle>(&identity, &identity, false, objectMesh, i),
+        nullptr, nullptr, MediumInterface()));
+  std::shared_ptr<Primitive> object =
+      std::make_shared<BVHAccel>(objectPrims, 4, BVHAccel::SplitMethod::SAH);
+  // AnimatedTransform keeps pointers, so instance transforms need stable storage
+  std::vector<Transform> instanceToWorld(grid*grid*grid);
+  std::vector<std::shared_ptr<CountedInstance>> instances;
+  std::vector<std::shared_ptr<Primitive>> instancePrims;
+  for (int z = 0; z < grid; ++z)
+    for (int y = 0; y < grid; ++y)
+      for (int x = 0; x < grid; ++x) {
+        Transform *toWorld = &instanceToWorld[(z*grid + y)*grid + x];
+        *toWorld = Translate(Vector3f(x, y, z));
+        instances.push_back(std::make_shared<CountedInstance>(
+            object, AnimatedTransform(toWorld, 0, toWorld, 1)));
+        instancePrims.push_back(instances.back());
+      }
+  BVHAccel topLevel(instancePrims, 1, BVHAccel::SplitMethod::SAH);
+  auto t1 = std::chrono::steady_clock::now();
+
+  int nHits = 0;
+  for (const Ray& r : rays) {
+    Ray ray = r;
+    SurfaceInteraction isect;
+    if (topLevel.Intersect(ray, &isect)) ++nHits;
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  int nOccluded = 0;
+  for (const Ray& r : shadowRays)
+    if (topLevel.IntersectP(r)) ++nOccluded;
+  auto t3 = std::chrono::steady_clock::now();
+
+  // <jitter every instance and refit the top level>
+  std::vector<Transform> movedToWorld(instanceToWorld.size());
+  for (size_t i = 0; i < instances.size(); ++i) {
+    movedToWorld[i] = Translate(Vector3f(u(rng) - .5f, u(rng) - .5f, u(rng) - .5f)*Float(.2))*
+        instanceToWorld[i];
+    instances[i]->SetPrimitiveToWorld(
+        AnimatedTransform(&movedToWorld[i], 0, &movedToWorld[i], 1));
+  }
+  auto t4 = std::chrono::steady_clock::now();
+  topLevel.Refit();
+  auto t5 = std::chrono::steady_clock::now();
+
+  InstanceMemoryStats stats = topLevel.InstanceMemoryUsage();
+  std::printf("instanced  top %8.2f MB  shared bottom %8.2f MB (%d objects)  flattened %8.2f MB"
+      "  (%d instances)\n", stats.topLevelBytes/(1024.*1024.),
+      stats.bottomLevelBytes/(1024.*1024.), stats.nObjects,
+      stats.flattenedBytes/(1024.*1024.), stats.nInstances);
+  std::printf("instanced  build %7.1f ms  refit %7.2f ms  Intersect %6.2f Mrays/s (%d hits)"
+      "  IntersectP %6.2f Mrays/s (%d occluded)\n", 1000*seconds(t1 - t0),
+      1000*seconds(t5 - t4), nRays/(1e6*seconds(t2 - t1)), nHits,
+      nRays/(1e6*seconds(t3 - t2)), nOccluded);
+
+  // <move and turn the instances over the shutter, with bounds over all of it or per
+  //  segment; at travel 1 an instance moves at most its own size, at travel 4 several
+  //  times it>
+  std::vector<Transform> closeToWorld(instances.size());
+  std::vector<Vector3f> travel(instances.size());
+  std::vector<Float> turn(instances.size());
+  for (size_t i = 0; i < instances.size(); ++i) {
+    travel[i] = Vector3f(u(rng) - .5f, u(rng) - .5f, u(rng) - .5f);
+    turn[i] = 90*u(rng);
+  }
+  std::vector<Ray> timedRays(rays), timedShadowRays(shadowRays);
+  for (int i = 0; i < nRays; ++i) {
+    timedRays[i].time = timedShadowRays[i].time = u(rng);
+  }
+  // <check the blurred BVHs on a subset of the rays against brute force over the
+  //  instances; two runs, so that nondeterministic motion bounds show up too>
+  const int nChecked = std::min(nRays, 10000);
+  auto bruteForce = [&](const Ray& r, bool occlusion, Float* tHit) {
+    Ray ray = r;
+    bool hit = false;
+    for (const auto& instance : instancePrims) {
+      Float b0, b1;
+      if (!instance->WorldBound().IntersectP(ray, &b0, &b1)) continue;
+      SurfaceInteraction isect;
+      if (occlusion ? instance->IntersectP(ray) : instance->Intersect(ray, &isect)) {
+        hit = true;
+        if (occlusion) break;
+      }
+    }
+    *tHit = ray.tMax;
+    return hit;
+  };
+  auto sameHit = [](bool hit0, Float t0, bool hit1, Float t1) {
+    return hit0 == hit1 && (!hit0 || std::abs(t0 - t1) <= 1e-5f*std::max(t0, t1));
+  };
+  for (Float travelScale : {Float(1), Float(4)}) {
+    for (size_t i = 0; i < instances.size(); ++i) {
+      closeToWorld[i] = Translate(travel[i]*travelScale)*movedToWorld[i]*
+          Rotate(turn[i], Vector3f(0, 1, 0));
+      instances[i]->SetPrimitiveToWorld(
+          AnimatedTransform(&movedToWorld[i], 0, &closeToWorld[i], 1));
+    }
+    for (int run = 0; run < 2; ++run) {
+      std::vector<char> bruteHit(nChecked), bruteOccluded(nChecked);
+      std::vector<Float> bruteT(nChecked);
+      for (int i = 0; i < nChecked; ++i) {
+        Float t;
+        bruteHit[i] = bruteForce(timedRays[i], false, &bruteT[i]);
+        bruteOccluded[i] = bruteForce(timedShadowRays[i], true, &t);
+      }
+      for (int motionSegments : {0, 4}) {
+        auto t0 = std::chrono::steady_clock::now();
+        BVHAccel blurred(instancePrims, 1, BVHAccel::SplitMethod::SAH,
+            BVHAccel::NodeLayout::Binary, .3f, 0, motionSegments);
+        auto t1 = std::chrono::steady_clock::now();
+        ClearStats();
+        instanceTests = bottomNodesVisited = 0;
+        int nHits = 0;
+        for (const Ray& r : timedRays) {
+          Ray ray = r;
+          SurfaceInteraction isect;
+          if (blurred.Intersect(ray, &isect)) ++nHits;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        double topNodes = (StatTotal(Stat::BVHNodesVisited) - bottomNodesVisited)/(double)nRays;
+        double tests = instanceTests/(double)nRays;
+        ClearStats();
+        instanceTests = bottomNodesVisited = 0;
+        int nOccluded = 0;
+        for (const Ray& r : timedShadowRays)
+          if (blurred.IntersectP(r)) ++nOccluded;
+        auto t3 = std::chrono::steady_clock::now();
+        double shadowTopNodes =
+            (StatTotal(Stat::BVHShadowNodesVisited) - bottomNodesVisited)/(double)nRays;
+        double shadowTests = instanceTests/(double)nRays;
+        int nMismatches = 0;
+        for (int i = 0; i < nChecked; ++i) {
+          Ray ray = timedRays[i];
+          SurfaceInteraction isect;
+          bool hit = blurred.Intersect(ray, &isect);
+          if (!sameHit(hit, ray.tMax, bruteHit[i], bruteT[i])) ++nMismatches;
+          if (blurred.IntersectP(timedShadowRays[i]) != (bool)bruteOccluded[i]) ++nMismatches;
+        }
+        std::printf("blur travel %g %d seg build %7.1f ms  Intersect %6.2f Mrays/s (%d hits)"
+            "  IntersectP %6.2f Mrays/s (%d occluded)  run %d: %d of %d rays differ"
+            " from brute force\n", travelScale, motionSegments, 1000*seconds(t1 - t0),
+            nRays/(1e6*seconds(t2 - t1)), nHits, nRays/(1e6*seconds(t3 - t2)), nOccluded,
+            run, nMismatches, 2*nChecked);
+        std::printf("      per ray: top-level nodes %6.1f instance tests %5.1f"
+            "  shadow top-level nodes %6.1f instance tests %5.1f\n",
+            topNodes, tests, shadowTopNodes, shadowTests);
+      }
+    }
+  }
+
+  ParallelCleanup();
+  return 0;
+}
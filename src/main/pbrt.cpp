@@ -12,6 +12,8 @@
 #include "perspective.h" // gkk
 #include "filter.h" // gkk
 #include "integrator.h"
+#include "parallel.h"
+#include "stats.h"
 #include "../integrators/directlighting.h"
 #include "texture.h" // gkk
 #include "../textures/constant.h" // gkk
@@ -21,6 +23,7 @@
 #include "../lights/point.h" // gkk
 #include "../shapes/triangle.h" // gkk
 #include "../accelerators/bvh.h" // gkk
+#include "../accelerators/kdtreeaccel.h"
 #include "../materials/matte.h" // gkk
 
 
@@ -109,7 +112,16 @@ Scene* buildScene() {
       shutterOpen, shutterClose, lensRadius, focalDistance, fov, film, medium);
 
 
-  std::shared_ptr<BVHAccel> aggregate(new BVHAccel(p, 12, BVHAccel::SplitMethod::HLBVH));
+  std::shared_ptr<Primitive> aggregate;
+  if (PbrtOptions.accelerator == "kdtree") {
+    aggregate = std::make_shared<KdTreeAccel>(p);
+  }
+  else {
+    if (PbrtOptions.accelerator != "bvh") {
+      Warning("Accelerator \"%s\" unknown. Using \"bvh\".", PbrtOptions.accelerator.c_str());
+    }
+    aggregate = std::make_shared<BVHAccel>(p, 12, BVHAccel::SplitMethod::HLBVH);
+  }
   Scene *scene = new Scene(aggregate, lights);
 
   return scene;
@@ -133,12 +145,17 @@ int main(int argc, char* argv[]) {
 //  // pbrtInit();
 //  PbrtOptions = options; // gkk
   
+  ParallelInit();
+
   // gkk---------------------------------------------------------------------
   Scene *scene = buildScene();
   std::cout << "yellow" << std::endl;
 
   std::shared_ptr<DirectLightingIntegrator> directli(new DirectLightingIntegrator());
   directli->Render(*scene);
+  if (PbrtOptions.printStats) {
+    PrintStats(stdout);
+  }
   //~gkk---------------------------------------------------------------------
 
 //  // <process scene description>
@@ -155,6 +172,7 @@ int main(int argc, char* argv[]) {
 //      }
 //  }
 //  // pbrtCleanup();
+  ParallelCleanup();
 
   return 0;
 }
@@ -54,7 +54,8 @@ bool Sphere::Intersect(const Ray& r, Float* tHit, SurfaceInteraction* isect,
     phi += 2*Pi;
 
   // <test sphere intersection against clipping parameters>
-  if ((zMin > -radius && pHit.z < zMin) || (zMax < radius && pHit.z > zMax)) {
+  if ((zMin > -radius && pHit.z < zMin) || (zMax < radius && pHit.z > zMax) ||
+      phi > phiMax) {
     if (tShapeHit == t1)
       return false;
     if (t1.UpperBound() > ray.tMax)
@@ -118,6 +119,7 @@ bool Sphere::Intersect(const Ray& r, Float* tHit, SurfaceInteraction* isect,
   *isect = (*objectToWorld)(SurfaceInteraction(pHit, pError, Point2f(u, v),
                                                -ray.d, dpdu, dpdv, dndu, dndv, ray.time, this));
   *tHit = (Float)tShapeHit;
+  return true;
 }
 
 bool Sphere::IntersectP(const Ray& r, bool testAlphaTexture) const {
@@ -129,9 +131,9 @@ bool Sphere::IntersectP(const Ray& r, bool testAlphaTexture) const {
   Vector3f oErr, dErr;
   Ray ray = (*worldToObject)(r, &oErr, &dErr);
 
-  // TODO <compute error bounds for sphere intersection 225>
-  EFloat ox(ray.o.x), oy(ray.o.y), oz(ray.o.z); // TODO
-  EFloat dx(ray.d.x), dy(ray.d.y), dz(ray.d.z); // TODO
+  // <compute error bounds for sphere intersection>
+  EFloat ox(ray.o.x, oErr.x), oy(ray.o.y, oErr.y), oz(ray.o.z, oErr.z);
+  EFloat dx(ray.d.x, dErr.x), dy(ray.d.y, dErr.y), dz(ray.d.z, dErr.z);
 
   // <compute quadratic sphere coefficients>
   EFloat a = dx*dx + dy*dy + dz*dz;
@@ -154,6 +156,11 @@ bool Sphere::IntersectP(const Ray& r, bool testAlphaTexture) const {
     }
   }
 
+  // <a full sphere is hit wherever the quadratic says so; skip the clipping tests>
+  if (zMin <= -radius && zMax >= radius && phiMax >= 2*Pi) {
+    return true;
+  }
+
   // <compute sphere hit position and phi>
   pHit = ray((Float)tShapeHit);
   // <refine sphere intersection point 225>
@@ -166,7 +173,8 @@ bool Sphere::IntersectP(const Ray& r, bool testAlphaTexture) const {
     phi += 2*Pi;
 
   // <test sphere intersection against clipping parameters>
-  if ((zMin > -radius && pHit.z < zMin) || (zMax < radius && pHit.z > zMax)) {
+  if ((zMin > -radius && pHit.z < zMin) || (zMax < radius && pHit.z > zMax) ||
+      phi > phiMax) {
     if (tShapeHit == t1)
       return false;
     if (t1.UpperBound() > ray.tMax)
@@ -23,7 +23,7 @@ public:
 
   bool Intersect(const Ray& r, Float* tHit, SurfaceInteraction* isect,
       bool testAlphaTexture) const;
-  bool IntersectP(const Ray& r, bool testAlphaTexture) const;
+  bool IntersectP(const Ray& r, bool testAlphaTexture = true) const;
 
   Float Area() const;
 
@@ -73,13 +73,8 @@ Bounds3f Triangle::WorldBound() const {
   return Union(Bounds3f(p0, p1), p2);
 }
 
-bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
-                         bool testAlphaTexture) const {
-
-  // <get triangle vertices in p0, p1, and p2>
-  const Point3f &p0 = mesh->p[v[0]];
-  const Point3f &p1 = mesh->p[v[1]];
-  const Point3f &p2 = mesh->p[v[2]];
+bool IntersectTriangle(const Point3f& p0, const Point3f& p1, const Point3f& p2,
+    const Ray& ray, Float* tHit, Float b[3]) {
 
   // <perform ray-triangle intersection test>
   // <transform triangle vertices to ray coordinate space>
@@ -148,9 +143,9 @@ bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
 
   // <compute barycentric coordinates and t value for triangle intersection>
   Float invDet = 1/det;
-  Float b0 = e0*invDet;
-  Float b1 = e1*invDet;
-  Float b2 = e2*invDet;
+  b[0] = e0*invDet;
+  b[1] = e1*invDet;
+  b[2] = e2*invDet;
   Float t = tScaled*invDet;
 
   // <ensure that computed triangle t is conservatively greater than zero>
@@ -173,6 +168,24 @@ bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
   if (t <= deltaT) {
     return false;
   }
+  *tHit = t;
+  return true;
+}
+
+bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
+                         bool testAlphaTexture) const {
+
+  // <get triangle vertices in p0, p1, and p2>
+  const Point3f &p0 = mesh->p[v[0]];
+  const Point3f &p1 = mesh->p[v[1]];
+  const Point3f &p2 = mesh->p[v[2]];
+
+  // <perform ray-triangle intersection test>
+  Float t, b[3];
+  if (!IntersectTriangle(p0, p1, p2, ray, &t, b)) {
+    return false;
+  }
+  Float b0 = b[0], b1 = b[1], b2 = b[2];
 
   // <compute triangle partial derivatives>
   Vector3f dpdu, dpdv;
@@ -284,6 +297,22 @@ bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
 }
 
 
+bool Triangle::IntersectP(const Ray& ray, bool testAlphaTexture) const {
+
+  // <alpha tests need the hit's uv; leave them to the full intersection>
+  if (testAlphaTexture && mesh->alphaMask) {
+    return Shape::IntersectP(ray, testAlphaTexture);
+  }
+
+  // <get triangle vertices in p0, p1, and p2>
+  const Point3f &p0 = mesh->p[v[0]];
+  const Point3f &p1 = mesh->p[v[1]];
+  const Point3f &p2 = mesh->p[v[2]];
+
+  Float t, b[3];
+  return IntersectTriangle(p0, p1, p2, ray, &t, b);
+}
+
 Float Triangle::Area() const {
 
   // <get triangle vertices in p0, p1, and p2>
@@ -2,6 +2,7 @@
 #define SHAPES_TRIANGLE_H
 
 #include <memory>
+#include <vector>
 
 #include "transform.h"
 #include "texture.h"
@@ -27,6 +28,11 @@ struct TriangleMesh {
   std::shared_ptr<Texture<Float>> alphaMask;
 };
 
+// Watertight ray-triangle test on world space vertices. On a hit, returns the
+// parametric distance in *tHit and the barycentrics of p0, p1, p2 in b.
+bool IntersectTriangle(const Point3f& p0, const Point3f& p1, const Point3f& p2,
+    const Ray& ray, Float* tHit, Float b[3]);
+
 class Triangle : public Shape {
 public:
   // <public methods>
@@ -47,9 +53,17 @@ public:
 
   virtual bool Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
                          bool testAlphaTexture = true) const override;
+  virtual bool IntersectP(const Ray& ray, bool testAlphaTexture = true) const override;
 
   virtual Float Area() const override;
 
+  void GetVertices(Point3f p[3]) const {
+    p[0] = mesh->p[v[0]];
+    p[1] = mesh->p[v[1]];
+    p[2] = mesh->p[v[2]];
+  }
+  bool HasAlphaMask() const { return (bool)mesh->alphaMask; }
+
 private:
   // <private methods>
   void GetUVs(Point2f uv[3]) const {